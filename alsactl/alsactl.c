@@ -46,6 +46,8 @@ int force_restore = 1;
 int ignore_nocards = 0;
 int do_lock = 0;
 int use_syslog = 0;
+int incremental_save = 0;
+int parallel_jobs = 1;
 char *command;
 char *statefile = NULL;
 char *lockfile = SYS_LOCKFILE;
@@ -76,6 +78,7 @@ static struct arg args[] = {
 { 'l', "lock", "use file locking to serialize concurrent access" },
 { 'L', "no-lock", "do not use file locking to serialize concurrent access" },
 { FILEARG | 'O', "lock-state-file", "state lock file path (default " SYS_LOCKFILE ")" },
+{ FILEARG | 'B', "binary", "binary state snapshot (store writes it, restore tries it first)" },
 { 'F', "force", "try to restore the matching controls as much as possible" },
 { 0, NULL, "  (default mode)" },
 { 'g', "ignore", "ignore 'No soundcards found' error" },
@@ -85,8 +88,10 @@ static struct arg args[] = {
 { FILEARG | 'r', "runstate", "save restore and init state to this file (only errors)" },
 { 0, NULL, "  default settings is 'no file set'" },
 { 'R', "remove", "remove runstate file at first, otherwise append errors" },
+{ INTARG | 'J', "jobs", "number of cards to save or restore in parallel" },
 { INTARG | 'p', "period", "store period in seconds for the daemon command" },
 { FILEARG | 'e', "pid-file", "pathname for the process id (daemon mode)" },
+{ 'j', "incremental", "daemon: refresh only the changed controls in the state" },
 { HEADER, NULL, "Available init options:" },
 { ENVARG | 'E', "env", "set environment variable for init phase (NAME=VALUE)" },
 { FILEARG | 'i', "initfile", "main configuation file for init phase" },
@@ -99,6 +104,9 @@ static struct arg args[] = {
 { 'D', "ucm-defaults", "execute also the UCM 'defaults' section" },
 { 'U', "no-ucm", "don't init with UCM" },
 #endif
+{ HEADER, NULL, "Available monitor options:" },
+{ FILEARG | 'M', "format", "event format: text (default), json or binary" },
+{ 'V', "values", "read the new values of the changed controls" },
 { HEADER, NULL, "Available commands:" },
 { CARDCMD, "store", "save current driver setup for one or each soundcards" },
 { EMPCMD, NULL, "  to configuration file" },
@@ -230,6 +238,9 @@ int main(int argc, char *argv[])
 	char *cfgfile = SYS_ASOUNDRC;
 	char *initfile = DATADIR "/init/00main";
 	char *pidfile = SYS_PIDFILE;
+	char *binfile = NULL;
+	int monitor_format = MONITOR_FORMAT_TEXT;
+	bool monitor_values = false;
 	char *cardname, ncardname[16];
 	char *cmd;
 	char *const *extra_args;
@@ -295,6 +306,9 @@ int main(int argc, char *argv[])
 		case 'O':
 			lockfile = optarg;
 			break;
+		case 'B':
+			binfile = optarg;
+			break;
 		case 'F':
 			force_restore = 1;
 			break;
@@ -339,6 +353,30 @@ int main(int argc, char *argv[])
 		case 'e':
 			pidfile = optarg;
 			break;
+		case 'j':
+			incremental_save = 1;
+			break;
+		case 'J':
+			parallel_jobs = atoi(optarg);
+			if (parallel_jobs < 1)
+				parallel_jobs = 1;
+			break;
+		case 'M':
+			if (!strcmp(optarg, "text")) {
+				monitor_format = MONITOR_FORMAT_TEXT;
+			} else if (!strcmp(optarg, "json")) {
+				monitor_format = MONITOR_FORMAT_JSON;
+			} else if (!strcmp(optarg, "binary")) {
+				monitor_format = MONITOR_FORMAT_BINARY;
+			} else {
+				fprintf(stderr, "unknown monitor format '%s'\n", optarg);
+				res = EXIT_FAILURE;
+				goto out;
+			}
+			break;
+		case 'V':
+			monitor_values = true;
+			break;
 		case 'b':
 			background = 1;
 			break;
@@ -424,12 +462,18 @@ int main(int argc, char *argv[])
 		snd_config_update_free_global();
 	} else if (!strcmp(cmd, "store")) {
 		res = save_state(cfgfile, cardname);
+		if (res >= 0 && binfile)
+			res = binstate_save(binfile, cfgfile, cardname);
 	} else if (!strcmp(cmd, "restore") ||
                    !strcmp(cmd, "rdaemon") ||
 		   !strcmp(cmd, "nrestore")) {
 		if (removestate)
 			remove(statefile);
-		res = load_state(cfgfile, initfile, initflags, cardname, init_fallback);
+		res = -ENOENT;
+		if (binfile)
+			res = binstate_load(binfile, cfgfile, initflags, cardname);
+		if (res < 0)
+			res = load_state(cfgfile, initfile, initflags, cardname, init_fallback);
 		if (!strcmp(cmd, "rdaemon")) {
 			do_nice(use_nice, sched_idle);
 			res = state_daemon(cfgfile, cardname, period, pidfile);
@@ -442,7 +486,7 @@ int main(int argc, char *argv[])
 	} else if (!strcmp(cmd, "kill")) {
 		res = state_daemon_kill(pidfile, cardname);
 	} else if (!strcmp(cmd, "monitor")) {
-		res = monitor(cardname);
+		res = monitor(cardname, monitor_format, monitor_values);
 	} else if (!strcmp(cmd, "clean")) {
 		res = clean(cardname, extra_args);
 	} else if (!strcmp(cmd, "dump-state")) {
@@ -6,6 +6,8 @@ extern int force_restore;
 extern int ignore_nocards;
 extern int do_lock;
 extern int use_syslog;
+extern int incremental_save;
+extern int parallel_jobs;
 extern char *command;
 extern char *statefile;
 extern char *lockfile;
@@ -51,10 +53,60 @@ int init_ucm(int flags, int cardno);
 int state_lock(const char *file, int timeout);
 int state_unlock(int fd, const char *file);
 int save_state(const char *file, const char *cardname);
+int state_snapshot(const char *file, const char *cardname, snd_config_t **top);
+int state_snapshot_card(snd_config_t *top, int cardno);
+int state_snapshot_control(snd_config_t *top, const char *cardid,
+			   snd_ctl_t *handle, snd_ctl_elem_id_t *id);
+int state_snapshot_save(const char *file, snd_config_t *top);
+int binstate_save(const char *binfile, const char *textfile,
+		  const char *cardname);
+int binstate_load(const char *binfile, const char *textfile, int initflags,
+		  const char *cardname);
+
+/*
+ * index of the live elements of a card, read with a single element list
+ * and hashed both by numid and by the full element id, so the saved
+ * controls are matched without probing the driver for each of them
+ */
+struct elem_index {
+	snd_ctl_elem_list_t *list;
+	unsigned int count;
+	unsigned int size;		/* power of two */
+	unsigned int *by_numid;		/* list position + 1, 0 = empty */
+	unsigned int *by_id;
+};
+
+/* batched control writes, see batch.c */
+struct ctl_batch {
+	struct ctl_batch_entry *entries;
+	unsigned int used;
+	unsigned int size;
+	unsigned int written;
+	unsigned int skipped;		/* already had the value */
+};
+
+void ctl_batch_init(struct ctl_batch *batch);
+void ctl_batch_free(struct ctl_batch *batch);
+int ctl_batch_add(struct ctl_batch *batch, snd_ctl_elem_info_t *info,
+		  snd_ctl_elem_value_t *value);
+int ctl_batch_commit(struct ctl_batch *batch, snd_ctl_t *handle);
+int ctl_value_equal(snd_ctl_elem_type_t type, unsigned int count,
+		    const snd_ctl_elem_value_t *a, const snd_ctl_elem_value_t *b);
+
+int elem_index_build(snd_ctl_t *handle, struct elem_index *e);
+void elem_index_free(struct elem_index *e);
+int elem_index_has_numid(struct elem_index *e, unsigned int numid);
+unsigned int elem_index_find(struct elem_index *e, int iface,
+			     long device, long subdevice,
+			     const char *name, long index);
 int load_state(const char *file, const char *initfile, int initflags,
 	       const char *cardname, int do_init);
 int power(const char *argv[], int argc);
-int monitor(const char *name);
+#define MONITOR_FORMAT_TEXT	0
+#define MONITOR_FORMAT_JSON	1
+#define MONITOR_FORMAT_BINARY	2
+
+int monitor(const char *name, int format, bool values);
 int state_daemon(const char *file, const char *cardname, int period,
 		 const char *pidfile);
 int state_daemon_kill(const char *pidfile, const char *cmd);
@@ -66,6 +118,7 @@ int file_map(const char *filename, char **buf, size_t *bufsize);
 void file_unmap(void *buf, size_t bufsize);
 size_t line_width(const char *buf, size_t bufsize, size_t pos);
 void initfailed(int cardnumber, const char *reason, int exitcode);
+void run_jobs(int count, int nthreads, void (*fn)(void *data, int idx), void *data);
 
 static inline int hextodigit(int c)
 {
@@ -0,0 +1,195 @@
+/*
+ *  Advanced Linux Sound Architecture Control Program - batched writes
+ *  Copyright (c) 2026 by agent <agent@local>
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "aconfig.h"
+#include <stdio.h>
+#include <errno.h>
+#include "alsactl.h"
+
+/*
+ * The values to restore are queued first and written in one pass:
+ * elements which already hold the value are skipped, and the writes are
+ * ordered enums, switches, volumes and the rest, so the routing is set
+ * before the levels which depend on it.
+ */
+
+struct ctl_batch_entry {
+	snd_ctl_elem_id_t *id;
+	snd_ctl_elem_value_t *value;
+	snd_ctl_elem_type_t type;
+	unsigned int count;
+	unsigned int seq;
+};
+
+static int batch_class(snd_ctl_elem_type_t type)
+{
+	switch (type) {
+	case SND_CTL_ELEM_TYPE_ENUMERATED:
+		return 0;
+	case SND_CTL_ELEM_TYPE_BOOLEAN:
+		return 1;
+	case SND_CTL_ELEM_TYPE_INTEGER:
+	case SND_CTL_ELEM_TYPE_INTEGER64:
+		return 2;
+	default:
+		return 3;
+	}
+}
+
+static int batch_compare(const void *a, const void *b)
+{
+	const struct ctl_batch_entry *e1 = a, *e2 = b;
+	int c1 = batch_class(e1->type), c2 = batch_class(e2->type);
+
+	if (c1 != c2)
+		return c1 - c2;
+	return e1->seq < e2->seq ? -1 : e1->seq > e2->seq;
+}
+
+int ctl_value_equal(snd_ctl_elem_type_t type, unsigned int count,
+		    const snd_ctl_elem_value_t *a, const snd_ctl_elem_value_t *b)
+{
+	snd_aes_iec958_t i1, i2;
+	unsigned int idx;
+
+	for (idx = 0; idx < count; idx++) {
+		switch (type) {
+		case SND_CTL_ELEM_TYPE_BOOLEAN:
+			if (snd_ctl_elem_value_get_boolean(a, idx) !=
+			    snd_ctl_elem_value_get_boolean(b, idx))
+				return 0;
+			break;
+		case SND_CTL_ELEM_TYPE_INTEGER:
+			if (snd_ctl_elem_value_get_integer(a, idx) !=
+			    snd_ctl_elem_value_get_integer(b, idx))
+				return 0;
+			break;
+		case SND_CTL_ELEM_TYPE_INTEGER64:
+			if (snd_ctl_elem_value_get_integer64(a, idx) !=
+			    snd_ctl_elem_value_get_integer64(b, idx))
+				return 0;
+			break;
+		case SND_CTL_ELEM_TYPE_ENUMERATED:
+			if (snd_ctl_elem_value_get_enumerated(a, idx) !=
+			    snd_ctl_elem_value_get_enumerated(b, idx))
+				return 0;
+			break;
+		case SND_CTL_ELEM_TYPE_BYTES:
+			if (snd_ctl_elem_value_get_byte(a, idx) !=
+			    snd_ctl_elem_value_get_byte(b, idx))
+				return 0;
+			break;
+		case SND_CTL_ELEM_TYPE_IEC958:
+			snd_ctl_elem_value_get_iec958(a, &i1);
+			snd_ctl_elem_value_get_iec958(b, &i2);
+			return memcmp(&i1, &i2, sizeof(i1)) == 0;
+		default:
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void ctl_batch_init(struct ctl_batch *batch)
+{
+	memset(batch, 0, sizeof(*batch));
+}
+
+void ctl_batch_free(struct ctl_batch *batch)
+{
+	unsigned int i;
+
+	for (i = 0; i < batch->used; i++) {
+		snd_ctl_elem_id_free(batch->entries[i].id);
+		snd_ctl_elem_value_free(batch->entries[i].value);
+	}
+	free(batch->entries);
+	batch->entries = NULL;
+	batch->used = batch->size = 0;
+}
+
+int ctl_batch_add(struct ctl_batch *batch, snd_ctl_elem_info_t *info,
+		  snd_ctl_elem_value_t *value)
+{
+	struct ctl_batch_entry *e;
+	unsigned int size;
+	int err;
+
+	if (batch->used == batch->size) {
+		size = batch->size ? batch->size * 2 : 64;
+		e = realloc(batch->entries, size * sizeof(*e));
+		if (e == NULL)
+			return -ENOMEM;
+		batch->entries = e;
+		batch->size = size;
+	}
+	e = &batch->entries[batch->used];
+	err = snd_ctl_elem_id_malloc(&e->id);
+	if (err < 0)
+		return err;
+	err = snd_ctl_elem_value_malloc(&e->value);
+	if (err < 0) {
+		snd_ctl_elem_id_free(e->id);
+		return err;
+	}
+	snd_ctl_elem_info_get_id(info, e->id);
+	snd_ctl_elem_value_copy(e->value, value);
+	e->type = snd_ctl_elem_info_get_type(info);
+	e->count = snd_ctl_elem_info_get_count(info);
+	e->seq = batch->used++;
+	return 0;
+}
+
+int ctl_batch_commit(struct ctl_batch *batch, snd_ctl_t *handle)
+{
+	struct ctl_batch_entry *e;
+	snd_ctl_elem_value_t *cur;
+	unsigned int i;
+	int err, res = 0;
+	snd_ctl_elem_value_alloca(&cur);
+
+	qsort(batch->entries, batch->used, sizeof(*batch->entries), batch_compare);
+	for (i = 0; i < batch->used; i++) {
+		e = &batch->entries[i];
+		snd_ctl_elem_value_set_id(cur, e->id);
+		if (snd_ctl_elem_read(handle, cur) >= 0 &&
+		    ctl_value_equal(e->type, e->count, cur, e->value)) {
+			batch->skipped++;
+			continue;
+		}
+		err = snd_ctl_elem_write(handle, e->value);
+		if (err < 0) {
+			error("Cannot write control '%d:%d:%d:%s:%d' : %s",
+			      (int)snd_ctl_elem_id_get_interface(e->id),
+			      snd_ctl_elem_id_get_device(e->id),
+			      snd_ctl_elem_id_get_subdevice(e->id),
+			      snd_ctl_elem_id_get_name(e->id),
+			      snd_ctl_elem_id_get_index(e->id),
+			      snd_strerror(err));
+			res = err;
+			if (!force_restore)
+				break;
+			continue;
+		}
+		batch->written++;
+	}
+	return res;
+}
@@ -0,0 +1,550 @@
+/*
+ *  Advanced Linux Sound Architecture Control Program - binary state
+ *  Copyright (c) 2026 by agent <agent@local>
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "aconfig.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "alsactl.h"
+
+/*
+ * The binary snapshot keeps the values of the writable controls as they
+ * were at store time, so restore can write them without parsing the text
+ * state. It is bound to the text file by its size and mtime and to each
+ * card by the element list; any mismatch makes it stale and the caller
+ * falls back to the text file.
+ */
+
+#define BSTATE_MAGIC	"ALSB"
+#define BSTATE_VERSION	1
+
+struct bstate_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t size;		/* whole file */
+	uint32_t checksum;	/* FNV-1a of the data after the header */
+	int64_t text_mtime;
+	int64_t text_size;
+	uint32_t cards;
+	uint32_t reserved;
+};
+
+struct bstate_card {
+	char id[32];
+	uint32_t elems;		/* records which follow */
+	uint32_t total;		/* elements of the card */
+};
+
+struct bstate_elem {
+	uint32_t numid;
+	int32_t iface;
+	uint32_t device;
+	uint32_t subdevice;
+	uint32_t index;
+	uint32_t type;
+	uint32_t count;
+	uint32_t size;		/* value bytes which follow */
+	char name[44];
+	uint32_t reserved;
+};
+
+struct bbuf {
+	char *data;
+	size_t len;
+	size_t alloc;
+};
+
+static uint32_t bstate_checksum(const char *data, size_t size)
+{
+	uint32_t h = 2166136261U;
+
+	while (size--)
+		h = (h ^ (unsigned char)*data++) * 16777619U;
+	return h;
+}
+
+/* value bytes of an element, 0 for the unsupported types */
+static uint32_t bstate_value_size(unsigned int type, unsigned int count)
+{
+	size_t size;
+
+	switch (type) {
+	case SND_CTL_ELEM_TYPE_BOOLEAN:
+	case SND_CTL_ELEM_TYPE_INTEGER:
+	case SND_CTL_ELEM_TYPE_ENUMERATED:
+	case SND_CTL_ELEM_TYPE_INTEGER64:
+		size = count * sizeof(int64_t);
+		break;
+	case SND_CTL_ELEM_TYPE_BYTES:
+		size = count;
+		break;
+	case SND_CTL_ELEM_TYPE_IEC958:
+		size = sizeof(snd_aes_iec958_t);
+		break;
+	default:
+		return 0;
+	}
+	return (size + 7) & ~7;
+}
+
+/* returns the offset of a zeroed area of size bytes or -ENOMEM */
+static long bbuf_add(struct bbuf *b, size_t size)
+{
+	size_t off = b->len;
+	char *n;
+
+	if (b->len + size > b->alloc) {
+		b->alloc = b->alloc ? b->alloc * 2 : 4096;
+		while (b->len + size > b->alloc)
+			b->alloc *= 2;
+		n = realloc(b->data, b->alloc);
+		if (n == NULL)
+			return -ENOMEM;
+		b->data = n;
+	}
+	memset(b->data + off, 0, size);
+	b->len += size;
+	return off;
+}
+
+static int bstate_save_card(struct bbuf *b, int cardno)
+{
+	snd_ctl_t *handle;
+	snd_ctl_card_info_t *cinfo;
+	snd_ctl_elem_list_t *list;
+	snd_ctl_elem_id_t *id;
+	snd_ctl_elem_info_t *info;
+	snd_ctl_elem_value_t *val;
+	struct bstate_card *card;
+	struct bstate_elem *e;
+	int64_t *v;
+	unsigned int i, idx, count, type, elems = 0, total;
+	uint32_t size;
+	long off, coff;
+	char name[32];
+	int err;
+	snd_ctl_card_info_alloca(&cinfo);
+	snd_ctl_elem_list_alloca(&list);
+	snd_ctl_elem_id_alloca(&id);
+	snd_ctl_elem_info_alloca(&info);
+	snd_ctl_elem_value_alloca(&val);
+
+	sprintf(name, "hw:%d", cardno);
+	err = snd_ctl_open(&handle, name, SND_CTL_READONLY);
+	if (err < 0) {
+		error("snd_ctl_open error: %s", snd_strerror(err));
+		return err;
+	}
+	err = snd_ctl_card_info(handle, cinfo);
+	if (err < 0)
+		goto _close;
+	err = snd_ctl_elem_list(handle, list);
+	if (err < 0)
+		goto _close;
+	total = snd_ctl_elem_list_get_count(list);
+	if (total > 0) {
+		err = snd_ctl_elem_list_alloc_space(list, total);
+		if (err < 0)
+			goto _close;
+		err = snd_ctl_elem_list(handle, list);
+		if (err < 0)
+			goto _free;
+		total = snd_ctl_elem_list_get_used(list);
+	}
+	coff = bbuf_add(b, sizeof(*card));
+	if (coff < 0) {
+		err = coff;
+		goto _free;
+	}
+	for (i = 0; i < total; i++) {
+		snd_ctl_elem_list_get_id(list, i, id);
+		snd_ctl_elem_info_set_id(info, id);
+		err = snd_ctl_elem_info(handle, info);
+		if (err < 0)
+			goto _free;
+		if (!snd_ctl_elem_info_is_readable(info) ||
+		    !snd_ctl_elem_info_is_writable(info) ||
+		    snd_ctl_elem_info_is_inactive(info))
+			continue;
+		type = snd_ctl_elem_info_get_type(info);
+		count = snd_ctl_elem_info_get_count(info);
+		size = bstate_value_size(type, count);
+		if (size == 0)
+			continue;
+		snd_ctl_elem_value_set_id(val, id);
+		err = snd_ctl_elem_read(handle, val);
+		if (err < 0)
+			goto _free;
+		off = bbuf_add(b, sizeof(*e) + size);
+		if (off < 0) {
+			err = off;
+			goto _free;
+		}
+		e = (struct bstate_elem *)(b->data + off);
+		e->numid = snd_ctl_elem_id_get_numid(id);
+		e->iface = snd_ctl_elem_id_get_interface(id);
+		e->device = snd_ctl_elem_id_get_device(id);
+		e->subdevice = snd_ctl_elem_id_get_subdevice(id);
+		e->index = snd_ctl_elem_id_get_index(id);
+		e->type = type;
+		e->count = count;
+		e->size = size;
+		snprintf(e->name, sizeof(e->name), "%s", snd_ctl_elem_id_get_name(id));
+		v = (int64_t *)(e + 1);
+		for (idx = 0; idx < count; idx++) {
+			switch (type) {
+			case SND_CTL_ELEM_TYPE_BOOLEAN:
+				v[idx] = snd_ctl_elem_value_get_boolean(val, idx);
+				break;
+			case SND_CTL_ELEM_TYPE_INTEGER:
+				v[idx] = snd_ctl_elem_value_get_integer(val, idx);
+				break;
+			case SND_CTL_ELEM_TYPE_ENUMERATED:
+				v[idx] = snd_ctl_elem_value_get_enumerated(val, idx);
+				break;
+			case SND_CTL_ELEM_TYPE_INTEGER64:
+				v[idx] = snd_ctl_elem_value_get_integer64(val, idx);
+				break;
+			default:
+				break;
+			}
+		}
+		if (type == SND_CTL_ELEM_TYPE_BYTES)
+			memcpy(v, snd_ctl_elem_value_get_bytes(val), count);
+		else if (type == SND_CTL_ELEM_TYPE_IEC958)
+			snd_ctl_elem_value_get_iec958(val, (snd_aes_iec958_t *)v);
+		elems++;
+	}
+	card = (struct bstate_card *)(b->data + coff);
+	snprintf(card->id, sizeof(card->id), "%s", snd_ctl_card_info_get_id(cinfo));
+	card->elems = elems;
+	card->total = total;
+	err = 0;
+ _free:
+	snd_ctl_elem_list_free_space(list);
+ _close:
+	snd_ctl_close(handle);
+	return err;
+}
+
+int binstate_save(const char *binfile, const char *textfile,
+		  const char *cardname)
+{
+	struct snd_card_iterator iter;
+	struct bstate_header *hdr;
+	struct bbuf b = { NULL, 0, 0 };
+	struct stat st;
+	char *nfile = NULL;
+	size_t pos;
+	ssize_t r;
+	int fd, err, cards = 0;
+
+	if (stat(textfile, &st) < 0) {
+		err = -errno;
+		error("Cannot stat %s: %s", textfile, strerror(errno));
+		return err;
+	}
+	err = bbuf_add(&b, sizeof(*hdr));
+	if (err < 0)
+		goto out;
+	err = snd_card_iterator_sinit(&iter, cardname);
+	if (err < 0)
+		goto out;
+	while (snd_card_iterator_next(&iter)) {
+		err = bstate_save_card(&b, iter.card);
+		if (err < 0)
+			goto out;
+		cards++;
+	}
+	hdr = (struct bstate_header *)b.data;
+	memcpy(hdr->magic, BSTATE_MAGIC, sizeof(hdr->magic));
+	hdr->version = BSTATE_VERSION;
+	hdr->size = b.len;
+	hdr->checksum = bstate_checksum(b.data + sizeof(*hdr), b.len - sizeof(*hdr));
+	hdr->text_mtime = st.st_mtime;
+	hdr->text_size = st.st_size;
+	hdr->cards = cards;
+
+	nfile = malloc(strlen(binfile) + 5);
+	if (nfile == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+	strcpy(nfile, binfile);
+	strcat(nfile, ".new");
+	fd = open(nfile, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0) {
+		err = -errno;
+		error("Cannot open %s for writing: %s", nfile, strerror(errno));
+		goto out;
+	}
+	for (pos = 0; pos < b.len; pos += r) {
+		r = write(fd, b.data + pos, b.len - pos);
+		if (r < 0 && errno == EINTR) {
+			r = 0;
+			continue;
+		}
+		if (r <= 0) {
+			err = r < 0 ? -errno : -EIO;
+			error("Cannot write %s: %s", nfile, strerror(-err));
+			close(fd);
+			unlink(nfile);
+			goto out;
+		}
+	}
+	close(fd);
+	if (rename(nfile, binfile) < 0) {
+		err = -errno;
+		error("rename failed: %s (%s)", strerror(errno), binfile);
+		unlink(nfile);
+		goto out;
+	}
+	err = 0;
+out:
+	free(nfile);
+	free(b.data);
+	return err;
+}
+
+/* checks the structure of a card section, returns the next one or NULL */
+static const struct bstate_card *bstate_check_card(const struct bstate_card *card,
+						    const char *end)
+{
+	const struct bstate_elem *e;
+	const char *pos;
+	unsigned int i;
+
+	if ((const char *)(card + 1) > end ||
+	    memchr(card->id, 0, sizeof(card->id)) == NULL)
+		return NULL;
+	pos = (const char *)(card + 1);
+	for (i = 0; i < card->elems; i++) {
+		e = (const struct bstate_elem *)pos;
+		if ((const char *)(e + 1) > end ||
+		    memchr(e->name, 0, sizeof(e->name)) == NULL ||
+		    e->size == 0 ||
+		    e->size != bstate_value_size(e->type, e->count) ||
+		    e->size > (size_t)(end - (const char *)(e + 1)))
+			return NULL;
+		pos = (const char *)(e + 1) + e->size;
+	}
+	return (const struct bstate_card *)pos;
+}
+
+static int bstate_apply_elem(snd_ctl_t *handle, const struct bstate_elem *e)
+{
+	snd_ctl_elem_value_t *val;
+	const int64_t *v = (const int64_t *)(e + 1);
+	unsigned int idx;
+	snd_ctl_elem_value_alloca(&val);
+
+	snd_ctl_elem_value_set_numid(val, e->numid);
+	for (idx = 0; idx < e->count; idx++) {
+		switch (e->type) {
+		case SND_CTL_ELEM_TYPE_BOOLEAN:
+			snd_ctl_elem_value_set_boolean(val, idx, v[idx]);
+			break;
+		case SND_CTL_ELEM_TYPE_INTEGER:
+			snd_ctl_elem_value_set_integer(val, idx, v[idx]);
+			break;
+		case SND_CTL_ELEM_TYPE_ENUMERATED:
+			snd_ctl_elem_value_set_enumerated(val, idx, v[idx]);
+			break;
+		case SND_CTL_ELEM_TYPE_INTEGER64:
+			snd_ctl_elem_value_set_integer64(val, idx, v[idx]);
+			break;
+		case SND_CTL_ELEM_TYPE_BYTES:
+			snd_ctl_elem_value_set_byte(val, idx, ((const unsigned char *)v)[idx]);
+			break;
+		default:
+			break;
+		}
+	}
+	if (e->type == SND_CTL_ELEM_TYPE_IEC958)
+		snd_ctl_elem_value_set_iec958(val, (const snd_aes_iec958_t *)v);
+	return snd_ctl_elem_write(handle, val);
+}
+
+struct bstate_live {
+	int card;
+	snd_ctl_t *handle;
+	const struct bstate_card *section;
+};
+
+/* matches a card section against the live elements */
+static int bstate_check_live(struct bstate_live *l)
+{
+	struct elem_index elems;
+	const struct bstate_elem *e;
+	const char *pos;
+	unsigned int i;
+	int err = 0;
+
+	err = elem_index_build(l->handle, &elems);
+	if (err < 0)
+		return err;
+	if (elems.count != l->section->total) {
+		dbg("binary state: element count mismatch for card %s",
+		    l->section->id);
+		err = -ESTALE;
+		goto out;
+	}
+	pos = (const char *)(l->section + 1);
+	for (i = 0; i < l->section->elems; i++) {
+		e = (const struct bstate_elem *)pos;
+		if (elem_index_find(&elems, e->iface, e->device, e->subdevice,
+				    e->name, e->index) != e->numid) {
+			dbg("binary state: control #%u changed for card %s",
+			    e->numid, l->section->id);
+			err = -ESTALE;
+			goto out;
+		}
+		pos = (const char *)(e + 1) + e->size;
+	}
+out:
+	elem_index_free(&elems);
+	return err;
+}
+
+int binstate_load(const char *binfile, const char *textfile, int initflags,
+		  const char *cardname)
+{
+	struct snd_card_iterator iter;
+	const struct bstate_header *hdr;
+	const struct bstate_card *card, **sections = NULL;
+	const struct bstate_elem *e;
+	struct bstate_live *live = NULL, *l;
+	snd_ctl_card_info_t *info;
+	struct stat st;
+	const char *pos, *end;
+	char *buf = NULL, name[32];
+	size_t size = 0;
+	unsigned int i, j;
+	int err, count = 0;
+	snd_ctl_card_info_alloca(&info);
+
+	if (!strcmp(textfile, "-"))
+		return -EINVAL;
+	if (file_map(binfile, &buf, &size) < 0)
+		return -ENOENT;
+	hdr = (const struct bstate_header *)buf;
+	end = buf + size;
+	err = -ESTALE;
+	if (size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, BSTATE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != BSTATE_VERSION || hdr->size != size ||
+	    hdr->checksum != bstate_checksum(buf + sizeof(*hdr), size - sizeof(*hdr))) {
+		dbg("binary state: %s is invalid", binfile);
+		goto out;
+	}
+	if (stat(textfile, &st) < 0 ||
+	    hdr->text_mtime != st.st_mtime || hdr->text_size != st.st_size) {
+		dbg("binary state: %s is older than %s", binfile, textfile);
+		goto out;
+	}
+	sections = calloc(hdr->cards + 1, sizeof(*sections));
+	if (sections == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+	card = (const struct bstate_card *)(buf + sizeof(*hdr));
+	for (i = 0; i < hdr->cards; i++) {
+		sections[i] = card;
+		card = bstate_check_card(card, end);
+		if (card == NULL) {
+			dbg("binary state: %s is corrupted", binfile);
+			goto out;
+		}
+	}
+
+	/* every card must match before anything is written */
+	err = snd_card_iterator_sinit(&iter, cardname);
+	if (err < 0)
+		goto out;
+	while (snd_card_iterator_next(&iter)) {
+		l = realloc(live, (count + 1) * sizeof(*live));
+		if (l == NULL) {
+			err = -ENOMEM;
+			goto out;
+		}
+		live = l;
+		l += count++;
+		l->card = iter.card;
+		l->section = NULL;
+		sprintf(name, "hw:%d", iter.card);
+		err = snd_ctl_open(&l->handle, name, 0);
+		if (err < 0) {
+			l->handle = NULL;
+			goto out;
+		}
+		err = snd_ctl_card_info(l->handle, info);
+		if (err < 0)
+			goto out;
+		for (i = 0; i < hdr->cards; i++) {
+			if (!strcmp(sections[i]->id, snd_ctl_card_info_get_id(info))) {
+				l->section = sections[i];
+				break;
+			}
+		}
+		if (l->section == NULL) {
+			dbg("binary state: no state for card %s",
+			    snd_ctl_card_info_get_id(info));
+			err = -ESTALE;
+			goto out;
+		}
+		err = bstate_check_live(l);
+		if (err < 0)
+			goto out;
+	}
+	err = snd_card_iterator_error(&iter);
+	if (err < 0)
+		goto out;
+
+	for (i = 0; i < (unsigned int)count; i++) {
+		l = &live[i];
+		/* error is ignored */
+		init_ucm(initflags | FLAG_UCM_FBOOT, l->card);
+		pos = (const char *)(l->section + 1);
+		for (j = 0; j < l->section->elems; j++) {
+			e = (const struct bstate_elem *)pos;
+			err = bstate_apply_elem(l->handle, e);
+			if (err < 0) {
+				error("Cannot write control #%u: %s",
+				      e->numid, snd_strerror(err));
+				goto out;
+			}
+			pos = (const char *)(e + 1) + e->size;
+		}
+	}
+	err = 0;
+out:
+	for (i = 0; i < (unsigned int)count; i++) {
+		if (live[i].handle)
+			snd_ctl_close(live[i].handle);
+	}
+	free(live);
+	free(sections);
+	file_unmap(buf, size);
+	return err;
+}
@@ -29,25 +29,42 @@
 #include <signal.h>
 #include <time.h>
 #include <poll.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
 #include "alsactl.h"
 
+/*
+ * set of element numids (which are unique per card and reported by every
+ * event), kept as an open addressing hash table which grows by doubling
+ */
+#define ID_LIST_EMPTY	0
+#define ID_LIST_DELETED	(~0U)
+
 struct id_list {
-	snd_ctl_elem_id_t **list;
-	int size;
+	unsigned int *numids;
+	unsigned int size;	/* power of two */
+	unsigned int used;	/* including deleted slots */
 };
 
 struct card {
 	int index;
 	int pfds;
+	char *id;
 	snd_ctl_t *handle;
 	struct id_list whitelist;
 	struct id_list blacklist;
+	struct id_list dirty;	/* changed since the last incremental save */
+	int full;		/* not in the snapshot yet */
 };
 
 static int quit = 0;
 static int rescan = 0;
 static int save_now = 0;
 
+/* epoll tag of the inotify descriptor, the cards use their own pointer */
+static int hotplug_tag;
+
 static void signal_handler_quit(int sig)
 {
 	quit = 1;
@@ -68,30 +85,77 @@ static void signal_handler_rescan(int sig)
 
 static void free_list(struct id_list *list)
 {
-	int i;
+	free(list->numids);
+}
+
+static void clear_list(struct id_list *list)
+{
+	if (list->size)
+		memset(list->numids, 0, list->size * sizeof(*list->numids));
+	list->used = 0;
+}
+
+static void card_unwatch(struct card *card, int epfd)
+{
+	struct pollfd *pfd;
+	int i, k;
 
-	for (i = 0; i < list->size; i++)
-		free(list->list[i]);
-	free(list->list);
+	if (card->pfds <= 0)
+		return;
+	pfd = alloca(sizeof(*pfd) * card->pfds);
+	k = snd_ctl_poll_descriptors(card->handle, pfd, card->pfds);
+	for (i = 0; i < k; i++)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, pfd[i].fd, NULL);
 }
 
-static void card_free(struct card **card)
+static int card_watch(struct card *card, int epfd)
+{
+	struct epoll_event ev;
+	struct pollfd *pfd;
+	int i, k;
+
+	pfd = alloca(sizeof(*pfd) * card->pfds);
+	k = snd_ctl_poll_descriptors(card->handle, pfd, card->pfds);
+	if (k != card->pfds) {
+		error("poll prepare failed: %i", k);
+		return -EIO;
+	}
+	for (i = 0; i < k; i++) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = card;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, pfd[i].fd, &ev) < 0) {
+			error("epoll_ctl failed: %s", strerror(errno));
+			return -errno;
+		}
+	}
+	return 0;
+}
+
+static void card_free(struct card **card, int epfd)
 {
 	struct card *c = *card;
 
+	if (c->handle && epfd >= 0)
+		card_unwatch(c, epfd);
+
+	free_list(&c->dirty);
 	free_list(&c->blacklist);
 	free_list(&c->whitelist);
 	if (c->handle)
 		snd_ctl_close(c->handle);
+	free(c->id);
 	free(c);
 	*card = NULL;
 }
 
-static void add_card(struct card ***cards, int *count, const char *cardname)
+static void add_card(struct card ***cards, int *count, const char *cardname,
+		     int epfd)
 {
 	struct card *card, **cc;
+	snd_ctl_card_info_t *info;
 	int i, index, findex;
 	char device[16];
+	snd_ctl_card_info_alloca(&info);
 
 	index = snd_card_get_index(cardname);
 	if (index < 0)
@@ -110,16 +174,30 @@ static void add_card(struct card ***cards, int *count, const char *cardname)
 	card->index = index;
 	sprintf(device, "hw:%i", index);
 	if (snd_ctl_open(&card->handle, device, SND_CTL_READONLY|SND_CTL_NONBLOCK) < 0) {
-		card_free(&card);
+		card_free(&card, -1);
 		return;
 	}
 	card->pfds = snd_ctl_poll_descriptors_count(card->handle);
 	if (card->pfds < 0) {
-		card_free(&card);
+		card_free(&card, -1);
 		return;
 	}
 	if (snd_ctl_subscribe_events(card->handle, 1) < 0) {
-		card_free(&card);
+		card_free(&card, -1);
+		return;
+	}
+	if (snd_ctl_card_info(card->handle, info) < 0) {
+		card_free(&card, -1);
+		return;
+	}
+	card->id = strdup(snd_ctl_card_info_get_id(info));
+	if (card->id == NULL) {
+		card_free(&card, -1);
+		return;
+	}
+	card->full = 1;
+	if (card_watch(card, epfd) < 0) {
+		card_free(&card, epfd);
 		return;
 	}
 	if (findex >= 0) {
@@ -127,7 +205,7 @@ static void add_card(struct card ***cards, int *count, const char *cardname)
 	} else {
 		cc = realloc(*cards, sizeof(void *) * (*count + 1));
 		if (cc == NULL) {
-			card_free(&card);
+			card_free(&card, epfd);
 			return;
 		}
 		cc[*count] = card;
@@ -136,7 +214,7 @@ static void add_card(struct card ***cards, int *count, const char *cardname)
 	}
 }
 
-static void add_cards(struct card ***cards, int *count)
+static void add_cards(struct card ***cards, int *count, int epfd)
 {
 	int card = -1;
 	char cardname[16];
@@ -148,32 +226,26 @@ static void add_cards(struct card ***cards, int *count)
 			break;
 		if (card >= 0) {
 			sprintf(cardname, "%i", card);
-			add_card(cards, count, cardname);
+			add_card(cards, count, cardname, epfd);
 		}
 	}
 }
 
-static int compare_ids(snd_ctl_elem_id_t *id1, snd_ctl_elem_id_t *id2)
+static inline unsigned int id_list_slot(struct id_list *list, unsigned int numid)
 {
-	if (id1 == NULL || id2 == NULL)
-		return 0;
-	return snd_ctl_elem_id_get_interface(id1) == snd_ctl_elem_id_get_interface(id2) &&
-	       snd_ctl_elem_id_get_index(id1) == snd_ctl_elem_id_get_index(id2) &&
-	       strcmp(snd_ctl_elem_id_get_name(id1), snd_ctl_elem_id_get_name(id2)) == 0 &&
-	       snd_ctl_elem_id_get_device(id1) == snd_ctl_elem_id_get_device(id2) &&
-	       snd_ctl_elem_id_get_subdevice(id1) == snd_ctl_elem_id_get_subdevice(id2);
+	return (numid * 2654435761U) & (list->size - 1);
 }
 
 static int in_list(struct id_list *list, snd_ctl_elem_id_t *id)
 {
-	int i;
-	snd_ctl_elem_id_t *id1;
+	unsigned int numid = snd_ctl_elem_id_get_numid(id);
+	unsigned int i;
 
-	for (i = 0; i < list->size; i++) {
-		id1 = list->list[i];
-		if (id1 == NULL)
-			continue;
-		if (compare_ids(id, id1))
+	if (list->size == 0 || numid == ID_LIST_EMPTY || numid == ID_LIST_DELETED)
+		return 0;
+	for (i = id_list_slot(list, numid); list->numids[i] != ID_LIST_EMPTY;
+	     i = (i + 1) & (list->size - 1)) {
+		if (list->numids[i] == numid)
 			return 1;
 	}
 	return 0;
@@ -181,37 +253,64 @@ static int in_list(struct id_list *list, snd_ctl_elem_id_t *id)
 
 static void remove_from_list(struct id_list *list, snd_ctl_elem_id_t *id)
 {
-	int i;
+	unsigned int numid = snd_ctl_elem_id_get_numid(id);
+	unsigned int i;
 
-	for (i = 0; i < list->size; i++) {
-		if (compare_ids(id, list->list[i])) {
-			free(list->list[i]);
-			list->list[i] = NULL;
+	if (list->size == 0 || numid == ID_LIST_EMPTY || numid == ID_LIST_DELETED)
+		return;
+	for (i = id_list_slot(list, numid); list->numids[i] != ID_LIST_EMPTY;
+	     i = (i + 1) & (list->size - 1)) {
+		if (list->numids[i] == numid) {
+			list->numids[i] = ID_LIST_DELETED;
+			return;
 		}
 	}
 }
 
+static int grow_list(struct id_list *list)
+{
+	struct id_list n;
+	unsigned int i, j;
+
+	n.size = list->size ? list->size * 2 : 64;
+	n.used = 0;
+	n.numids = calloc(n.size, sizeof(*n.numids));
+	if (n.numids == NULL)
+		return -ENOMEM;
+	for (i = 0; i < list->size; i++) {
+		if (list->numids[i] == ID_LIST_EMPTY ||
+		    list->numids[i] == ID_LIST_DELETED)
+			continue;
+		for (j = id_list_slot(&n, list->numids[i]);
+		     n.numids[j] != ID_LIST_EMPTY; j = (j + 1) & (n.size - 1))
+			;
+		n.numids[j] = list->numids[i];
+		n.used++;
+	}
+	free(list->numids);
+	*list = n;
+	return 0;
+}
+
 static void add_to_list(struct id_list *list, snd_ctl_elem_id_t *id)
 {
-	snd_ctl_elem_id_t *id1;
-	snd_ctl_elem_id_t **n;
-	int i;
+	unsigned int numid = snd_ctl_elem_id_get_numid(id);
+	unsigned int i;
 
-	if (snd_ctl_elem_id_malloc(&id1))
+	if (numid == ID_LIST_EMPTY || numid == ID_LIST_DELETED)
 		return;
-	snd_ctl_elem_id_copy(id1, id);
-	for (i = 0; i < list->size; i++) {
-		if (list->list[i] == NULL) {
-			list->list[i] = id1;
-			return;
-		}
-	}
-	n = realloc(list->list, sizeof(void *) * (list->size + 1));
-	if (n == NULL)
+	if (in_list(list, id))
 		return;
-	n[list->size] = id1;
-	list->size++;
-	list->list = n;
+	/* keep the load factor (deleted slots included) below 3/4 */
+	if ((list->used + 1) * 4 > list->size * 3 && grow_list(list) < 0)
+		return;
+	for (i = id_list_slot(list, numid);
+	     list->numids[i] != ID_LIST_EMPTY && list->numids[i] != ID_LIST_DELETED;
+	     i = (i + 1) & (list->size - 1))
+		;
+	if (list->numids[i] == ID_LIST_EMPTY)
+		list->used++;
+	list->numids[i] = numid;
 }
 
 static int check_lists(struct card *card, snd_ctl_elem_id_t *id)
@@ -255,6 +354,10 @@ static int card_events(struct card *card)
 		if (mask == SND_CTL_EVENT_MASK_REMOVE) {
 			remove_from_list(&card->whitelist, id);
 			remove_from_list(&card->blacklist, id);
+			if (incremental_save) {
+				add_to_list(&card->dirty, id);
+				res = 1;
+			}
 			continue;
 		}
 		if (mask & SND_CTL_EVENT_MASK_INFO) {
@@ -264,7 +367,80 @@ static int card_events(struct card *card)
 		if (mask & (SND_CTL_EVENT_MASK_VALUE|
 			    SND_CTL_EVENT_MASK_ADD|
 			    SND_CTL_EVENT_MASK_TLV)) {
-			if (check_lists(card, id))
+			if (check_lists(card, id)) {
+				if (incremental_save)
+					add_to_list(&card->dirty, id);
+				res = 1;
+			}
+		}
+	}
+	return res;
+}
+
+static int save_incremental(const char *file, const char *cardname,
+			    snd_config_t **snapshot,
+			    struct card **cards, int count)
+{
+	struct card *card;
+	snd_ctl_elem_id_t *id;
+	unsigned int j, numid;
+	int i, err;
+	snd_ctl_elem_id_alloca(&id);
+
+	if (*snapshot == NULL) {
+		err = state_snapshot(file, cardname, snapshot);
+		if (err < 0)
+			return err;
+		for (i = 0; i < count; i++) {
+			if (cards[i] == NULL)
+				continue;
+			cards[i]->full = 0;
+			clear_list(&cards[i]->dirty);
+		}
+		return state_snapshot_save(file, *snapshot);
+	}
+	for (i = 0; i < count; i++) {
+		card = cards[i];
+		if (card == NULL)
+			continue;
+		for (j = 0; !card->full && j < card->dirty.size; j++) {
+			numid = card->dirty.numids[j];
+			if (numid == ID_LIST_EMPTY || numid == ID_LIST_DELETED)
+				continue;
+			snd_ctl_elem_id_set_numid(id, numid);
+			err = state_snapshot_control(*snapshot, card->id,
+						     card->handle, id);
+			if (err < 0) {
+				dbg("card %s: control %u refresh failed, rescanning card",
+				    card->id, numid);
+				card->full = 1;
+			}
+		}
+		if (card->full) {
+			err = state_snapshot_card(*snapshot, card->index);
+			if (err < 0)
+				return err;
+			card->full = 0;
+		}
+		clear_list(&card->dirty);
+	}
+	return state_snapshot_save(file, *snapshot);
+}
+
+/* returns 1 when a control device was created */
+static int hotplug_events(int infd)
+{
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	ssize_t len, pos;
+	int res = 0;
+
+	while ((len = read(infd, buf, sizeof(buf))) > 0) {
+		for (pos = 0; pos < len; pos += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)(buf + pos);
+			if ((ev->mask & IN_CREATE) && ev->len > 0 &&
+			    !strncmp(ev->name, "controlC", 8))
 				res = 1;
 		}
 	}
@@ -359,14 +535,32 @@ static int check_another_instance(const char *pidfile)
 int state_daemon(const char *file, const char *cardname, int period,
 		 const char *pidfile)
 {
-	int count = 0, pcount, psize = 0, i, j, k, changed = 0;
+	int count = 0, i, k, n, changed = 0, epfd, infd;
 	time_t last_write, now;
-	unsigned short revents;
-	struct card **cards = NULL;
-	struct pollfd *pfd = NULL, *pfdn;
+	struct card **cards = NULL, *card;
+	struct epoll_event ev, epev[16];
+	snd_config_t *snapshot = NULL;
 
 	if (check_another_instance(pidfile))
 		return 0;
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		n = -errno;
+		error("epoll_create failed: %s", strerror(-n));
+		return n;
+	}
+	/* new cards are picked up from /dev/snd, SIGUSR1 still forces a rescan */
+	infd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (infd >= 0 && inotify_add_watch(infd, "/dev/snd", IN_CREATE) >= 0) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &hotplug_tag;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, infd, &ev);
+	} else {
+		dbg("cannot watch /dev/snd, hotplug needs SIGUSR1");
+		if (infd >= 0)
+			close(infd);
+		infd = -1;
+	}
 	rescan = 1;
 	signal(SIGABRT, signal_handler_quit);
 	signal(SIGTERM, signal_handler_quit);
@@ -380,60 +574,42 @@ int state_daemon(const char *file, const char *cardname, int period,
 			goto save;
 		if (rescan) {
 			if (cardname) {
-				add_card(&cards, &count, cardname);
+				add_card(&cards, &count, cardname, epfd);
 			} else {
-				add_cards(&cards, &count);
+				add_cards(&cards, &count, epfd);
 			}
 			snd_config_update_free_global();
 			rescan = 0;
 		}
-		for (i = pcount = 0; i < count; i++) {
-			if (cards[i] == NULL)
-				continue;
-			pcount += cards[i]->pfds;
-		}
-		if (pcount > psize) {
-			pfdn = realloc(pfd, sizeof(struct pollfd) * pcount);
-			if (pfdn) {
-				psize = pcount;
-				pfd = pfdn;
-			} else {
-				error("No enough memory...");
-				goto out;
-			}
-		}
-		for (i = j = 0; i < count; i++) {
-			if (cards[i] == NULL)
-				continue;
-			k = snd_ctl_poll_descriptors(cards[i]->handle, pfd + j, pcount - j);
-			if (k != cards[i]->pfds) {
-				error("poll prepare failed: %i", k);
-				goto out;
-			}
-			j += k;
-		}
-		i = poll(pfd, j, (period / 2) * 1000);
-		if (i < 0 && errno == EINTR)
+		n = epoll_wait(epfd, epev, ARRAY_SIZE(epev), (period / 2) * 1000);
+		if (n < 0 && errno == EINTR)
 			continue;
-		if (i < 0) {
-			error("poll failed: %s", strerror(errno));
+		if (n < 0) {
+			error("epoll_wait failed: %s", strerror(errno));
 			break;
 		}
 		time(&now);
-		for (i = j = 0; i < count; i++) {
-			if (cards[i] == NULL)
+		for (i = 0; i < n; i++) {
+			card = epev[i].data.ptr;
+			if (card == NULL)
+				continue;
+			if (card == (struct card *)&hotplug_tag) {
+				if (hotplug_events(infd))
+					rescan = 1;
 				continue;
-			k = snd_ctl_poll_descriptors_revents(cards[i]->handle,
-					pfd + j, cards[i]->pfds, &revents);
-			if (k < 0) {
-				error("poll post failed: %i\n", k);
-				goto out;
 			}
-			j += cards[i]->pfds;
-			if (revents & (POLLERR|POLLNVAL)) {
-				card_free(&cards[i]);
-			} else if (revents & POLLIN) {
-				if (card_events(cards[i])) {
+			if (epev[i].events & (EPOLLERR|EPOLLHUP)) {
+				for (k = 0; k < count; k++) {
+					if (cards[k] == card)
+						card_free(&cards[k], epfd);
+				}
+				/* drop the other events of the freed card */
+				for (k = i + 1; k < n; k++) {
+					if (epev[k].data.ptr == card)
+						epev[k].data.ptr = NULL;
+				}
+			} else if (epev[i].events & EPOLLIN) {
+				if (card_events(card)) {
 					/* delay the write */
 					if (!changed)
 						last_write = now;
@@ -444,16 +620,25 @@ int state_daemon(const char *file, const char *cardname, int period,
 		if ((now - last_write >= period && changed) || save_now) {
 save:
 			changed = save_now = 0;
-			save_state(file, cardname);
+			if (incremental_save)
+				save_incremental(file, cardname, &snapshot,
+						 cards, count);
+			else
+				save_state(file, cardname);
 		}
 	}
-out:
-	free(pfd);
+	if (snapshot)
+		snd_config_delete(snapshot);
 	remove(pidfile);
 	if (cards) {
-		for (i = 0; i < count; i++)
-			card_free(&cards[i]);
+		for (i = 0; i < count; i++) {
+			if (cards[i])
+				card_free(&cards[i], epfd);
+		}
 		free(cards);
 	}
+	if (infd >= 0)
+		close(infd);
+	close(epfd);
 	return 0;
 }
@@ -71,6 +71,8 @@ struct space {
 	int exit_code;
 	int quit;
 	unsigned int ctl_id_changed;
+	unsigned int ctl_writes;
+	unsigned int ctl_writes_skipped;
 	snd_hctl_t *ctl_handle;
 	snd_ctl_card_info_t *ctl_card_info;
 	snd_ctl_elem_id_t *ctl_id;
@@ -106,6 +108,9 @@ static void free_space(struct space *space)
 		free(pair);
 	}
 	space->pairs = NULL;
+	if (space->ctl_writes || space->ctl_writes_skipped)
+		dbg("%u controls written, %u unchanged",
+		    space->ctl_writes, space->ctl_writes_skipped);
 	if (space->ctl_value) {
 		snd_ctl_elem_value_free(space->ctl_value);
 		space->ctl_value = NULL;
@@ -745,6 +750,20 @@ dbvalue:
   	return res;
 }
 
+/* the element already holds the value to be written */
+static int ctl_value_unchanged(struct space *space)
+{
+	snd_ctl_elem_value_t *cur;
+	snd_ctl_elem_value_alloca(&cur);
+
+	snd_ctl_elem_value_set_id(cur, space->ctl_id);
+	if (snd_ctl_elem_read(snd_hctl_ctl(space->ctl_handle), cur) < 0)
+		return 0;
+	return ctl_value_equal(snd_ctl_elem_info_get_type(space->ctl_info),
+			       snd_ctl_elem_info_get_count(space->ctl_info),
+			       cur, space->ctl_value);
+}
+
 static int elemid_set(struct space *space, const char *attr, const char *value)
 {
 	unsigned int val;
@@ -818,11 +837,16 @@ static int elemid_set(struct space *space, const char *attr, const char *value)
 		} else {
 			space->ctl_id_changed &= ~2;
 			snd_ctl_elem_value_set_id(space->ctl_value, space->ctl_id);
+			if (ctl_value_unchanged(space)) {
+				space->ctl_writes_skipped++;
+				return 0;
+			}
 			err = snd_ctl_elem_write(snd_hctl_ctl(space->ctl_handle), space->ctl_value);
 			if (err < 0) {
 				Perror(space, "value write error: %s", snd_strerror(err));
 				return err;
 			}
+			space->ctl_writes++;
 		}
 	    	return err;
 	}
@@ -938,30 +962,6 @@ static int get_key(char **line, char **key, enum key_op *op, char **value)
 	return 0;
 }
 
-/* extract possible KEY{attr} */
-static char *get_key_attribute(struct space *space, char *str, char *res, size_t ressize)
-{
-	char *pos;
-	char *attr;
-
-	attr = strchr(str, '{');
-	if (attr != NULL) {
-		attr++;
-		pos = strchr(attr, '}');
-		if (pos == NULL) {
-			Perror(space, "missing closing brace for format");
-			return NULL;
-		}
-		pos[0] = '\0';
-		strlcpy(res, attr, ressize);
-		pos[0] = '}';
-		dbg("attribute='%s'", res);
-		return res;
-	}
-
-	return NULL;
-}
-
 /* extract possible {attr} and move str behind it */
 static char *get_format_attribute(struct space *space, char **str)
 {
@@ -1284,25 +1284,282 @@ static int conf_name_filter(const struct dirent *d)
 	return ext && !strcmp(ext, ".conf");
 }
 
-static int parse_line(struct space *space, char *line, size_t linesize)
+/*
+ * Compiled rules: each rule file is split into rule lines and keys (with
+ * the key type and the {attr} resolved) once and kept until the end of
+ * init(), so the files are not re-read and re-tokenized for every card.
+ */
+enum rule_type {
+	RULE_UNKNOWN,
+	RULE_LABEL,
+	RULE_CTL,
+	RULE_RESULT,
+	RULE_PROGRAM,
+	RULE_CARDINFO,
+	RULE_ATTR,
+	RULE_ENV,
+	RULE_GOTO,
+	RULE_INCLUDE,
+	RULE_ACCESS,
+	RULE_PRINT,
+	RULE_ERROR,
+	RULE_EXIT,
+	RULE_CONFIG,
+};
+
+struct rule_key {
+	enum rule_type type;
+	enum key_op op;
+	char *key;
+	char *attr;		/* contents of {attr}, NULL if missing */
+	char *value;
+};
+
+struct rule_line {
+	unsigned int linenum;
+	int toolong;
+	int invalid;		/* unparsable key after the keys */
+	unsigned int nkeys;
+	struct rule_key *keys;
+	char *buf;
+};
+
+struct rule_file {
+	char *filename;
+	struct timespec mtime;
+	off_t size;
+	unsigned int nlines;
+	struct rule_line *lines;
+	struct list_head list;
+};
+
+static LIST_HEAD(rule_files);
+
+static enum rule_type rule_key_type(const char *key)
 {
-	char *linepos;
+	if (strncasecmp(key, "LABEL", 5) == 0)
+		return RULE_LABEL;
+	if (strncasecmp(key, "CTL{", 4) == 0)
+		return RULE_CTL;
+	if (strcasecmp(key, "RESULT") == 0)
+		return RULE_RESULT;
+	if (strcasecmp(key, "PROGRAM") == 0)
+		return RULE_PROGRAM;
+	if (strncasecmp(key, "CARDINFO{", 9) == 0)
+		return RULE_CARDINFO;
+	if (strncasecmp(key, "ATTR{", 5) == 0)
+		return RULE_ATTR;
+	if (strncasecmp(key, "ENV{", 4) == 0)
+		return RULE_ENV;
+	if (strcasecmp(key, "GOTO") == 0)
+		return RULE_GOTO;
+	if (strcasecmp(key, "INCLUDE") == 0)
+		return RULE_INCLUDE;
+	if (strncasecmp(key, "ACCESS", 6) == 0)
+		return RULE_ACCESS;
+	if (strncasecmp(key, "PRINT", 5) == 0)
+		return RULE_PRINT;
+	if (strncasecmp(key, "ERROR", 5) == 0)
+		return RULE_ERROR;
+	if (strncasecmp(key, "EXIT", 4) == 0)
+		return RULE_EXIT;
+	if (strncasecmp(key, "CONFIG{", 7) == 0)
+		return RULE_CONFIG;
+	return RULE_UNKNOWN;
+}
+
+static void rule_file_free(struct rule_file *rf)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < rf->nlines; i++) {
+		for (j = 0; j < rf->lines[i].nkeys; j++)
+			free(rf->lines[i].keys[j].attr);
+		free(rf->lines[i].keys);
+		free(rf->lines[i].buf);
+	}
+	free(rf->lines);
+	free(rf->filename);
+	free(rf);
+}
+
+static void rule_cache_free(void)
+{
+	struct rule_file *rf, *tmp;
+
+	list_for_each_entry_safe(rf, tmp, &rule_files, list) {
+		list_del(&rf->list);
+		rule_file_free(rf);
+	}
+}
+
+static int compile_line(struct rule_line *rl, const char *bufline, size_t count)
+{
+	struct rule_key *k;
+	char *linepos, *key, *value, *attr, *end;
+	enum key_op op;
+	unsigned int i, j;
+
+	rl->buf = malloc(count + 1);
+	if (rl->buf == NULL)
+		return -ENOMEM;
+	/* skip backslash and newline from multiline rules */
+	for (i = j = 0; i < count; i++) {
+		if (bufline[i] == '\\' && bufline[i+1] == '\n')
+			continue;
+		rl->buf[j++] = bufline[i];
+	}
+	rl->buf[j] = '\0';
+	dbg("read (%i) '%s'", rl->linenum, rl->buf);
+
+	linepos = rl->buf;
+	while (*linepos != '\0') {
+		op = KEY_OP_UNSET;
+		if (get_key(&linepos, &key, &op, &value) < 0) {
+			rl->invalid = 1;
+			break;
+		}
+		k = realloc(rl->keys, (rl->nkeys + 1) * sizeof(*k));
+		if (k == NULL)
+			return -ENOMEM;
+		rl->keys = k;
+		k += rl->nkeys++;
+		k->type = rule_key_type(key);
+		k->op = op;
+		k->key = key;
+		k->value = value;
+		k->attr = NULL;
+		attr = strchr(key, '{');
+		if (attr && (end = strchr(attr + 1, '}')) != NULL) {
+			k->attr = strndup(attr + 1, end - attr - 1);
+			if (k->attr == NULL)
+				return -ENOMEM;
+			dbg("attribute='%s'", k->attr);
+		}
+	}
+	return 0;
+}
+
+static int compile_file(const char *filename, struct rule_file *rf)
+{
+	struct rule_line *rl;
+	char *buf, *bufline;
+	size_t bufsize, pos, count;
+	unsigned int linenum, i;
+	int err = 0;
+
+	if (file_map(filename, &buf, &bufsize) != 0) {
+		err = errno;
+		error("Unable to open file '%s': %s", filename, strerror(err));
+		return -err;
+	}
+	pos = 0;
+	linenum = 0;
+	while (pos < bufsize) {
+		count = line_width(buf, bufsize, pos);
+		bufline = buf + pos;
+		pos += count + 1;
+		linenum++;
+
+		/* skip whitespaces */
+		while (count > 0 && isspace(bufline[0])) {
+			bufline++;
+			count--;
+		}
+		if (count == 0)
+			continue;
+
+		/* comment check */
+		if (bufline[0] == '#')
+			continue;
+
+		rl = realloc(rf->lines, (rf->nlines + 1) * sizeof(*rl));
+		if (rl == NULL) {
+			err = -ENOMEM;
+			break;
+		}
+		rf->lines = rl;
+		rl += rf->nlines++;
+		memset(rl, 0, sizeof(*rl));
+		rl->linenum = linenum;
+		for (i = 0; i < count; i++) {
+			if (bufline[i] == '\\' && bufline[i+1] == '\n')
+				linenum++;
+		}
+		if (count > 2047) {
+			rl->toolong = 1;
+			continue;
+		}
+		err = compile_line(rl, bufline, count);
+		if (err < 0)
+			break;
+	}
+	file_unmap(buf, bufsize);
+	return err;
+}
+
+static int rule_file_get(const char *filename, struct rule_file **rfp)
+{
+	struct rule_file *rf;
+	struct stat st;
+	int err;
+
+	if (stat(filename, &st) < 0) {
+		err = errno;
+		error("Unable to open file '%s': %s", filename, strerror(err));
+		return -err;
+	}
+	list_for_each_entry(rf, &rule_files, list) {
+		if (strcmp(rf->filename, filename))
+			continue;
+		if (rf->size == st.st_size &&
+		    rf->mtime.tv_sec == st.st_mtim.tv_sec &&
+		    rf->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+			*rfp = rf;
+			return 0;
+		}
+		list_del(&rf->list);
+		rule_file_free(rf);
+		break;
+	}
+	rf = calloc(1, sizeof(*rf));
+	if (rf == NULL)
+		return -ENOMEM;
+	rf->filename = strdup(filename);
+	if (rf->filename == NULL) {
+		free(rf);
+		return -ENOMEM;
+	}
+	rf->mtime = st.st_mtim;
+	rf->size = st.st_size;
+	err = compile_file(filename, rf);
+	if (err < 0) {
+		rule_file_free(rf);
+		return err;
+	}
+	list_add_tail(&rf->list, &rule_files);
+	*rfp = rf;
+	return 0;
+}
+
+static int parse_line(struct space *space, const struct rule_line *rl)
+{
+	const struct rule_key *k;
 	char *key, *value, *attr, *temp;
 	struct pair *pair;
 	enum key_op op;
 	int err = 0, count;
+	unsigned int n;
 	char string[PATH_SIZE];
 	char result[PATH_SIZE];
 
-	linepos = line;
-	while (*linepos != '\0') {
-		op = KEY_OP_UNSET;
-		
-		err = get_key(&linepos, &key, &op, &value);
-		if (err < 0)
-			goto invalid;
+	for (n = 0; n < rl->nkeys; n++) {
+		k = &rl->keys[n];
+		key = k->key;
+		op = k->op;
+		value = k->value;
 
-		if (strncasecmp(key, "LABEL", 5) == 0) {
+		if (k->type == RULE_LABEL) {
 			if (op != KEY_OP_ASSIGN) {
 				Perror(space, "invalid LABEL operation");
 				goto invalid;
@@ -1319,9 +1576,10 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			break;		/* not for us */
 		}
 
-		if (strncasecmp(key, "CTL{", 4) == 0) {
-			attr = get_key_attribute(space, key + 3, string, sizeof(string));
+		if (k->type == RULE_CTL) {
+			attr = k->attr;
 			if (attr == NULL) {
+				Perror(space, "missing closing brace for format");
 				Perror(space, "error parsing CTL attribute");
 				goto invalid;
 			}
@@ -1361,7 +1619,7 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			}
 			continue;
 		}
-		if (strcasecmp(key, "RESULT") == 0) {
+		if (k->type == RULE_RESULT) {
 			if (op == KEY_OP_MATCH || op == KEY_OP_NOMATCH) {
 				if (!do_match(key, op, value, space->program_result))
 					break;
@@ -1381,7 +1639,7 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			}
 			continue;
 		}
-		if (strcasecmp(key, "PROGRAM") == 0) {
+		if (k->type == RULE_PROGRAM) {
 			if (op == KEY_OP_UNSET)
 				continue;
 			strlcpy(string, value, sizeof(string));
@@ -1410,9 +1668,10 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			dbg("PROGRAM key is true");
 			continue;
 		}
-		if (strncasecmp(key, "CARDINFO{", 9) == 0) {
-			attr = get_key_attribute(space, key + 8, string, sizeof(string));
+		if (k->type == RULE_CARDINFO) {
+			attr = k->attr;
 			if (attr == NULL) {
+				Perror(space, "missing closing brace for format");
 				Perror(space, "error parsing CARDINFO attribute");
 				goto invalid;
 			}
@@ -1427,9 +1686,10 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			}
 			continue;
 		}
-		if (strncasecmp(key, "ATTR{", 5) == 0) {
-			attr = get_key_attribute(space, key + 4, string, sizeof(string));
+		if (k->type == RULE_ATTR) {
+			attr = k->attr;
 			if (attr == NULL) {
+				Perror(space, "missing closing brace for format");
 				Perror(space, "error parsing ATTR attribute");
 				goto invalid;
 			}
@@ -1447,9 +1707,10 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			}
 			continue;
 		}
-		if (strncasecmp(key, "ENV{", 4) == 0) {
-			attr = get_key_attribute(space, key + 3, string, sizeof(string));
+		if (k->type == RULE_ENV) {
+			attr = k->attr;
 			if (attr == NULL) {
+				Perror(space, "missing closing brace for format");
 				Perror(space, "error parsing ENV attribute");
 				goto invalid;
 			}
@@ -1471,7 +1732,7 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			}
 			continue;
 		}
-		if (strcasecmp(key, "GOTO") == 0) {
+		if (k->type == RULE_GOTO) {
 			if (op != KEY_OP_ASSIGN) {
 				Perror(space, "invalid GOTO operation");
 				goto invalid;
@@ -1483,7 +1744,7 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			}
 			continue;
 		}
-		if (strcasecmp(key, "INCLUDE") == 0) {
+		if (k->type == RULE_INCLUDE) {
 			char *rootdir, *go_to;
 			const char *filename;
 			struct stat st;
@@ -1560,7 +1821,7 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 				break;
 			continue;
 		}
-		if (strncasecmp(key, "ACCESS", 6) == 0) {
+		if (k->type == RULE_ACCESS) {
 			if (op == KEY_OP_MATCH || op == KEY_OP_NOMATCH) {
 				if (value[0] == '$') {
 					strlcpy(string, value, sizeof(string));
@@ -1589,7 +1850,7 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			}
 			continue;
 		}
-		if (strncasecmp(key, "PRINT", 5) == 0) {
+		if (k->type == RULE_PRINT) {
 			if (op != KEY_OP_ASSIGN) {
 				Perror(space, "invalid PRINT operation");
 				goto invalid;
@@ -1599,7 +1860,7 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			fwrite(string, strlen(string), 1, stdout);
 			continue;
 		}
-		if (strncasecmp(key, "ERROR", 5) == 0) {
+		if (k->type == RULE_ERROR) {
 			if (op != KEY_OP_ASSIGN) {
 				Perror(space, "invalid ERROR operation");
 				goto invalid;
@@ -1609,7 +1870,7 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			fwrite(string, strlen(string), 1, stderr);
 			continue;
 		}
-		if (strncasecmp(key, "EXIT", 4) == 0) {
+		if (k->type == RULE_EXIT) {
 			if (op != KEY_OP_ASSIGN) {
 				Perror(space, "invalid EXIT operation");
 				goto invalid;
@@ -1622,9 +1883,10 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 			space->quit = 1;
 			break;
 		}
-		if (strncasecmp(key, "CONFIG{", 7) == 0) {
-			attr = get_key_attribute(space, key + 6, string, sizeof(string));
+		if (k->type == RULE_CONFIG) {
+			attr = k->attr;
 			if (attr == NULL) {
+				Perror(space, "missing closing brace for format");
 				Perror(space, "error parsing CONFIG attribute");
 				goto invalid;
 			}
@@ -1648,6 +1910,8 @@ static int parse_line(struct space *space, char *line, size_t linesize)
 
 		Perror(space, "unknown key '%s'", key);
 	}
+	if (n == rl->nkeys && rl->invalid)
+		goto invalid;
 	return err;
 
 invalid:
@@ -1657,88 +1921,35 @@ invalid:
 
 static int parse(struct space *space, const char *filename)
 {
-	char *buf, *bufline, *line;
-	size_t bufsize, pos, count, linesize;
-	unsigned int linenum, i, j, linenum_adj;
+	struct rule_file *rf;
+	const struct rule_line *rl;
+	unsigned int i;
 	int err;
 
 	dbg("start of file '%s'", filename);
 
-	if (file_map(filename, &buf, &bufsize) != 0) {
-		err = errno;
-		error("Unable to open file '%s': %s", filename, strerror(err));
-		return -err;
-	}
+	err = rule_file_get(filename, &rf);
+	if (err < 0)
+		return err;
 
-	err = 0;	
-	pos = 0;
-	linenum = 0;
-	linesize = 128;
-	line = malloc(linesize);
-	if (line == NULL) {
-		file_unmap(buf, bufsize);
-		return -ENOMEM;
-	}
 	space->filename = filename;
-	while (!err && pos < bufsize && !space->quit) {
-		count = line_width(buf, bufsize, pos);
-		bufline = buf + pos;
-		pos += count + 1;
-		linenum++;
-		
-		/* skip whitespaces */
-		while (count > 0 && isspace(bufline[0])) {
-			bufline++;
-			count--;
-		}
-		if (count == 0)
-			continue;
-			
-		/* comment check */
-		if (bufline[0] == '#')
-			continue;
-		
-		if (count > linesize - 1) {
-			free(line);
-			line = NULL;
-			linesize = (count + 127 + 1) & ~127;
-			if (linesize > 2048) {
-				error("file %s, line %i too long", filename, linenum);
-				err = -EINVAL;
-				break;
-			}
-			line = malloc(linesize);
-			if (line == NULL) {
-				err = -EINVAL;
-				break;
-			}
-		}
-		
-		/* skip backslash and newline from multiline rules */
-		linenum_adj = 0;
-		for (i = j = 0; i < count; i++) {
-			if (bufline[i] == '\\' && bufline[i+1] == '\n') {
-				linenum_adj++;
-				continue;
-			}
-			line[j++] = bufline[i];
+	for (i = 0; !err && i < rf->nlines && !space->quit; i++) {
+		rl = &rf->lines[i];
+		if (rl->toolong) {
+			error("file %s, line %i too long", filename, rl->linenum);
+			err = -EINVAL;
+			break;
 		}
-		line[j] = '\0';
-
-		dbg("read (%i) '%s'", linenum, line);
-		space->linenum = linenum;
-		err = parse_line(space, line, linesize);
+		space->linenum = rl->linenum;
+		err = parse_line(space, rl);
 		if (err == -EJUSTRETURN) {
 			err = 0;
 			break;
 		}
-		linenum += linenum_adj;
 	}
 
-	free(line);
 	space->filename = NULL;
 	space->linenum = -1;
-	file_unmap(buf, bufsize);
 	dbg("end of file '%s'", filename);
 	return err ? err : -abs(space->exit_code);
 }
@@ -1773,6 +1984,7 @@ int init(const char *filename, int flags, const char *cardname)
 	}
 	err = lasterr ? lasterr : snd_card_iterator_error(&iter);
 out:
+	rule_cache_free();
 	sysfs_cleanup();
 	return err;
 }
@@ -20,21 +20,45 @@
 
 static char sysfs_path[PATH_SIZE];
 
-/* attribute value cache */
-static LIST_HEAD(attr_list);
+/*
+ * attribute value cache, hashed by path and bounded to ATTR_CACHE_MAX
+ * entries; the least recently used entry is dropped when it is full
+ */
+#define ATTR_HASH_SIZE	256
+#define ATTR_CACHE_MAX	1024
+
+static struct list_head attr_hash[ATTR_HASH_SIZE];
+static LIST_HEAD(attr_lru);
+static unsigned int attr_count;
+static unsigned int attr_hits, attr_misses, attr_evicted;
+
 struct sysfs_attr {
-	struct list_head node;
+	struct list_head node;		/* hash bucket */
+	struct list_head lru;
 	char path[PATH_SIZE];
 	char *value;			/* points to value_local if value is cached */
 	char value_local[NAME_SIZE];
 };
 
+static unsigned int attr_hash_path(const char *path)
+{
+	unsigned int h = 2166136261U;
+
+	while (*path)
+		h = (h ^ (unsigned char)*path++) * 16777619U;
+	return h & (ATTR_HASH_SIZE - 1);
+}
+
 static int sysfs_init(void)
 {
 	const char *env;
 	char sysfs_test[PATH_SIZE];
+	int i;
 
-	INIT_LIST_HEAD(&attr_list);
+	for (i = 0; i < ATTR_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&attr_hash[i]);
+	INIT_LIST_HEAD(&attr_lru);
+	attr_count = attr_hits = attr_misses = attr_evicted = 0;
 
 	env = getenv("SYSFS_PATH");
 	if (env) {
@@ -63,10 +87,14 @@ static void sysfs_cleanup(void)
 	struct sysfs_attr *attr_loop;
 	struct sysfs_attr *attr_temp;
 
-	list_for_each_entry_safe(attr_loop, attr_temp, &attr_list, node) {
+	dbg("sysfs attribute cache: %u hits, %u misses, %u evicted",
+	    attr_hits, attr_misses, attr_evicted);
+	list_for_each_entry_safe(attr_loop, attr_temp, &attr_lru, lru) {
 		list_del(&attr_loop->node);
+		list_del(&attr_loop->lru);
 		free(attr_loop);
 	}
+	attr_count = 0;
 }
 
 static char *sysfs_attr_get_value(const char *devpath, const char *attr_name)
@@ -76,6 +104,7 @@ static char *sysfs_attr_get_value(const char *devpath, const char *attr_name)
 	char value[NAME_SIZE];
 	struct sysfs_attr *attr_loop;
 	struct sysfs_attr *attr;
+	struct list_head *bucket;
 	struct stat statbuf;
 	int fd;
 	ssize_t size;
@@ -89,22 +118,35 @@ static char *sysfs_attr_get_value(const char *devpath, const char *attr_name)
 	strlcat(path_full, attr_name, sizeof(path_full));
 
 	/* look for attribute in cache */
-	list_for_each_entry(attr_loop, &attr_list, node) {
+	bucket = &attr_hash[attr_hash_path(path)];
+	list_for_each_entry(attr_loop, bucket, node) {
 		if (strcmp(attr_loop->path, path) == 0) {
 			dbg("found in cache '%s'", attr_loop->path);
+			attr_hits++;
+			list_move(&attr_loop->lru, &attr_lru);
 			return attr_loop->value;
 		}
 	}
+	attr_misses++;
 
 	/* store attribute in cache (also negatives are kept in cache) */
 	dbg("new uncached attribute '%s'", path_full);
-	attr = malloc(sizeof(struct sysfs_attr));
-	if (attr == NULL)
-		return NULL;
+	if (attr_count >= ATTR_CACHE_MAX) {
+		attr = list_entry(attr_lru.prev, struct sysfs_attr, lru);
+		list_del(&attr->node);
+		list_del(&attr->lru);
+		attr_evicted++;
+	} else {
+		attr = malloc(sizeof(struct sysfs_attr));
+		if (attr == NULL)
+			return NULL;
+		attr_count++;
+	}
 	memset(attr, 0x00, sizeof(struct sysfs_attr));
 	strlcpy(attr->path, path, sizeof(attr->path));
 	dbg("add to cache '%s'", path_full);
-	list_add(&attr->node, &attr_list);
+	list_add(&attr->node, bucket);
+	list_add(&attr->lru, &attr_lru);
 
 	if (lstat(path_full, &statbuf) != 0) {
 		dbg("stat '%s' failed: %s", path_full, strerror(errno));
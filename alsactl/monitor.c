@@ -21,6 +21,7 @@
 #include "version.h"
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/inotify.h>
@@ -37,15 +38,53 @@
 struct src_entry {
 	snd_ctl_t *handle;
 	char *name;
+	int card;
 	unsigned int pfd_count;
+	struct elem_type *types;	/* by numid, for value reads */
+	unsigned int types_size;
 	struct list_head list;
 };
 
+struct elem_type {
+	snd_ctl_elem_type_t type;	/* 0 = unknown */
+	unsigned int count;
+};
+
+/*
+ * binary stream: struct monitor_stream once, then a struct monitor_record
+ * per event followed by nvalues int64_t values (one per byte for the
+ * BYTES and IEC958 types), all in host byte order
+ */
+#define MONITOR_MAGIC	"ALSM"
+#define MONITOR_VERSION	1
+
+struct monitor_stream {
+	char magic[4];
+	uint32_t version;
+};
+
+struct monitor_record {
+	uint64_t tstamp_ns;	/* CLOCK_MONOTONIC */
+	int32_t card;
+	uint32_t numid;
+	uint32_t mask;
+	int32_t iface;
+	uint32_t device;
+	uint32_t subdevice;
+	uint32_t index;
+	uint32_t nvalues;
+	char name[44];
+	uint32_t reserved;
+};
+
+#define MONITOR_MAX_VALUES	512
+
 static void remove_source_entry(struct src_entry *entry)
 {
 	list_del(&entry->list);
 	if (entry->handle)
 		snd_ctl_close(entry->handle);
+	free(entry->types);
 	free(entry->name);
 	free(entry);
 }
@@ -62,9 +101,12 @@ static int insert_source_entry(struct list_head *srcs, snd_ctl_t *handle,
 			       const char *name)
 {
 	struct src_entry *entry;
+	snd_ctl_card_info_t *info;
 	int count;
 	int err;
 
+	snd_ctl_card_info_alloca(&info);
+
 	entry = calloc(1, sizeof(*entry));
 	if (!entry)
 		return -ENOMEM;
@@ -87,6 +129,9 @@ static int insert_source_entry(struct list_head *srcs, snd_ctl_t *handle,
 		goto error;
 	}
 	entry->pfd_count = count;
+	/* the name is "hw:N" or any user given device, ask the handle */
+	err = snd_ctl_card_info(handle, info);
+	entry->card = err < 0 ? -1 : snd_ctl_card_info_get_card(info);
 
 	list_add_tail(&entry->list, srcs);
 
@@ -101,7 +146,7 @@ static int open_ctl(const char *name, snd_ctl_t **ctlp)
 	snd_ctl_t *ctl;
 	int err;
 
-	err = snd_ctl_open(&ctl, name, SND_CTL_READONLY);
+	err = snd_ctl_open(&ctl, name, SND_CTL_READONLY|SND_CTL_NONBLOCK);
 	if (err < 0) {
 		fprintf(stderr, "Cannot open ctl %s\n", name);
 		return err;
@@ -197,19 +242,9 @@ static int check_control_cdev(int infd, bool *retry)
 	return err;
 }
 
-static int print_event(snd_ctl_t *ctl, const char *name)
+static void print_event(snd_ctl_event_t *event, const char *name)
 {
-	snd_ctl_event_t *event;
 	unsigned int mask;
-	int err;
-
-	snd_ctl_event_alloca(&event);
-	err = snd_ctl_read(ctl, event);
-	if (err < 0)
-		return err;
-
-	if (snd_ctl_event_get_type(event) != SND_CTL_EVENT_ELEM)
-		return 0;
 
 	printf("node %s, #%d (%i,%i,%i,%s,%i)",
 	       name,
@@ -223,7 +258,7 @@ static int print_event(snd_ctl_t *ctl, const char *name)
 	mask = snd_ctl_event_elem_get_mask(event);
 	if (mask == SND_CTL_EVENT_MASK_REMOVE) {
 		printf(" REMOVE\n");
-		return 0;
+		return;
 	}
 
 	if (mask & SND_CTL_EVENT_MASK_VALUE)
@@ -235,7 +270,211 @@ static int print_event(snd_ctl_t *ctl, const char *name)
 	if (mask & SND_CTL_EVENT_MASK_TLV)
 		printf(" TLV");
 	printf("\n");
-	return 0;
+}
+
+static void print_json_string(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			printf("\\u%04x", (unsigned char)*str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
+}
+
+static void print_json_event(snd_ctl_event_t *event, struct src_entry *entry,
+			     uint64_t tstamp, const int64_t *values, int nvalues)
+{
+	static const struct {
+		unsigned int mask;
+		const char *name;
+	} masks[] = {
+		{ SND_CTL_EVENT_MASK_VALUE, "VALUE" },
+		{ SND_CTL_EVENT_MASK_INFO, "INFO" },
+		{ SND_CTL_EVENT_MASK_ADD, "ADD" },
+		{ SND_CTL_EVENT_MASK_TLV, "TLV" },
+	};
+	unsigned int i, mask = snd_ctl_event_elem_get_mask(event);
+	const char *sep = "";
+
+	printf("{\"tstamp_ns\":%llu,\"node\":", (unsigned long long)tstamp);
+	print_json_string(entry->name);
+	printf(",\"card\":%d", entry->card);
+	printf(",\"numid\":%u,\"iface\":\"%s\",\"device\":%u,\"subdevice\":%u,\"name\":",
+	       snd_ctl_event_elem_get_numid(event),
+	       snd_ctl_elem_iface_name(snd_ctl_event_elem_get_interface(event)),
+	       snd_ctl_event_elem_get_device(event),
+	       snd_ctl_event_elem_get_subdevice(event));
+	print_json_string(snd_ctl_event_elem_get_name(event));
+	printf(",\"index\":%u,\"mask\":[", snd_ctl_event_elem_get_index(event));
+	if (mask == SND_CTL_EVENT_MASK_REMOVE) {
+		printf("\"REMOVE\"");
+	} else {
+		for (i = 0; i < ARRAY_SIZE(masks); i++) {
+			if (mask & masks[i].mask) {
+				printf("%s\"%s\"", sep, masks[i].name);
+				sep = ",";
+			}
+		}
+	}
+	putchar(']');
+	if (nvalues >= 0) {
+		printf(",\"values\":[");
+		for (i = 0; i < (unsigned int)nvalues; i++)
+			printf("%s%lld", i ? "," : "", (long long)values[i]);
+		putchar(']');
+	}
+	printf("}\n");
+}
+
+static void write_binary_event(snd_ctl_event_t *event, struct src_entry *entry,
+			       uint64_t tstamp, const int64_t *values, int nvalues)
+{
+	struct monitor_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.tstamp_ns = tstamp;
+	rec.card = entry->card;
+	rec.numid = snd_ctl_event_elem_get_numid(event);
+	rec.mask = snd_ctl_event_elem_get_mask(event);
+	rec.iface = snd_ctl_event_elem_get_interface(event);
+	rec.device = snd_ctl_event_elem_get_device(event);
+	rec.subdevice = snd_ctl_event_elem_get_subdevice(event);
+	rec.index = snd_ctl_event_elem_get_index(event);
+	rec.nvalues = nvalues > 0 ? nvalues : 0;
+	snprintf(rec.name, sizeof(rec.name), "%s", snd_ctl_event_elem_get_name(event));
+	fwrite(&rec, sizeof(rec), 1, stdout);
+	if (nvalues > 0)
+		fwrite(values, sizeof(*values), nvalues, stdout);
+}
+
+/* the element types are cached by numid and dropped on INFO/ADD/REMOVE */
+static struct elem_type *lookup_type(struct src_entry *entry, unsigned int numid,
+				     unsigned int mask)
+{
+	struct elem_type *t;
+	snd_ctl_elem_info_t *info;
+	unsigned int size;
+	snd_ctl_elem_info_alloca(&info);
+
+	if (numid >= entry->types_size) {
+		for (size = entry->types_size ? entry->types_size : 64;
+		     size <= numid; size *= 2)
+			;
+		t = realloc(entry->types, size * sizeof(*t));
+		if (t == NULL)
+			return NULL;
+		memset(t + entry->types_size, 0,
+		       (size - entry->types_size) * sizeof(*t));
+		entry->types = t;
+		entry->types_size = size;
+	}
+	t = &entry->types[numid];
+	if (mask == SND_CTL_EVENT_MASK_REMOVE ||
+	    (mask & (SND_CTL_EVENT_MASK_INFO|SND_CTL_EVENT_MASK_ADD)))
+		t->type = 0;
+	if (mask == SND_CTL_EVENT_MASK_REMOVE)
+		return NULL;
+	if (t->type == 0) {
+		snd_ctl_elem_info_set_numid(info, numid);
+		if (snd_ctl_elem_info(entry->handle, info) < 0 ||
+		    !snd_ctl_elem_info_is_readable(info))
+			return NULL;
+		t->type = snd_ctl_elem_info_get_type(info);
+		t->count = snd_ctl_elem_info_get_count(info);
+	}
+	return t;
+}
+
+/* returns the number of values or -1 */
+static int read_values(struct src_entry *entry, snd_ctl_event_t *event,
+		       int64_t *values)
+{
+	snd_ctl_elem_value_t *val;
+	struct elem_type *t;
+	unsigned int i, count, numid, mask;
+	const unsigned char *bytes;
+	snd_aes_iec958_t iec958;
+	snd_ctl_elem_value_alloca(&val);
+
+	numid = snd_ctl_event_elem_get_numid(event);
+	mask = snd_ctl_event_elem_get_mask(event);
+	t = lookup_type(entry, numid, mask);
+	if (t == NULL || !(mask & SND_CTL_EVENT_MASK_VALUE))
+		return -1;
+	snd_ctl_elem_value_set_numid(val, numid);
+	if (snd_ctl_elem_read(entry->handle, val) < 0)
+		return -1;
+	count = t->count;
+	if (t->type == SND_CTL_ELEM_TYPE_IEC958)
+		count = sizeof(iec958);
+	if (count > MONITOR_MAX_VALUES)
+		count = MONITOR_MAX_VALUES;
+	switch (t->type) {
+	case SND_CTL_ELEM_TYPE_BOOLEAN:
+		for (i = 0; i < count; i++)
+			values[i] = snd_ctl_elem_value_get_boolean(val, i);
+		break;
+	case SND_CTL_ELEM_TYPE_INTEGER:
+		for (i = 0; i < count; i++)
+			values[i] = snd_ctl_elem_value_get_integer(val, i);
+		break;
+	case SND_CTL_ELEM_TYPE_ENUMERATED:
+		for (i = 0; i < count; i++)
+			values[i] = snd_ctl_elem_value_get_enumerated(val, i);
+		break;
+	case SND_CTL_ELEM_TYPE_INTEGER64:
+		for (i = 0; i < count; i++)
+			values[i] = snd_ctl_elem_value_get_integer64(val, i);
+		break;
+	case SND_CTL_ELEM_TYPE_BYTES:
+		bytes = snd_ctl_elem_value_get_bytes(val);
+		for (i = 0; i < count; i++)
+			values[i] = bytes[i];
+		break;
+	case SND_CTL_ELEM_TYPE_IEC958:
+		snd_ctl_elem_value_get_iec958(val, &iec958);
+		bytes = (const unsigned char *)&iec958;
+		for (i = 0; i < count; i++)
+			values[i] = bytes[i];
+		break;
+	default:
+		return -1;
+	}
+	return count;
+}
+
+/* drain all pending events of a source, the output is flushed once */
+static int dispatch_events(struct src_entry *entry, int format, bool values)
+{
+	snd_ctl_event_t *event;
+	struct timespec ts;
+	int64_t vals[MONITOR_MAX_VALUES];
+	uint64_t tstamp;
+	int err, nvalues;
+	snd_ctl_event_alloca(&event);
+
+	while ((err = snd_ctl_read(entry->handle, event)) > 0) {
+		if (snd_ctl_event_get_type(event) != SND_CTL_EVENT_ELEM)
+			continue;
+		if (format == MONITOR_FORMAT_TEXT) {
+			print_event(event, entry->name);
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		tstamp = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		nvalues = values ? read_values(entry, event, vals) : -1;
+		if (format == MONITOR_FORMAT_JSON)
+			print_json_event(event, entry, tstamp, vals, nvalues);
+		else
+			write_binary_event(event, entry, tstamp, vals, nvalues);
+	}
+	fflush(stdout);
+	return err == -EAGAIN ? 0 : err;
 }
 
 static int operate_dispatcher(int epfd, uint32_t op, struct epoll_event *epev,
@@ -299,7 +538,7 @@ static int prepare_dispatcher(int epfd, int sigfd, int infd,
 }
 
 static int run_dispatcher(int epfd, int sigfd, int infd, struct list_head *srcs,
-			  bool *retry)
+			  int format, bool values, bool *retry)
 {
 	struct src_entry *entry;
 	unsigned int max_ev_count;
@@ -343,7 +582,7 @@ static int run_dispatcher(int epfd, int sigfd, int infd, struct list_head *srcs,
 
 			entry = ev->data.ptr;
 			if (ev->events & EPOLLIN)
-				print_event(entry->handle, entry->name);
+				dispatch_events(entry, format, values);
 			if (ev->events & EPOLLERR) {
 				operate_dispatcher(epfd, EPOLL_CTL_DEL, NULL, entry);
 				remove_source_entry(entry);
@@ -388,7 +627,7 @@ static int prepare_signalfd(int *sigfd)
 	return 0;
 }
 
-int monitor(const char *name)
+int monitor(const char *name, int format, bool values)
 {
 	LIST_HEAD(srcs);
 	int sigfd = 0;
@@ -418,6 +657,16 @@ int monitor(const char *name)
 		err = -errno;
 		goto error;
 	}
+
+	if (format != MONITOR_FORMAT_TEXT)
+		setvbuf(stdout, NULL, _IOFBF, 64 * 1024);
+	if (format == MONITOR_FORMAT_BINARY) {
+		struct monitor_stream hdr;
+
+		memcpy(hdr.magic, MONITOR_MAGIC, sizeof(hdr.magic));
+		hdr.version = MONITOR_VERSION;
+		fwrite(&hdr, sizeof(hdr), 1, stdout);
+	}
 retry:
 	retry = false;
 	err = prepare_source_entry(&srcs, name);
@@ -426,7 +675,8 @@ retry:
 
 	err = prepare_dispatcher(epfd, sigfd, infd, &srcs);
 	if (err >= 0)
-		err = run_dispatcher(epfd, sigfd, infd, &srcs, &retry);
+		err = run_dispatcher(epfd, sigfd, infd, &srcs, format, values,
+				     &retry);
 	clear_dispatcher(epfd, sigfd, infd, &srcs);
 
 	if (retry) {
@@ -27,12 +27,13 @@
 #include <stdio.h>
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include "alsactl.h"
 
 
 static char *id_str(snd_ctl_elem_id_t *id)
 {
-	static char str[128];
+	static __thread char str[128];
 	assert(id);
 	sprintf(str, "%i,%i,%i,%s,%i", 
 		snd_ctl_elem_id_get_interface(id),
@@ -45,7 +46,7 @@ static char *id_str(snd_ctl_elem_id_t *id)
 
 static char *num_str(long n)
 {
-	static char str[32];
+	static __thread char str[32];
 	sprintf(str, "%ld", n);
 	return str;
 }
@@ -1192,7 +1193,118 @@ static int restore_config_value2(snd_ctl_t *handle, snd_ctl_elem_info_t *info,
 	return 0;
 }
 
+static unsigned int elem_id_hash(int iface, long device, long subdevice,
+				 const char *name, long index)
+{
+	unsigned int h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619U;
+	h = (h ^ (unsigned int)iface) * 16777619U;
+	h = (h ^ (unsigned int)device) * 16777619U;
+	h = (h ^ (unsigned int)subdevice) * 16777619U;
+	h = (h ^ (unsigned int)index) * 16777619U;
+	return h;
+}
+
+void elem_index_free(struct elem_index *e)
+{
+	if (e->list) {
+		snd_ctl_elem_list_free_space(e->list);
+		snd_ctl_elem_list_free(e->list);
+	}
+	free(e->by_numid);
+	free(e->by_id);
+	memset(e, 0, sizeof(*e));
+}
+
+int elem_index_build(snd_ctl_t *handle, struct elem_index *e)
+{
+	unsigned int i, j, numid, mask;
+	int err;
+
+	memset(e, 0, sizeof(*e));
+	err = snd_ctl_elem_list_malloc(&e->list);
+	if (err < 0)
+		return err;
+	err = snd_ctl_elem_list(handle, e->list);
+	if (err < 0)
+		goto _err;
+	e->count = snd_ctl_elem_list_get_count(e->list);
+	if (e->count > 0) {
+		err = snd_ctl_elem_list_alloc_space(e->list, e->count);
+		if (err < 0)
+			goto _err;
+		err = snd_ctl_elem_list(handle, e->list);
+		if (err < 0)
+			goto _err;
+		e->count = snd_ctl_elem_list_get_used(e->list);
+	}
+	for (e->size = 16; e->size < e->count * 2; e->size *= 2)
+		;
+	mask = e->size - 1;
+	e->by_numid = calloc(e->size, sizeof(*e->by_numid));
+	e->by_id = calloc(e->size, sizeof(*e->by_id));
+	if (e->by_numid == NULL || e->by_id == NULL) {
+		err = -ENOMEM;
+		goto _err;
+	}
+	for (i = 0; i < e->count; i++) {
+		numid = snd_ctl_elem_list_get_numid(e->list, i);
+		for (j = (numid * 2654435761U) & mask; e->by_numid[j];
+		     j = (j + 1) & mask)
+			;
+		e->by_numid[j] = i + 1;
+		j = elem_id_hash(snd_ctl_elem_list_get_interface(e->list, i),
+				 snd_ctl_elem_list_get_device(e->list, i),
+				 snd_ctl_elem_list_get_subdevice(e->list, i),
+				 snd_ctl_elem_list_get_name(e->list, i),
+				 snd_ctl_elem_list_get_index(e->list, i));
+		for (j &= mask; e->by_id[j]; j = (j + 1) & mask)
+			;
+		e->by_id[j] = i + 1;
+	}
+	return 0;
+
+ _err:
+	elem_index_free(e);
+	return err;
+}
+
+int elem_index_has_numid(struct elem_index *e, unsigned int numid)
+{
+	unsigned int j, pos, mask = e->size - 1;
+
+	for (j = (numid * 2654435761U) & mask; (pos = e->by_numid[j]) != 0;
+	     j = (j + 1) & mask) {
+		if (snd_ctl_elem_list_get_numid(e->list, pos - 1) == numid)
+			return 1;
+	}
+	return 0;
+}
+
+/* returns the numid of the matching element or 0 */
+unsigned int elem_index_find(struct elem_index *e, int iface,
+			     long device, long subdevice,
+			     const char *name, long index)
+{
+	unsigned int j, pos, mask = e->size - 1;
+
+	j = elem_id_hash(iface, device, subdevice, name, index);
+	for (j &= mask; (pos = e->by_id[j]) != 0; j = (j + 1) & mask) {
+		pos--;
+		if ((int)snd_ctl_elem_list_get_interface(e->list, pos) == iface &&
+		    snd_ctl_elem_list_get_device(e->list, pos) == device &&
+		    snd_ctl_elem_list_get_subdevice(e->list, pos) == subdevice &&
+		    snd_ctl_elem_list_get_index(e->list, pos) == index &&
+		    strcmp(snd_ctl_elem_list_get_name(e->list, pos), name) == 0)
+			return snd_ctl_elem_list_get_numid(e->list, pos);
+	}
+	return 0;
+}
+
 static int set_control(snd_ctl_t *handle, snd_config_t *control,
+		       struct elem_index *elems, struct ctl_batch *batch,
 		       int *maxnumid, int doit)
 {
 	snd_ctl_elem_value_t *ctl;
@@ -1300,8 +1412,12 @@ static int set_control(snd_ctl_t *handle, snd_config_t *control,
 
 	err = -EINVAL;
 	if (!force_restore) {
-		snd_ctl_elem_info_set_numid(info, numid);
-		err = snd_ctl_elem_info(handle, info);
+		if (elems && !elem_index_has_numid(elems, numid)) {
+			err = -ENOENT;
+		} else {
+			snd_ctl_elem_info_set_numid(info, numid);
+			err = snd_ctl_elem_info(handle, info);
+		}
 	}
 	if (err < 0 && name) {
 		snd_ctl_elem_info_set_numid(info, 0);
@@ -1310,7 +1426,14 @@ static int set_control(snd_ctl_t *handle, snd_config_t *control,
 		snd_ctl_elem_info_set_subdevice(info, subdevice);
 		snd_ctl_elem_info_set_name(info, name);
 		snd_ctl_elem_info_set_index(info, index);
-		err = snd_ctl_elem_info(handle, info);
+		if (elems) {
+			numid1 = elem_index_find(elems, iface, device,
+						 subdevice, name, index);
+			snd_ctl_elem_info_set_numid(info, numid1);
+			err = numid1 ? snd_ctl_elem_info(handle, info) : -ENOENT;
+		} else {
+			err = snd_ctl_elem_info(handle, info);
+		}
 		if (err < 0 && comment && check_comment_access(comment, "user")) {
 			err = add_user_control(handle, info, comment);
 			if (err < 0) {
@@ -1455,6 +1578,12 @@ static int set_control(snd_ctl_t *handle, snd_config_t *control,
 	}
 
  _ok:
+	if (doit && batch) {
+		err = ctl_batch_add(batch, info, ctl);
+		if (err < 0)
+			error("No enough memory...");
+		return err;
+	}
 	err = doit ? snd_ctl_elem_write(handle, ctl) : 0;
 	if (err < 0) {
 		error("Cannot write control '%d:%ld:%ld:%s:%ld' : %s", (int)iface, device, subdevice, name, index, snd_strerror(err));
@@ -1469,7 +1598,9 @@ static int set_controls(int card, snd_config_t *top, int doit)
 	snd_ctl_card_info_t *info;
 	snd_config_t *control;
 	snd_config_iterator_t i, next;
-	int err, maxnumid = -1;
+	struct elem_index elems, *pelems = &elems;
+	struct ctl_batch batch;
+	int err, err2, maxnumid = -1;
 	char name[32], tmpid[16];
 	const char *id;
 	snd_ctl_card_info_alloca(&info);
@@ -1506,17 +1637,29 @@ static int set_controls(int card, snd_config_t *top, int doit)
 		cerror(doit, "state.%s.control is not a compound\n", id);
 		return -EINVAL;
 	}
+	ctl_batch_init(&batch);
+	if (elem_index_build(handle, &elems) < 0) {
+		dbg("cannot index controls, using lookups");
+		pelems = NULL;
+	}
 	snd_config_for_each(i, next, control) {
 		snd_config_t *n = snd_config_iterator_entry(i);
-		err = set_control(handle, n, &maxnumid, doit);
+		err = set_control(handle, n, pelems, &batch, &maxnumid, doit);
 		if (err < 0 && (!force_restore || !doit))
-			goto _close;
+			goto _free;
 	}
 
 	dbg("maxnumid=%i", maxnumid);
 	/* check if we have additional controls in driver */
 	/* in this case we should go through init procedure */
-	if (!doit && maxnumid >= 0) {
+	if (!doit && maxnumid >= 0 && pelems) {
+		if (elem_index_has_numid(&elems, maxnumid + 1)) {
+			/* not very informative */
+			/* but value is used for check only */
+			err = -EAGAIN;
+			dbg("more controls than maxnumid?");
+		}
+	} else if (!doit && maxnumid >= 0) {
 		snd_ctl_elem_info_t *info;
 		snd_ctl_elem_info_alloca(&info);
 		snd_ctl_elem_info_set_numid(info, maxnumid+1);
@@ -1525,74 +1668,210 @@ static int set_controls(int card, snd_config_t *top, int doit)
 			/* but value is used for check only */
 			err = -EAGAIN;
 			dbg("more controls than maxnumid?");
-			goto _close;
 		}
 	}
 
+ _free:
+	if (doit) {
+		/* the values queued so far are written even after an error */
+		err2 = ctl_batch_commit(&batch, handle);
+		if (err2 < 0 && err >= 0)
+			err = err2;
+		dbg("%u controls written, %u unchanged",
+		    batch.written, batch.skipped);
+	}
+	ctl_batch_free(&batch);
+	if (pelems)
+		elem_index_free(pelems);
  _close:
 	snd_ctl_close(handle);
 	dbg("result code: %i", err);
 	return err;
 }
 
-int save_state(const char *file, const char *cardname)
-{
+/*
+ * parallel save and restore: the cards are collected first, processed
+ * by run_jobs() and the results are applied in the card order
+ */
+struct card_job {
+	int card;
+	char name[16];
+	snd_config_t *config;	/* save: private tree for the card */
 	int err;
+	int init_err;
+};
+
+struct restore_ctx {
+	struct card_job *jobs;
 	snd_config_t *config;
-	snd_input_t *in;
-	snd_output_t *out;
-	int stdio;
-	char *nfile = NULL;
-	int lock_fd = -EINVAL;
+	const char *initfile;
+	int initflags;
+	int do_init;
+};
+
+/* init() and init_ucm() share global state */
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int collect_cards(const char *cardname, struct card_job **jobs, int *count)
+{
 	struct snd_card_iterator iter;
+	struct card_job *j;
+	const char *name;
+	int err;
 
-	err = snd_config_top(&config);
-	if (err < 0) {
-		error("snd_config_top error: %s", snd_strerror(err));
+	*jobs = NULL;
+	*count = 0;
+	err = snd_card_iterator_sinit(&iter, cardname);
+	if (err < 0)
 		return err;
-	}
-	stdio = !strcmp(file, "-");
-	if (!stdio) {
-		nfile = malloc(strlen(file) + 5);
-		if (nfile == NULL) {
+	while ((name = snd_card_iterator_next(&iter)) != NULL) {
+		j = realloc(*jobs, (*count + 1) * sizeof(*j));
+		if (j == NULL) {
 			error("No enough memory...");
-			err = -ENOMEM;
-			goto out;
+			free(*jobs);
+			*jobs = NULL;
+			*count = 0;
+			return -ENOMEM;
 		}
-		strcpy(nfile, file);
-		strcat(nfile, ".new");
-		lock_fd = state_lock(file, 10);
-		if (lock_fd < 0) {
-			err = lock_fd;
-			goto out;
+		*jobs = j;
+		j += *count;
+		memset(j, 0, sizeof(*j));
+		j->card = iter.card;
+		snprintf(j->name, sizeof(j->name), "%s", name);
+		(*count)++;
+	}
+	return snd_card_iterator_error(&iter);
+}
+
+static void save_card_job(void *data, int idx)
+{
+	struct card_job *job = (struct card_job *)data + idx;
+
+	job->err = snd_config_top(&job->config);
+	if (job->err < 0) {
+		job->config = NULL;
+		return;
+	}
+	job->err = get_controls(job->card, job->config);
+}
+
+/* move the state.<id>.control nodes of a card tree to top */
+static int merge_card_state(snd_config_t *top, snd_config_t *part)
+{
+	snd_config_t *state, *pstate, *card, *pcard, *control;
+	snd_config_iterator_t i, next;
+	const char *id;
+	int err;
+
+	if (snd_config_search(part, "state", &pstate) < 0)
+		return 0;
+	err = snd_config_search(top, "state", &state);
+	if (err == 0 &&
+	    snd_config_get_type(state) != SND_CONFIG_TYPE_COMPOUND) {
+		error("config state node is not a compound");
+		return -EINVAL;
+	}
+	if (err < 0) {
+		err = snd_config_compound_add(top, "state", 1, &state);
+		if (err < 0) {
+			error("snd_config_compound_add: %s", snd_strerror(err));
+			return err;
 		}
 	}
-	if (!stdio && (err = snd_input_stdio_open(&in, file, "r")) >= 0) {
-		err = snd_config_load(config, in);
-		snd_input_close(in);
-#if 0
+	snd_config_for_each(i, next, pstate) {
+		pcard = snd_config_iterator_entry(i);
+		if (snd_config_get_id(pcard, &id) < 0)
+			continue;
+		if (snd_config_search(state, id, &card) < 0) {
+			snd_config_remove(pcard);
+			err = snd_config_add(state, pcard);
+			if (err < 0) {
+				error("snd_config_add: %s", snd_strerror(err));
+				snd_config_delete(pcard);
+				return err;
+			}
+			continue;
+		}
+		if (snd_config_get_type(card) != SND_CONFIG_TYPE_COMPOUND) {
+			error("config state.%s node is not a compound", id);
+			return -EINVAL;
+		}
+		if (snd_config_search(card, "control", &control) == 0)
+			snd_config_delete(control);
+		if (snd_config_search(pcard, "control", &control) < 0)
+			continue;
+		snd_config_remove(control);
+		err = snd_config_add(card, control);
 		if (err < 0) {
-			error("snd_config_load error: %s", snd_strerror(err));
-			goto out;
+			error("snd_config_add: %s", snd_strerror(err));
+			snd_config_delete(control);
+			return err;
 		}
-#endif
 	}
+	return 0;
+}
 
-	err = snd_card_iterator_sinit(&iter, cardname);
-	if (err < 0)
-		goto out;
-	while (snd_card_iterator_next(&iter)) {
-		if ((err = get_controls(iter.card, config)))
-			goto out;
-	}
-	if (iter.first) {
-		err = snd_card_iterator_error(&iter);
+/* returns the number of saved cards or a negative error code */
+static int save_cards(const char *cardname, snd_config_t *config)
+{
+	struct card_job *jobs;
+	int i, count, err;
+
+	err = collect_cards(cardname, &jobs, &count);
+	if (err < 0 || count == 0)
 		goto out;
+	run_jobs(count, parallel_jobs, save_card_job, jobs);
+	for (i = 0; i < count && err == 0; i++) {
+		err = jobs[i].err;
+		if (err == 0)
+			err = merge_card_state(config, jobs[i].config);
+	}
+	if (err == 0)
+		err = count;
+out:
+	for (i = 0; i < count; i++) {
+		if (jobs[i].config)
+			snd_config_delete(jobs[i].config);
 	}
+	free(jobs);
+	return err;
+}
 
-	if (stdio) {
+static void restore_card_job(void *data, int idx)
+{
+	struct restore_ctx *ctx = data;
+	struct card_job *job = ctx->jobs + idx;
+
+	pthread_mutex_lock(&init_lock);
+	/* error is ignored */
+	init_ucm(ctx->initflags | FLAG_UCM_FBOOT, job->card);
+	pthread_mutex_unlock(&init_lock);
+	/* do a check if controls matches state file */
+	if (ctx->do_init && set_controls(job->card, ctx->config, 0)) {
+		pthread_mutex_lock(&init_lock);
+		job->init_err = init(ctx->initfile,
+				     ctx->initflags | FLAG_UCM_BOOT, job->name);
+		pthread_mutex_unlock(&init_lock);
+	}
+	job->err = set_controls(job->card, ctx->config, 1);
+}
+
+static int write_state(const char *file, snd_config_t *config)
+{
+	snd_output_t *out;
+	char *nfile = NULL;
+	int err;
+
+	if (!strcmp(file, "-")) {
 		err = snd_output_stdio_attach(&out, stdout, 0);
 	} else {
+		nfile = malloc(strlen(file) + 5);
+		if (nfile == NULL) {
+			error("No enough memory...");
+			return -ENOMEM;
+		}
+		strcpy(nfile, file);
+		strcat(nfile, ".new");
 		err = snd_output_stdio_open(&out, nfile, "w");
 	}
 	if (err < 0) {
@@ -1609,22 +1888,183 @@ int save_state(const char *file, const char *cardname)
 		if (err < 0)
 			error("rename failed: %s (%s)", strerror(-err), file);
 	}
+out:
+	free(nfile);
+	return err;
+}
+
+static int read_state(const char *file, snd_config_t *config)
+{
+	snd_input_t *in;
+	int err;
+
+	err = snd_input_stdio_open(&in, file, "r");
+	if (err < 0)
+		return err;
+	err = snd_config_load(config, in);
+	snd_input_close(in);
+	return err;
+}
+
+int save_state(const char *file, const char *cardname)
+{
+	int err;
+	snd_config_t *config;
+	int stdio;
+	int lock_fd = -EINVAL;
+
+	err = snd_config_top(&config);
+	if (err < 0) {
+		error("snd_config_top error: %s", snd_strerror(err));
+		return err;
+	}
+	stdio = !strcmp(file, "-");
+	if (!stdio) {
+		lock_fd = state_lock(file, 10);
+		if (lock_fd < 0) {
+			err = lock_fd;
+			goto out;
+		}
+		/* errors are ignored, the file is rewritten */
+		read_state(file, config);
+	}
+
+	err = save_cards(cardname, config);
+	if (err <= 0)	/* error or no cards */
+		goto out;
+
+	err = write_state(file, config);
 out:
 	if (!stdio && lock_fd >= 0)
 		state_unlock(lock_fd, file);
-	free(nfile);
 	snd_config_delete(config);
 	snd_config_update_free_global();
 	return err;
 }
 
+/*
+ * Incremental saving for the daemon: the state tree is built once by
+ * state_snapshot() and afterwards only the controls reported by events
+ * are refreshed before the tree is written again.
+ */
+int state_snapshot(const char *file, const char *cardname, snd_config_t **top)
+{
+	snd_config_t *config;
+	int err, lock_fd;
+
+	err = snd_config_top(&config);
+	if (err < 0) {
+		error("snd_config_top error: %s", snd_strerror(err));
+		return err;
+	}
+	if (strcmp(file, "-")) {
+		lock_fd = state_lock(file, 10);
+		if (lock_fd < 0) {
+			err = lock_fd;
+			goto out;
+		}
+		read_state(file, config);
+		state_unlock(lock_fd, file);
+	}
+	err = save_cards(cardname, config);
+	if (err <= 0) {
+		if (err == 0)
+			err = -ENODEV;
+		goto out;
+	}
+	*top = config;
+	return 0;
+out:
+	snd_config_delete(config);
+	return err;
+}
+
+int state_snapshot_card(snd_config_t *top, int cardno)
+{
+	return get_controls(cardno, top);
+}
+
+int state_snapshot_control(snd_config_t *top, const char *cardid,
+			   snd_ctl_t *handle, snd_ctl_elem_id_t *id)
+{
+	snd_config_t *control, *tmp, *n, *old;
+	snd_ctl_elem_info_t *info;
+	char key[16];
+	int err;
+	snd_ctl_elem_info_alloca(&info);
+
+	err = snd_config_searchv(top, &control, "state", cardid, "control", 0);
+	if (err < 0)
+		return err;
+	sprintf(key, "%u", snd_ctl_elem_id_get_numid(id));
+	if (snd_config_search(control, key, &old) < 0)
+		old = NULL;
+	snd_ctl_elem_info_set_id(info, id);
+	err = snd_ctl_elem_info(handle, info);
+	if (err == -ENOENT) {
+		/* the element was removed */
+		if (old)
+			snd_config_delete(old);
+		return 0;
+	}
+	if (err < 0)
+		return err;
+
+	err = snd_config_make_compound(&tmp, NULL, 0);
+	if (err < 0)
+		return err;
+	err = get_control(handle, id, tmp);
+	if (err < 0)
+		goto out;
+	if (snd_config_search(tmp, key, &n) < 0) {
+		/* not readable */
+		if (old)
+			snd_config_delete(old);
+		goto out;
+	}
+	snd_config_remove(n);
+	if (old) {
+		/* keep the order of the controls in the file */
+		err = snd_config_add_after(old, n);
+		if (err >= 0)
+			snd_config_delete(old);
+	} else {
+		err = snd_config_add(control, n);
+	}
+	if (err < 0) {
+		error("snd_config_add: %s", snd_strerror(err));
+		snd_config_delete(n);
+	}
+out:
+	snd_config_delete(tmp);
+	return err;
+}
+
+int state_snapshot_save(const char *file, snd_config_t *top)
+{
+	int err, lock_fd = -EINVAL;
+
+	if (strcmp(file, "-")) {
+		lock_fd = state_lock(file, 10);
+		if (lock_fd < 0)
+			return lock_fd;
+	}
+	err = write_state(file, top);
+	if (lock_fd >= 0)
+		state_unlock(lock_fd, file);
+	return err;
+}
+
 int load_state(const char *file, const char *initfile, int initflags,
 	       const char *cardname, int do_init)
 {
 	int err, finalerr = 0, open_failed;
 	struct snd_card_iterator iter;
+	struct card_job *jobs;
+	struct restore_ctx ctx;
 	snd_config_t *config;
 	const char *cardname1;
+	int i, count;
 
 	err = load_configuration(file, &config, &open_failed);
 	if (err < 0 && !open_failed)
@@ -1653,27 +2093,28 @@ int load_state(const char *file, const char *initfile, int initflags,
 		goto out;
 	}
 
-	err = snd_card_iterator_sinit(&iter, cardname);
-	if (err < 0)
-		goto out;
-	while ((cardname1 = snd_card_iterator_next(&iter)) != NULL) {
-		/* error is ignored */
-		init_ucm(initflags | FLAG_UCM_FBOOT, iter.card);
-		/* do a check if controls matches state file */
-		if (do_init && set_controls(iter.card, config, 0)) {
-			err = init(initfile, initflags | FLAG_UCM_BOOT, cardname1);
-			if (err < 0) {
-				initfailed(iter.card, "init", err);
-				finalerr = err;
-			}
+	err = collect_cards(cardname, &jobs, &count);
+	if (count > 0) {
+		ctx.jobs = jobs;
+		ctx.config = config;
+		ctx.initfile = initfile;
+		ctx.initflags = initflags;
+		ctx.do_init = do_init;
+		run_jobs(count, parallel_jobs, restore_card_job, &ctx);
+	}
+	for (i = 0; i < count; i++) {
+		if (jobs[i].init_err < 0) {
+			initfailed(jobs[i].card, "init", jobs[i].init_err);
+			finalerr = jobs[i].init_err;
 		}
-		if ((err = set_controls(iter.card, config, 1))) {
+		if (jobs[i].err) {
 			if (!force_restore)
-				finalerr = err;
-			initfailed(iter.card, "restore", err);
+				finalerr = jobs[i].err;
+			initfailed(jobs[i].card, "restore", jobs[i].err);
 		}
 	}
-	err = finalerr ? finalerr : snd_card_iterator_error(&iter);
+	free(jobs);
+	err = finalerr ? finalerr : err;
 out:
 	snd_config_delete(config);
 	snd_config_update_free_global();
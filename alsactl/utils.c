@@ -28,6 +28,7 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <syslog.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include "alsactl.h"
@@ -100,6 +101,61 @@ void initfailed(int cardnumber, const char *reason, int exitcode)
 	free(str);
 }
 
+struct jobs {
+	pthread_mutex_t lock;
+	int next;
+	int count;
+	void (*fn)(void *data, int idx);
+	void *data;
+};
+
+static void *jobs_thread(void *arg)
+{
+	struct jobs *j = arg;
+	int idx;
+
+	while (1) {
+		pthread_mutex_lock(&j->lock);
+		idx = j->next < j->count ? j->next++ : -1;
+		pthread_mutex_unlock(&j->lock);
+		if (idx < 0)
+			break;
+		j->fn(j->data, idx);
+	}
+	return NULL;
+}
+
+/*
+ * call fn(data, idx) for each idx in 0..count-1 using up to nthreads
+ * threads (the caller included); the order of the calls is not defined
+ */
+void run_jobs(int count, int nthreads, void (*fn)(void *data, int idx), void *data)
+{
+	struct jobs j;
+	pthread_t *tids = NULL;
+	int i, started = 0;
+
+	j.next = 0;
+	j.count = count;
+	j.fn = fn;
+	j.data = data;
+	pthread_mutex_init(&j.lock, NULL);
+	if (nthreads > count)
+		nthreads = count;
+	if (nthreads > 1)
+		tids = calloc(nthreads - 1, sizeof(*tids));
+	for (i = 0; tids && i < nthreads - 1; i++) {
+		if (pthread_create(&tids[i], NULL, jobs_thread, &j))
+			break;
+		started++;
+	}
+	jobs_thread(&j);
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	pthread_mutex_destroy(&j.lock);
+}
+
 static void syslog_(int prio, const char *fcn, long line,
 		    const char *fmt, va_list ap)
 {
@@ -32,6 +32,7 @@
 #include <malloc.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
 #include <getopt.h>
@@ -46,7 +47,10 @@
 #include <termios.h>
 #include <signal.h>
 #include <poll.h>
+#include <pthread.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
+#include <netdb.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -71,6 +75,10 @@
 #define be16toh(x) __be16_to_cpu(x)
 #define le32toh(x) __le32_to_cpu(x)
 #define be32toh(x) __be32_to_cpu(x)
+#define htole16(x) __cpu_to_le16(x)
+#define htobe16(x) __cpu_to_be16(x)
+#define htole32(x) __cpu_to_le32(x)
+#define htobe32(x) __cpu_to_be32(x)
 #endif
 
 #define DEFAULT_FORMAT		SND_PCM_FORMAT_U8
@@ -102,7 +110,7 @@ static struct {
 	snd_pcm_format_t format;
 	unsigned int channels;
 	unsigned int rate;
-} hwparams, rhwparams;
+} hwparams, rhwparams, ghwparams;
 static int timelimit = 0;
 static int sampleslimit = 0;
 static int quiet_mode = 0;
@@ -113,6 +121,7 @@ static int mmap_flag = 0;
 static int interleaved = 1;
 static int nonblock = 0;
 static volatile sig_atomic_t in_aborting = 0;
+static volatile sig_atomic_t in_signal_exit = 0;
 static u_char *audiobuf = NULL;
 static snd_pcm_uframes_t chunk_size = 0;
 static unsigned period_time = 0;
@@ -141,6 +150,23 @@ static int use_strftime = 0;
 volatile static int recycle_capture_file = 0;
 static long term_c_lflag = -1;
 static int dump_hw_params = 0;
+static int gapless = 0;
+static int gapless_setup = 0;
+static unsigned int gapless_rate;
+static char *gapless_next = NULL;	/* file played after the current one */
+static char *gapless_fd_name = NULL;
+static int gapless_fd = -1;		/* early opened descriptor of gapless_next */
+static u_char *gapless_buf = NULL;	/* frames carried over to the next file */
+static size_t gapless_frames = 0;
+static FILE *telemetry_file = NULL;
+static unsigned int read_threads = 0;
+static int convert = 0;
+static snd_pcm_format_t conv_format = SND_PCM_FORMAT_UNKNOWN;	/* device format */
+static size_t conv_bits_per_frame;
+static int32_t *conv_tmp = NULL;
+static u_char *conv_buf = NULL;
+static char **tee_names = NULL;
+static unsigned int tee_count = 0;
 
 static int fd = -1;
 static off64_t pbrec_count = LLONG_MAX, fdcount;
@@ -172,6 +198,8 @@ static void begin_au(int fd, size_t count);
 static void end_au(int fd);
 
 static void suspend(void);
+static void gapless_flush(void);
+static void tee_stop(void);
 
 static const struct fmt_capture {
 	void (*start) (int fd, size_t count);
@@ -247,6 +275,15 @@ _("Usage: %s [OPTION]... [FILE]...\n"
 "    --use-strftime      apply the strftime facility to the output file name\n"
 "    --dump-hw-params    dump hw_params of the device\n"
 "    --fatal-errors      treat all errors as fatal\n"
+"    --gapless           play files back to back without draining the PCM\n"
+"    --telemetry=FILE    log avail, delay and timestamps of each period and\n"
+"                        the length and recovery time of each xrun as CSV\n"
+"    --read-threads=#    read the separate channel files with # threads\n"
+"                        ahead of the device (default 0 = sequential)\n"
+"    --convert           convert the sample format in aplay when the device\n"
+"                        does not support the format of the file\n"
+"    --tee=SINK          also send the captured data to SINK (a file, - for\n"
+"                        stdout, tcp:HOST:PORT or udp:HOST:PORT), repeatable\n"
   )
 		, command);
 	printf(_("Recognized sample formats are:"));
@@ -382,11 +419,24 @@ static void version(void)
  */
 static void prg_exit(int code) 
 {
+	/* the tee threads may hold the ring lock or block on a stalled
+	 * sink, leave them to exit() when called from a signal handler */
+	if (!in_signal_exit) {
+		tee_stop();
+		/* the next file may have been opened before playback stopped */
+		if (gapless_fd >= 0)
+			close(gapless_fd);
+		gapless_fd = -1;
+		free(gapless_buf);
+		gapless_buf = NULL;
+	}
 	done_stdin();
 	if (handle)
 		snd_pcm_close(handle);
 	if (pidfile_written)
 		remove (pidfile_name);
+	if (telemetry_file)
+		fclose(telemetry_file);
 	exit(code);
 }
 
@@ -405,6 +455,7 @@ static void signal_handler(int sig)
 	if (sig == SIGABRT) {
 		/* do not call snd_pcm_close() and abort immediately */
 		handle = NULL;
+		in_signal_exit = 1;
 		prg_exit(EXIT_FAILURE);
 	}
 	signal(sig, SIG_DFL);
@@ -433,6 +484,11 @@ enum {
 	OPT_USE_STRFTIME,
 	OPT_DUMP_HWPARAMS,
 	OPT_FATAL_ERRORS,
+	OPT_GAPLESS,
+	OPT_TELEMETRY,
+	OPT_READ_THREADS,
+	OPT_CONVERT,
+	OPT_TEE,
 };
 
 /*
@@ -538,6 +594,11 @@ int main(int argc, char *argv[])
 		{"interactive", 0, 0, 'i'},
 		{"dump-hw-params", 0, 0, OPT_DUMP_HWPARAMS},
 		{"fatal-errors", 0, 0, OPT_FATAL_ERRORS},
+		{"gapless", 0, 0, OPT_GAPLESS},
+		{"telemetry", 1, 0, OPT_TELEMETRY},
+		{"read-threads", 1, 0, OPT_READ_THREADS},
+		{"convert", 0, 0, OPT_CONVERT},
+		{"tee", 1, 0, OPT_TEE},
 #ifdef CONFIG_SUPPORT_CHMAP
 		{"chmap", 1, 0, 'm'},
 #endif
@@ -823,6 +884,35 @@ int main(int argc, char *argv[])
 		case OPT_FATAL_ERRORS:
 			fatal_errors = 1;
 			break;
+		case OPT_GAPLESS:
+			gapless = 1;
+			break;
+		case OPT_TELEMETRY:
+			telemetry_file = fopen(optarg, "w");
+			if (telemetry_file == NULL) {
+				error(_("Cannot create telemetry file %s: %s"),
+				      optarg, strerror(errno));
+				return 1;
+			}
+			break;
+		case OPT_CONVERT:
+			convert = 1;
+			break;
+		case OPT_TEE:
+			tee_names = realloc(tee_names, (tee_count + 1) * sizeof(*tee_names));
+			if (tee_names == NULL) {
+				error(_("not enough memory"));
+				return 1;
+			}
+			tee_names[tee_count++] = optarg;
+			break;
+		case OPT_READ_THREADS:
+			read_threads = parse_long(optarg, &err);
+			if (err < 0) {
+				error(_("invalid read threads argument '%s'"), optarg);
+				return 1;
+			}
+			break;
 #ifdef CONFIG_SUPPORT_CHMAP
 		case 'm':
 			channel_map = snd_pcm_chmap_parse_string(optarg);
@@ -838,6 +928,11 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (tee_count && (stream != SND_PCM_STREAM_CAPTURE || !interleaved)) {
+		error(_("--tee works only for interleaved capture"));
+		return 1;
+	}
+
 	if (do_device_list) {
 		if (do_pcm_list) pcm_list();
 		device_list();
@@ -869,6 +964,13 @@ int main(int argc, char *argv[])
 	if (!user_set_fmt)
 		try_to_adjust_default_format_16bit();
 
+	if (telemetry_file) {
+		fprintf(telemetry_file, "# %s pid=%d device=%s\n",
+			command, getpid(), snd_pcm_name(handle));
+		fprintf(telemetry_file, "system_ns,event,frames,avail,delay,"
+			"hw_ns,audio_ns,xrun_ns,recovery_ns\n");
+	}
+
 	chunk_size = 1024;
 	hwparams = rhwparams;
 
@@ -916,9 +1018,11 @@ int main(int argc, char *argv[])
 				capture(NULL);
 		} else {
 			while (optind <= argc - 1) {
-				if (stream == SND_PCM_STREAM_PLAYBACK)
+				if (stream == SND_PCM_STREAM_PLAYBACK) {
+					if (gapless)
+						gapless_next = optind < argc - 1 ? argv[optind + 1] : NULL;
 					playback(argv[optind++]);
-				else
+				} else
 					capture(argv[optind++]);
 			}
 		}
@@ -1323,6 +1427,206 @@ static int setup_chmap(void)
 #define setup_chmap()	0
 #endif
 
+/*
+ * native sample format conversion (--convert) for devices which don't
+ * accept the format of the file, e.g. hw: devices without the plug layer;
+ * samples pass through a left-justified 32-bit intermediate buffer and the
+ * per-format loops are kept simple enough for the compiler to vectorize
+ */
+
+static int conv_supported(snd_pcm_format_t format)
+{
+	if (format == SND_PCM_FORMAT_FLOAT_LE ||
+	    format == SND_PCM_FORMAT_FLOAT_BE)
+		return 1;
+	/* DSD bitstreams count as linear but are not PCM samples */
+	switch (format) {
+	case SND_PCM_FORMAT_DSD_U8:
+	case SND_PCM_FORMAT_DSD_U16_LE:
+	case SND_PCM_FORMAT_DSD_U32_LE:
+	case SND_PCM_FORMAT_DSD_U16_BE:
+	case SND_PCM_FORMAT_DSD_U32_BE:
+		return 0;
+	default:
+		break;
+	}
+	if (snd_pcm_format_linear(format) != 1)
+		return 0;
+	switch (snd_pcm_format_physical_width(format)) {
+	case 8:
+	case 16:
+	case 24:
+	case 32:
+		return 1;
+	}
+	return 0;
+}
+
+static void conv_to_s32(const u_char *src, snd_pcm_format_t format,
+			int32_t *dst, size_t n)
+{
+	int big = snd_pcm_format_big_endian(format) == 1;
+	int shift = 32 - snd_pcm_format_width(format);
+	uint32_t flip = snd_pcm_format_signed(format) == 1 ? 0 : 0x80000000U;
+	size_t i;
+
+	if (format == SND_PCM_FORMAT_FLOAT_LE ||
+	    format == SND_PCM_FORMAT_FLOAT_BE) {
+		for (i = 0; i < n; i++) {
+			uint32_t v;
+			float f;
+			memcpy(&v, src + i * 4, 4);
+			v = big ? be32toh(v) : le32toh(v);
+			memcpy(&f, &v, 4);
+			if (f >= 1.0f)
+				dst[i] = INT32_MAX;
+			else if (f <= -1.0f)
+				dst[i] = INT32_MIN;
+			else
+				dst[i] = (int32_t)(f * 2147483648.0f);
+		}
+		return;
+	}
+
+	switch (snd_pcm_format_physical_width(format)) {
+	case 8:
+		for (i = 0; i < n; i++)
+			dst[i] = ((uint32_t)src[i] << 24) ^ flip;
+		break;
+	case 16:
+		for (i = 0; i < n; i++) {
+			uint16_t v;
+			memcpy(&v, src + i * 2, 2);
+			v = big ? be16toh(v) : le16toh(v);
+			dst[i] = ((uint32_t)v << shift) ^ flip;
+		}
+		break;
+	case 24:
+		for (i = 0; i < n; i++, src += 3) {
+			uint32_t v;
+			if (big)
+				v = (src[0] << 16) | (src[1] << 8) | src[2];
+			else
+				v = src[0] | (src[1] << 8) | (src[2] << 16);
+			dst[i] = (v << shift) ^ flip;
+		}
+		break;
+	case 32:
+		for (i = 0; i < n; i++) {
+			uint32_t v;
+			memcpy(&v, src + i * 4, 4);
+			v = big ? be32toh(v) : le32toh(v);
+			dst[i] = (v << shift) ^ flip;
+		}
+		break;
+	}
+}
+
+static void conv_from_s32(const int32_t *src, snd_pcm_format_t format,
+			  u_char *dst, size_t n)
+{
+	int big = snd_pcm_format_big_endian(format) == 1;
+	int sign = snd_pcm_format_signed(format) == 1;
+	int shift = 32 - snd_pcm_format_width(format);
+	size_t i;
+
+	if (format == SND_PCM_FORMAT_FLOAT_LE ||
+	    format == SND_PCM_FORMAT_FLOAT_BE) {
+		for (i = 0; i < n; i++) {
+			float f = src[i] * (1.0f / 2147483648.0f);
+			uint32_t v;
+			memcpy(&v, &f, 4);
+			v = big ? htobe32(v) : htole32(v);
+			memcpy(dst + i * 4, &v, 4);
+		}
+		return;
+	}
+
+	switch (snd_pcm_format_physical_width(format)) {
+	case 8:
+		for (i = 0; i < n; i++)
+			dst[i] = sign ? (uint32_t)(src[i] >> 24) :
+				((uint32_t)src[i] ^ 0x80000000U) >> 24;
+		break;
+	case 16:
+		for (i = 0; i < n; i++) {
+			uint16_t v = sign ? (uint32_t)(src[i] >> shift) :
+				((uint32_t)src[i] ^ 0x80000000U) >> shift;
+			v = big ? htobe16(v) : htole16(v);
+			memcpy(dst + i * 2, &v, 2);
+		}
+		break;
+	case 24:
+		for (i = 0; i < n; i++, dst += 3) {
+			uint32_t v = sign ? (uint32_t)(src[i] >> shift) :
+				((uint32_t)src[i] ^ 0x80000000U) >> shift;
+			if (big) {
+				dst[0] = v >> 16;
+				dst[1] = v >> 8;
+				dst[2] = v;
+			} else {
+				dst[0] = v;
+				dst[1] = v >> 8;
+				dst[2] = v >> 16;
+			}
+		}
+		break;
+	case 32:
+		for (i = 0; i < n; i++) {
+			uint32_t v = sign ? (uint32_t)(src[i] >> shift) :
+				((uint32_t)src[i] ^ 0x80000000U) >> shift;
+			v = big ? htobe32(v) : htole32(v);
+			memcpy(dst + i * 4, &v, 4);
+		}
+		break;
+	}
+}
+
+/* lossless formats first (the narrowest one), then the widest lossy one */
+static snd_pcm_format_t conv_pick_format(snd_pcm_hw_params_t *params)
+{
+	snd_pcm_format_t format, best = SND_PCM_FORMAT_UNKNOWN;
+	int width = snd_pcm_format_width(hwparams.format);
+	int fwidth, score, best_score = -1;
+
+	for (format = 0; format <= SND_PCM_FORMAT_LAST; format++) {
+		if (!conv_supported(format) ||
+		    snd_pcm_hw_params_test_format(handle, params, format) < 0)
+			continue;
+		fwidth = snd_pcm_format_width(format);
+		score = fwidth >= width ? 64 - fwidth : fwidth - 64;
+		score = (score + 64) * 8;
+		if (snd_pcm_format_cpu_endian(format) == 1)
+			score += 4;
+		if (snd_pcm_format_linear(format) == 1)
+			score += 2;
+		if (snd_pcm_format_signed(format) == 1)
+			score += 1;
+		if (score > best_score) {
+			best_score = score;
+			best = format;
+		}
+	}
+	return best;
+}
+
+static u_char *convert_to_hw(u_char *data, size_t frames)
+{
+	size_t n = frames * hwparams.channels;
+
+	conv_to_s32(data, hwparams.format, conv_tmp, n);
+	conv_from_s32(conv_tmp, conv_format, conv_buf, n);
+	return conv_buf;
+}
+
+static void convert_from_hw(u_char *data, size_t frames)
+{
+	size_t n = frames * hwparams.channels;
+
+	conv_to_s32(conv_buf, conv_format, conv_tmp, n);
+	conv_from_s32(conv_tmp, hwparams.format, data, n);
+}
+
 static void set_params(void)
 {
 	snd_pcm_hw_params_t *params;
@@ -1332,6 +1636,23 @@ static void set_params(void)
 	size_t n;
 	unsigned int rate;
 	snd_pcm_uframes_t start_threshold, stop_threshold;
+	if (gapless) {
+		/* keep the stream running when the format did not change */
+		if (gapless_setup &&
+		    hwparams.format == ghwparams.format &&
+		    hwparams.channels == ghwparams.channels &&
+		    hwparams.rate == ghwparams.rate) {
+			hwparams.rate = gapless_rate;
+			return;
+		}
+		if (gapless_setup) {
+			gapless_flush();
+			snd_pcm_nonblock(handle, 0);
+			snd_pcm_drain(handle);
+			snd_pcm_nonblock(handle, nonblock);
+		}
+		ghwparams = hwparams;
+	}
 	snd_pcm_hw_params_alloca(&params);
 	snd_pcm_sw_params_alloca(&swparams);
 	err = snd_pcm_hw_params_any(handle, params);
@@ -1363,7 +1684,18 @@ static void set_params(void)
 		error(_("Access type not available"));
 		prg_exit(EXIT_FAILURE);
 	}
+	conv_format = SND_PCM_FORMAT_UNKNOWN;
 	err = snd_pcm_hw_params_set_format(handle, params, hwparams.format);
+	if (err < 0 && convert && interleaved && conv_supported(hwparams.format)) {
+		conv_format = conv_pick_format(params);
+		if (conv_format != SND_PCM_FORMAT_UNKNOWN) {
+			err = snd_pcm_hw_params_set_format(handle, params, conv_format);
+			if (err >= 0 && !quiet_mode)
+				fprintf(stderr, _("Converting %s to %s\n"),
+					snd_pcm_format_name(hwparams.format),
+					snd_pcm_format_name(conv_format));
+		}
+	}
 	if (err < 0) {
 		error(_("Sample format non available"));
 		show_available_sample_formats(params);
@@ -1470,6 +1802,14 @@ static void set_params(void)
 	err = snd_pcm_sw_params_set_stop_threshold(handle, swparams, stop_threshold);
 	assert(err >= 0);
 
+	if (telemetry_file) {
+		/* hw timestamps are needed to line up with system events */
+		snd_pcm_sw_params_set_tstamp_mode(handle, swparams,
+						  SND_PCM_TSTAMP_ENABLE);
+		snd_pcm_sw_params_set_tstamp_type(handle, swparams,
+						  SND_PCM_TSTAMP_TYPE_MONOTONIC);
+	}
+
 	if (snd_pcm_sw_params(handle, swparams) < 0) {
 		error(_("unable to install sw params:"));
 		snd_pcm_sw_params_dump(swparams, log);
@@ -1491,6 +1831,27 @@ static void set_params(void)
 		error(_("not enough memory"));
 		prg_exit(EXIT_FAILURE);
 	}
+	if (conv_format != SND_PCM_FORMAT_UNKNOWN) {
+		conv_bits_per_frame = snd_pcm_format_physical_width(conv_format) *
+				      hwparams.channels;
+		conv_tmp = realloc(conv_tmp, chunk_size * hwparams.channels *
+					     sizeof(*conv_tmp));
+		conv_buf = realloc(conv_buf, chunk_size * conv_bits_per_frame / 8);
+		if (conv_tmp == NULL || conv_buf == NULL) {
+			error(_("not enough memory"));
+			prg_exit(EXIT_FAILURE);
+		}
+	}
+	if (gapless) {
+		gapless_buf = realloc(gapless_buf, chunk_bytes);
+		if (gapless_buf == NULL) {
+			error(_("not enough memory"));
+			prg_exit(EXIT_FAILURE);
+		}
+		gapless_frames = 0;
+		gapless_rate = hwparams.rate;
+		gapless_setup = 1;
+	}
 	// fprintf(stderr, "real chunk_size = %i, frags = %i, total = %i\n", chunk_size, setup.buf.block.frags, setup.buf.block.frags * chunk_size);
 
 	/* stereo VU-meter isn't always available... */
@@ -1516,6 +1877,12 @@ static void set_params(void)
 	}
 
 	buffer_frames = buffer_size;	/* for position test */
+
+	if (telemetry_file)
+		fprintf(telemetry_file, "# setup format=%s rate=%u channels=%u "
+			"period=%lu buffer=%lu\n",
+			snd_pcm_format_name(hwparams.format), hwparams.rate,
+			hwparams.channels, chunk_size, buffer_size);
 }
 
 static void init_stdin(void)
@@ -1641,10 +2008,53 @@ do { \
 } while (0)
 #endif
 
+/*
+ * telemetry: one CSV record per transfer and per xrun or suspend,
+ * all times are in nanoseconds
+ */
+
+static long long telemetry_now(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+#else
+	struct timeval now;
+
+	gettimeofday(&now, 0);
+	return now.tv_sec * 1000000000LL + now.tv_usec * 1000LL;
+#endif
+}
+
+static void telemetry_record(const char *event, snd_pcm_status_t *status,
+			     snd_pcm_sframes_t frames, long long xrun_ns,
+			     long long recovery_ns)
+{
+	snd_htimestamp_t tstamp, audio_tstamp;
+
+	if (status == NULL) {
+		snd_pcm_status_alloca(&status);
+		if (snd_pcm_status(handle, status) < 0)
+			return;
+	}
+	snd_pcm_status_get_htstamp(status, &tstamp);
+	snd_pcm_status_get_audio_htstamp(status, &audio_tstamp);
+	fprintf(telemetry_file, "%lld,%s,%li,%li,%li,%lld,%lld,%lld,%lld\n",
+		telemetry_now(), event, (long)frames,
+		(long)snd_pcm_status_get_avail(status),
+		(long)snd_pcm_status_get_delay(status),
+		tstamp.tv_sec * 1000000000LL + tstamp.tv_nsec,
+		audio_tstamp.tv_sec * 1000000000LL + audio_tstamp.tv_nsec,
+		xrun_ns, recovery_ns);
+}
+
 /* I/O error handler */
 static void xrun(void)
 {
 	snd_pcm_status_t *status;
+	long long xrun_ns = 0, start_ns;
 	int res;
 	
 	snd_pcm_status_alloca(&status);
@@ -1665,6 +2075,7 @@ static void xrun(void)
 			clock_gettime(CLOCK_MONOTONIC, &now);
 			snd_pcm_status_get_trigger_htstamp(status, &tstamp);
 			timermsub(&now, &tstamp, &diff);
+			xrun_ns = diff.tv_sec * 1000000000LL + diff.tv_nsec;
 			fprintf(stderr, _("%s!!! (at least %.3f ms long)\n"),
 				stream == SND_PCM_STREAM_PLAYBACK ? _("underrun") : _("overrun"),
 				diff.tv_sec * 1000 + diff.tv_nsec / 1000000.0);
@@ -1676,6 +2087,7 @@ static void xrun(void)
 			gettimeofday(&now, 0);
 			snd_pcm_status_get_trigger_tstamp(status, &tstamp);
 			timersub(&now, &tstamp, &diff);
+			xrun_ns = diff.tv_sec * 1000000000LL + diff.tv_usec * 1000LL;
 			fprintf(stderr, _("%s!!! (at least %.3f ms long)\n"),
 				stream == SND_PCM_STREAM_PLAYBACK ? _("underrun") : _("overrun"),
 				diff.tv_sec * 1000 + diff.tv_usec / 1000.0);
@@ -1684,10 +2096,14 @@ static void xrun(void)
 			fprintf(stderr, _("Status:\n"));
 			snd_pcm_status_dump(status, log);
 		}
+		start_ns = telemetry_now();
 		if ((res = snd_pcm_prepare(handle))<0) {
 			error(_("xrun: prepare error: %s"), snd_strerror(res));
 			prg_exit(EXIT_FAILURE);
 		}
+		if (telemetry_file)
+			telemetry_record("xrun", status, 0, xrun_ns,
+					 telemetry_now() - start_ns);
 		return;		/* ok, data should be accepted again */
 	}
 	if (snd_pcm_status_get_state(status) == SND_PCM_STATE_DRAINING) {
@@ -1715,6 +2131,7 @@ static void xrun(void)
 /* I/O suspend handler */
 static void suspend(void)
 {
+	long long start_ns = telemetry_now();
 	int res;
 
 	if (!quiet_mode) {
@@ -1733,6 +2150,9 @@ static void suspend(void)
 	}
 	if (!quiet_mode)
 		fprintf(stderr, _("Done.\n"));
+	if (telemetry_file)
+		telemetry_record("suspend", NULL, 0, 0,
+				 telemetry_now() - start_ns);
 }
 
 static void print_vu_meter_mono(int perc, int maxperc)
@@ -2109,12 +2529,19 @@ static ssize_t pcm_write(u_char *data, size_t count)
 {
 	ssize_t r;
 	ssize_t result = 0;
+	size_t frame_bits = bits_per_frame;
+	u_char *src;
 
 	if (count < chunk_size) {
 		snd_pcm_format_set_silence(hwparams.format, data + count * bits_per_frame / 8, (chunk_size - count) * hwparams.channels);
 		count = chunk_size;
 	}
 	data = remap_data(data, count);
+	src = data;
+	if (conv_format != SND_PCM_FORMAT_UNKNOWN) {
+		data = convert_to_hw(data, count);
+		frame_bits = conv_bits_per_frame;
+	}
 	while (count > 0 && !in_aborting) {
 		if (test_position)
 			do_test_position();
@@ -2135,10 +2562,13 @@ static ssize_t pcm_write(u_char *data, size_t count)
 		}
 		if (r > 0) {
 			if (vumeter)
-				compute_max_peak(data, r * hwparams.channels);
+				compute_max_peak(src, r * hwparams.channels);
+			if (telemetry_file)
+				telemetry_record("period", NULL, r, 0, 0);
 			result += r;
 			count -= r;
-			data += r * bits_per_frame / 8;
+			data += r * frame_bits / 8;
+			src += r * bits_per_frame / 8;
 		}
 	}
 	return result;
@@ -2186,6 +2616,8 @@ static ssize_t pcm_writev(u_char **data, unsigned int channels, size_t count)
 				for (channel = 0; channel < channels; channel++)
 					compute_max_peak(data[channel], r);
 			}
+			if (telemetry_file)
+				telemetry_record("period", NULL, r, 0, 0);
 			result += r;
 			count -= r;
 		}
@@ -2213,7 +2645,10 @@ static ssize_t pcm_read(u_char *data, size_t rcount)
 		if (test_position)
 			do_test_position();
 		check_stdin();
-		r = readi_func(handle, data, count);
+		if (conv_format != SND_PCM_FORMAT_UNKNOWN)
+			r = readi_func(handle, conv_buf, count);
+		else
+			r = readi_func(handle, data, count);
 		if (test_position)
 			do_test_position();
 		if (r == -EAGAIN || (r >= 0 && (size_t)r < count)) {
@@ -2228,8 +2663,12 @@ static ssize_t pcm_read(u_char *data, size_t rcount)
 			prg_exit(EXIT_FAILURE);
 		}
 		if (r > 0) {
+			if (conv_format != SND_PCM_FORMAT_UNKNOWN)
+				convert_from_hw(data, r);
 			if (vumeter)
 				compute_max_peak(data, r * hwparams.channels);
+			if (telemetry_file)
+				telemetry_record("period", NULL, r, 0, 0);
 			result += r;
 			count -= r;
 			data += r * bits_per_frame / 8;
@@ -2279,6 +2718,8 @@ static ssize_t pcm_readv(u_char **data, unsigned int channels, size_t rcount)
 				for (channel = 0; channel < channels; channel++)
 					compute_max_peak(data[channel], r);
 			}
+			if (telemetry_file)
+				telemetry_record("period", NULL, r, 0, 0);
 			result += r;
 			count -= r;
 		}
@@ -2390,6 +2831,7 @@ static void voc_play(int fd, int ofs, char *name)
 			prg_exit(EXIT_FAILURE);
 		}
 	}
+	gapless_flush();
 	hwparams.format = default_format;
 	hwparams.channels = 1;
 	hwparams.rate = DEFAULT_SPEED;
@@ -2832,6 +3274,83 @@ static void header(int rtype, char *name)
 	}
 }
 
+/*
+ * gapless playback: a partial chunk at the end of a file is carried over
+ * and completed with the first frames of the next file instead of being
+ * padded with silence
+ */
+
+static ssize_t gapless_write(u_char *data, size_t count)
+{
+	size_t frame_bytes = bits_per_frame / 8;
+	size_t n, done = 0;
+
+	if (!gapless)
+		return pcm_write(data, count);
+	if (gapless_frames > 0) {
+		n = chunk_size - gapless_frames;
+		if (n > count)
+			n = count;
+		memcpy(gapless_buf + gapless_frames * frame_bytes, data,
+		       n * frame_bytes);
+		gapless_frames += n;
+		data += n * frame_bytes;
+		count -= n;
+		done = n;
+		if (gapless_frames < chunk_size)
+			return done;
+		if (pcm_write(gapless_buf, chunk_size) != (ssize_t)chunk_size)
+			return 0;
+		gapless_frames = 0;
+	}
+	if (count > 0 && count < chunk_size) {
+		memcpy(gapless_buf, data, count * frame_bytes);
+		gapless_frames = count;
+		return done + count;
+	}
+	if (count > 0)
+		done += pcm_write(data, count);
+	return done;
+}
+
+/*
+ * The carried over frames belong to the previous file: hwparams may
+ * already hold the header of the next one, so pad and write them with
+ * the parameters the device and gapless_buf were set up for.
+ */
+static void gapless_flush(void)
+{
+	snd_pcm_format_t format = hwparams.format;
+	unsigned int channels = hwparams.channels;
+	unsigned int rate = hwparams.rate;
+
+	if (gapless_frames == 0)
+		return;
+	hwparams = ghwparams;
+	hwparams.rate = gapless_rate;
+	pcm_write(gapless_buf, gapless_frames);
+	gapless_frames = 0;
+	hwparams.format = format;
+	hwparams.channels = channels;
+	hwparams.rate = rate;
+}
+
+/*
+ * open the next file early and hint the kernel to cache it with
+ * posix_fadvise(); nothing is read here, the header is parsed when
+ * the file is played
+ */
+static void gapless_open_next(void)
+{
+	if (!gapless_next || gapless_fd >= 0 || !strcmp(gapless_next, "-"))
+		return;
+	gapless_fd = open(gapless_next, O_RDONLY, 0);
+	if (gapless_fd < 0)
+		return;		/* reported when the file is played */
+	gapless_fd_name = gapless_next;
+	posix_fadvise(gapless_fd, 0, 0, POSIX_FADV_WILLNEED);
+}
+
 /* playing raw data */
 
 static void playback_go(int fd, size_t loaded, off64_t count, int rtype, char *name)
@@ -2842,9 +3361,11 @@ static void playback_go(int fd, size_t loaded, off64_t count, int rtype, char *n
 
 	header(rtype, name);
 	set_params();
+	if (gapless)
+		gapless_open_next();
 
 	while (loaded > chunk_bytes && written < count && !in_aborting) {
-		if (pcm_write(audiobuf + written, chunk_size) <= 0)
+		if (gapless_write(audiobuf + written, chunk_size) <= 0)
 			return;
 		written += chunk_bytes;
 		loaded -= chunk_bytes;
@@ -2880,7 +3401,7 @@ static void playback_go(int fd, size_t loaded, off64_t count, int rtype, char *n
 			l += r;
 		} while ((size_t)l < chunk_bytes);
 		l = l * 8 / bits_per_frame;
-		r = pcm_write(audiobuf, l);
+		r = gapless_write(audiobuf, l);
 		if (r != l)
 			break;
 		r = r * bits_per_frame / 8;
@@ -2888,6 +3409,9 @@ static void playback_go(int fd, size_t loaded, off64_t count, int rtype, char *n
 		l = 0;
 	}
 	if (!in_aborting) {
+		if (gapless_next)
+			return;		/* the next file continues the stream */
+		gapless_flush();
 		snd_pcm_nonblock(handle, 0);
 		snd_pcm_drain(handle);
 		snd_pcm_nonblock(handle, nonblock);
@@ -2994,7 +3518,10 @@ static void playback(char *name)
 		name = "stdin";
 	} else {
 		init_stdin();
-		if ((fd = open(name, O_RDONLY, 0)) == -1) {
+		if (gapless_fd >= 0 && name == gapless_fd_name) {
+			fd = gapless_fd;
+			gapless_fd = -1;
+		} else if ((fd = open(name, O_RDONLY, 0)) == -1) {
 			perror(name);
 			prg_exit(EXIT_FAILURE);
 		}
@@ -3202,6 +3729,227 @@ static int safe_open(const char *name)
 	return fd;
 }
 
+/*
+ * tee sinks for capture: the main loop copies each captured chunk into a
+ * ring and never waits for a sink; every sink has a consumer thread with
+ * its own position, a sink which falls behind by more than the ring size
+ * skips the lost data instead of stalling the PCM or the other sinks.
+ * The ring is only accessed with the lock held, the writes to the sinks
+ * are done outside of it.
+ */
+struct tee_sink {
+	const char *name;
+	int fd;
+	size_t max_write;
+	pthread_t thread;
+	unsigned long long pos;
+	unsigned long long dropped;
+};
+
+static struct {
+	u_char *buf;
+	size_t size;
+	unsigned long long head;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int quit;
+	struct tee_sink *sinks;
+	unsigned int nsinks;
+} tee_ring;
+
+static int tee_connect(const char *name, int type)
+{
+	struct addrinfo hints, *res, *ai;
+	char *host, *port;
+	int fd = -1;
+
+	host = strdup(name);
+	if (host == NULL)
+		return -1;
+	port = strrchr(host, ':');
+	if (port == NULL) {
+		free(host);
+		errno = EINVAL;
+		return -1;
+	}
+	*port++ = '\0';
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = type;
+	if (getaddrinfo(host, port, &hints, &res) != 0) {
+		free(host);
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	free(host);
+	return fd;
+}
+
+static int tee_open(struct tee_sink *sink)
+{
+	size_t frame_bytes = bits_per_frame / 8;
+
+	sink->max_write = chunk_bytes;
+	if (!strcmp(sink->name, "-")) {
+		sink->fd = fileno(stdout);
+	} else if (!strncmp(sink->name, "tcp:", 4)) {
+		sink->fd = tee_connect(sink->name + 4, SOCK_STREAM);
+	} else if (!strncmp(sink->name, "udp:", 4)) {
+		sink->fd = tee_connect(sink->name + 4, SOCK_DGRAM);
+		/* whole frames in one unfragmented datagram */
+		sink->max_write = 1472 / frame_bytes * frame_bytes;
+		if (sink->max_write == 0)
+			sink->max_write = frame_bytes;
+		if (sink->max_write > chunk_bytes)
+			sink->max_write = chunk_bytes;
+	} else {
+		sink->fd = open(sink->name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	return sink->fd < 0 ? -1 : 0;
+}
+
+static void *tee_thread(void *arg)
+{
+	struct tee_sink *sink = arg;
+	unsigned long long head;
+	size_t n, off, part;
+	u_char *local;
+
+	local = malloc(sink->max_write);
+	if (local == NULL)
+		return NULL;
+	while (1) {
+		pthread_mutex_lock(&tee_ring.lock);
+		while (!tee_ring.quit && sink->pos == tee_ring.head)
+			pthread_cond_wait(&tee_ring.cond, &tee_ring.lock);
+		head = tee_ring.head;
+		if (sink->pos == head) {
+			/* quit and everything written */
+			pthread_mutex_unlock(&tee_ring.lock);
+			break;
+		}
+		if (head - sink->pos > tee_ring.size) {
+			/* overrun, continue with the newest data */
+			sink->dropped += head - sink->pos;
+			sink->pos = head;
+			pthread_mutex_unlock(&tee_ring.lock);
+			continue;
+		}
+		n = head - sink->pos;
+		if (n > sink->max_write)
+			n = sink->max_write;
+		off = sink->pos % tee_ring.size;
+		part = tee_ring.size - off;
+		if (part > n)
+			part = n;
+		memcpy(local, tee_ring.buf + off, part);
+		memcpy(local + part, tee_ring.buf, n - part);
+		pthread_mutex_unlock(&tee_ring.lock);
+		if ((size_t)xwrite(sink->fd, local, n) != n) {
+			fprintf(stderr, _("%s: tee %s: %s\n"), command,
+				sink->name, strerror(errno));
+			break;
+		}
+		sink->pos += n;
+	}
+	free(local);
+	return NULL;
+}
+
+static void tee_start(void)
+{
+	sigset_t all, saved;
+	unsigned int i;
+
+	tee_ring.size = snd_pcm_format_size(hwparams.format,
+				       hwparams.rate * hwparams.channels) * 2;
+	if (tee_ring.size < chunk_bytes * 8)
+		tee_ring.size = chunk_bytes * 8;
+	pthread_mutex_init(&tee_ring.lock, NULL);
+	pthread_cond_init(&tee_ring.cond, NULL);
+	tee_ring.buf = malloc(tee_ring.size);
+	tee_ring.sinks = calloc(tee_count, sizeof(*tee_ring.sinks));
+	if (tee_ring.buf == NULL || tee_ring.sinks == NULL) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+
+	/* signals are handled by the capture loop */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &saved);
+	for (i = 0; i < tee_count; i++) {
+		struct tee_sink *sink = &tee_ring.sinks[tee_ring.nsinks];
+
+		sink->name = tee_names[i];
+		if (tee_open(sink) < 0) {
+			perror(sink->name);
+			continue;
+		}
+		if (pthread_create(&sink->thread, NULL, tee_thread, sink)) {
+			error(_("cannot start tee thread for %s"), sink->name);
+			if (sink->fd != fileno(stdout))
+				close(sink->fd);
+			continue;
+		}
+		tee_ring.nsinks++;
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+/* the lock is held at most for a copy of one chunk by a sink thread */
+static void tee_push(const u_char *data, size_t count)
+{
+	size_t off, part;
+
+	pthread_mutex_lock(&tee_ring.lock);
+	off = tee_ring.head % tee_ring.size;
+	part = tee_ring.size - off;
+	if (part > count)
+		part = count;
+	memcpy(tee_ring.buf + off, data, part);
+	memcpy(tee_ring.buf, data + part, count - part);
+	tee_ring.head += count;
+	pthread_cond_broadcast(&tee_ring.cond);
+	pthread_mutex_unlock(&tee_ring.lock);
+}
+
+static void tee_stop(void)
+{
+	struct tee_sink *sink;
+	unsigned int i;
+
+	if (tee_ring.buf == NULL)
+		return;
+	pthread_mutex_lock(&tee_ring.lock);
+	tee_ring.quit = 1;
+	pthread_cond_broadcast(&tee_ring.cond);
+	pthread_mutex_unlock(&tee_ring.lock);
+	for (i = 0; i < tee_ring.nsinks; i++) {
+		sink = &tee_ring.sinks[i];
+		pthread_join(sink->thread, NULL);
+		if (sink->fd != fileno(stdout))
+			close(sink->fd);
+		if (sink->dropped && !quiet_mode)
+			fprintf(stderr, _("tee %s: %llu bytes dropped\n"),
+				sink->name, sink->dropped);
+	}
+	pthread_cond_destroy(&tee_ring.cond);
+	pthread_mutex_destroy(&tee_ring.lock);
+	free(tee_ring.sinks);
+	free(tee_ring.buf);
+	memset(&tee_ring, 0, sizeof(tee_ring));
+}
+
 static void capture(char *orig_name)
 {
 	int tostdout=0;		/* boolean which describes output stream */
@@ -3232,6 +3980,9 @@ static void capture(char *orig_name)
 	/* setup sound hardware */
 	set_params();
 
+	if (tee_count && tee_ring.buf == NULL)
+		tee_start();
+
 	/* write to stdout? */
 	if (!name || !strcmp(name, "-")) {
 		fd = fileno(stdout);
@@ -3287,6 +4038,8 @@ static void capture(char *orig_name)
 			if (read != f)
 				in_aborting = 1;
 			save = read * bits_per_frame / 8;
+			if (tee_ring.nsinks)
+				tee_push(audiobuf, save);
 			if (xwrite(fd, audiobuf, save) != save) {
 				perror(name);
 				in_aborting = 1;
@@ -3320,24 +4073,197 @@ static void capture(char *orig_name)
 	} while ((file_type == FORMAT_RAW && !timelimit && !sampleslimit) || count > 0);
 }
 
-static void playbackv_go(int* fds, unsigned int channels, size_t loaded, off64_t count, int rtype, char **names)
+/*
+ * parallel reader for separate channel files: the files of the next chunk
+ * are read by a small thread pool while the current chunk is written
+ */
+static struct {
+	pthread_t *threads;
+	unsigned int nthreads;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned int generation;
+	unsigned int pending;
+	int quit;
+	int *fds;
+	unsigned int channels;
+	u_char **bufs;
+	size_t expected;
+	ssize_t *results;
+} vreader;
+
+static void *vreader_thread(void *arg)
 {
-	int r;
-	size_t vsize;
+	unsigned int idx = (unsigned int)(long)arg;
+	unsigned int seen = 0, channel;
 
+	while (1) {
+		pthread_mutex_lock(&vreader.lock);
+		while (vreader.generation == seen && !vreader.quit)
+			pthread_cond_wait(&vreader.start, &vreader.lock);
+		if (vreader.quit) {
+			pthread_mutex_unlock(&vreader.lock);
+			return NULL;
+		}
+		seen = vreader.generation;
+		pthread_mutex_unlock(&vreader.lock);
+
+		for (channel = idx; channel < vreader.channels;
+		     channel += vreader.nthreads)
+			vreader.results[channel] =
+				safe_read(vreader.fds[channel],
+					  vreader.bufs[channel],
+					  vreader.expected);
+
+		pthread_mutex_lock(&vreader.lock);
+		if (--vreader.pending == 0)
+			pthread_cond_signal(&vreader.done);
+		pthread_mutex_unlock(&vreader.lock);
+	}
+}
+
+static void vreader_stop(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&vreader.lock);
+	vreader.quit = 1;
+	pthread_cond_broadcast(&vreader.start);
+	pthread_mutex_unlock(&vreader.lock);
+	for (i = 0; i < vreader.nthreads; i++)
+		pthread_join(vreader.threads[i], NULL);
+	pthread_cond_destroy(&vreader.done);
+	pthread_cond_destroy(&vreader.start);
+	pthread_mutex_destroy(&vreader.lock);
+	free(vreader.threads);
+	free(vreader.results);
+	vreader.threads = NULL;
+	vreader.results = NULL;
+	vreader.nthreads = 0;
+}
+
+static int vreader_start(int *fds, unsigned int channels)
+{
+	unsigned int i;
+
+	memset(&vreader, 0, sizeof(vreader));
+	vreader.fds = fds;
+	vreader.channels = channels;
+	vreader.threads = calloc(channels, sizeof(*vreader.threads));
+	vreader.results = calloc(channels, sizeof(*vreader.results));
+	if (vreader.threads == NULL || vreader.results == NULL) {
+		free(vreader.threads);
+		free(vreader.results);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&vreader.lock, NULL);
+	pthread_cond_init(&vreader.start, NULL);
+	pthread_cond_init(&vreader.done, NULL);
+	for (i = 0; i < read_threads && i < channels; i++) {
+		if (pthread_create(&vreader.threads[i], NULL, vreader_thread,
+				   (void *)(long)i))
+			break;
+		vreader.nthreads++;
+	}
+	if (vreader.nthreads == 0) {
+		vreader_stop();
+		return -EAGAIN;
+	}
+	return 0;
+}
+
+static void vreader_submit(u_char **bufs, size_t expected)
+{
+	pthread_mutex_lock(&vreader.lock);
+	vreader.bufs = bufs;
+	vreader.expected = expected;
+	vreader.pending = vreader.nthreads;
+	vreader.generation++;
+	pthread_cond_broadcast(&vreader.start);
+	pthread_mutex_unlock(&vreader.lock);
+}
+
+static ssize_t vreader_wait(char **names)
+{
 	unsigned int channel;
-	u_char *bufs[channels];
+	ssize_t r;
 
-	header(rtype, names[0]);
-	set_params();
+	pthread_mutex_lock(&vreader.lock);
+	while (vreader.pending > 0)
+		pthread_cond_wait(&vreader.done, &vreader.lock);
+	pthread_mutex_unlock(&vreader.lock);
 
-	vsize = chunk_bytes / channels;
+	r = vreader.results[0];
+	if (r < 0) {
+		perror(names[0]);
+		prg_exit(EXIT_FAILURE);
+	}
+	for (channel = 1; channel < vreader.channels; ++channel) {
+		if (vreader.results[channel] != r) {
+			perror(names[channel]);
+			prg_exit(EXIT_FAILURE);
+		}
+	}
+	return r;
+}
 
-	// Not yet implemented
-	assert(loaded == 0);
+static void playbackv_parallel(u_char **bufs, unsigned int channels, size_t vsize,
+			       off64_t count, char **names)
+{
+	u_char *nbufs[channels];
+	u_char **cur = bufs, **next = nbufs, **tmp;
+	u_char *second;
+	off64_t queued;
+	size_t expected, c;
+	ssize_t r;
+	unsigned int channel;
+	int more;
 
+	second = malloc(vsize * channels);
+	if (second == NULL) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
 	for (channel = 0; channel < channels; ++channel)
-		bufs[channel] = audiobuf + vsize * channel;
+		nbufs[channel] = second + vsize * channel;
+
+	expected = count / channels;
+	if (expected > vsize)
+		expected = vsize;
+	vreader_submit(cur, expected);
+	queued = (off64_t)expected * channels;
+
+	while (!in_aborting) {
+		c = vreader_wait(names);
+		if (c == 0)
+			break;
+		/* queue the next chunk before the device gets this one */
+		more = c == expected && queued < count;
+		if (more) {
+			expected = (count - queued) / channels;
+			if (expected > vsize)
+				expected = vsize;
+			vreader_submit(next, expected);
+			queued += (off64_t)expected * channels;
+		}
+		c = c * 8 / bits_per_sample;
+		r = pcm_writev(cur, channels, c);
+		if ((size_t)r != c || !more)
+			break;
+		tmp = cur;
+		cur = next;
+		next = tmp;
+	}
+	vreader_stop();
+	free(second);
+}
+
+static void playbackv_serial(int *fds, u_char **bufs, unsigned int channels, size_t vsize,
+			     off64_t count, char **names)
+{
+	int r;
+	unsigned int channel;
 
 	while (count > 0 && !in_aborting) {
 		size_t c = 0;
@@ -3367,6 +4293,30 @@ static void playbackv_go(int* fds, unsigned int channels, size_t loaded, off64_t
 		r = r * bits_per_frame / 8;
 		count -= r;
 	}
+}
+
+static void playbackv_go(int* fds, unsigned int channels, size_t loaded, off64_t count, int rtype, char **names)
+{
+	size_t vsize;
+
+	unsigned int channel;
+	u_char *bufs[channels];
+
+	header(rtype, names[0]);
+	set_params();
+
+	vsize = chunk_bytes / channels;
+
+	// Not yet implemented
+	assert(loaded == 0);
+
+	for (channel = 0; channel < channels; ++channel)
+		bufs[channel] = audiobuf + vsize * channel;
+
+	if (read_threads > 0 && vreader_start(fds, channels) == 0)
+		playbackv_parallel(bufs, channels, vsize, count, names);
+	else
+		playbackv_serial(fds, bufs, channels, vsize, count, names);
 	if (!in_aborting) {
 		snd_pcm_nonblock(handle, 0);
 		snd_pcm_drain(handle);
@@ -28,6 +28,9 @@
 #include "common.h"
 #include "alsa.h"
 #include "latencytest.h"
+#ifdef HAVE_LIBFFTW3F
+#include "analyze.h"
+#endif
 
 struct pcm_container {
 	snd_pcm_t *handle;
@@ -39,6 +42,8 @@ struct pcm_container {
 	size_t sample_bits;
 	size_t frame_bits;
 	char *buffer;
+	long long frames;	/* frames transferred so far */
+	bool tstamp;		/* status has monotonic position timestamps */
 };
 
 struct format_map_table {
@@ -69,6 +74,55 @@ static int format_convert(struct bat *bat, snd_pcm_format_t *fmt)
 	return -EINVAL;
 }
 
+/* the cross-correlation latency test lines up the playback and capture
+ * positions with the timestamps the driver takes with them */
+static void set_snd_pcm_tstamp(struct bat *bat, struct pcm_container *sndpcm)
+{
+	snd_pcm_sw_params_t *swparams;
+
+	snd_pcm_sw_params_alloca(&swparams);
+	sndpcm->tstamp = false;
+	if (snd_pcm_sw_params_current(sndpcm->handle, swparams) < 0
+			|| snd_pcm_sw_params_set_tstamp_mode(sndpcm->handle,
+				swparams, SND_PCM_TSTAMP_ENABLE) < 0
+			|| snd_pcm_sw_params_set_tstamp_type(sndpcm->handle,
+				swparams, SND_PCM_TSTAMP_TYPE_MONOTONIC) < 0
+			|| snd_pcm_sw_params(sndpcm->handle, swparams) < 0) {
+		fprintf(bat->log, _("No PCM timestamps, the latency is"));
+		fprintf(bat->log, _(" bounded by the thread wakeup jitter\n"));
+		return;
+	}
+	sndpcm->tstamp = true;
+}
+
+/*
+ * System time of a stream position from a status snapshot: for playback,
+ * when the next written frame will be played, behind the delay; for
+ * capture, when the next frame to read came in. 0 if unknown.
+ */
+static double pcm_position_time(struct bat *bat,
+		struct pcm_container *sndpcm, bool capture)
+{
+	snd_pcm_status_t *status;
+	snd_htimestamp_t ts;
+	double t;
+
+	if (!sndpcm->tstamp)
+		return 0.0;
+	snd_pcm_status_alloca(&status);
+	if (snd_pcm_status(sndpcm->handle, status) < 0
+			|| snd_pcm_status_get_state(status)
+				!= SND_PCM_STATE_RUNNING)
+		return 0.0;
+	snd_pcm_status_get_htstamp(status, &ts);
+	t = ts.tv_sec + ts.tv_nsec * 1e-9;
+	if (capture)
+		t -= (double) snd_pcm_status_get_delay(status) / bat->rate;
+	else
+		t += (double) snd_pcm_status_get_delay(status) / bat->rate;
+	return t;
+}
+
 static int set_snd_pcm_params(struct bat *bat, struct pcm_container *sndpcm)
 {
 	snd_pcm_hw_params_t *params;
@@ -298,10 +352,13 @@ static int set_snd_pcm_params(struct bat *bat, struct pcm_container *sndpcm)
 		return -ENOMEM;
 	}
 
+	if (bat->roundtripxcorr)
+		set_snd_pcm_tstamp(bat, sndpcm);
+
 	return 0;
 }
 
-static int write_to_pcm(const struct pcm_container *sndpcm,
+static int write_to_pcm(struct pcm_container *sndpcm,
 		int frames, struct bat *bat)
 {
 	int err;
@@ -316,6 +373,8 @@ static int write_to_pcm(const struct pcm_container *sndpcm,
 		} else if (err == -EPIPE) {
 			fprintf(bat->err, _("Underrun: %s(%d)\n"),
 					snd_strerror(err), err);
+			log_xrun(&bat->xrun_play,
+					sndpcm->frames + frames - remain);
 			if (bat->roundtriplatency)
 				bat->latency.xrun_error = true;
 			snd_pcm_prepare(sndpcm->handle);
@@ -333,6 +392,7 @@ static int write_to_pcm(const struct pcm_container *sndpcm,
 		if (err > 0) {
 			remain -= err;
 			offset += err * sndpcm->frame_bits / 8;
+			sndpcm->frames += err;
 		}
 	}
 
@@ -352,6 +412,8 @@ static int latencytest_process_output(struct pcm_container *sndpcm,
 	bat->latency.is_playing = true;
 
 	while (1) {
+		bat->latency.play_time = pcm_position_time(bat, sndpcm, false);
+
 		/* generate output data */
 		err = handleoutput(bat, sndpcm->buffer, bytes, frames);
 		if (err != 0)
@@ -443,7 +505,7 @@ void *playback_alsa(struct bat *bat)
 
 	fprintf(bat->log, _("Entering playback thread (ALSA).\n"));
 
-	retval_play = 0;
+	bat->retval_play = 0;
 	memset(&sndpcm, 0, sizeof(sndpcm));
 
 	err = snd_pcm_open(&sndpcm.handle, bat->playback.device,
@@ -451,13 +513,13 @@ void *playback_alsa(struct bat *bat)
 	if (err != 0) {
 		fprintf(bat->err, _("Cannot open PCM playback device: "));
 		fprintf(bat->err, _("%s(%d)\n"), snd_strerror(err), err);
-		retval_play = err;
+		bat->retval_play = err;
 		goto exit1;
 	}
 
 	err = set_snd_pcm_params(bat, &sndpcm);
 	if (err != 0) {
-		retval_play = err;
+		bat->retval_play = err;
 		goto exit2;
 	}
 
@@ -474,13 +536,13 @@ void *playback_alsa(struct bat *bat)
 		if (bat->fp == NULL) {
 			fprintf(bat->err, _("Cannot open file: %s %d\n"),
 					bat->playback.file, err);
-			retval_play = err;
+			bat->retval_play = err;
 			goto exit3;
 		}
 		/* Skip header */
 		err = read_wav_header(bat, bat->playback.file, bat->fp, true);
 		if (err != 0) {
-			retval_play = err;
+			bat->retval_play = err;
 			goto exit4;
 		}
 	}
@@ -490,7 +552,7 @@ void *playback_alsa(struct bat *bat)
 	else
 		err = write_to_pcm_loop(&sndpcm, bat);
 	if (err < 0) {
-		retval_play = err;
+		bat->retval_play = err;
 		goto exit4;
 	}
 
@@ -502,7 +564,7 @@ exit3:
 exit2:
 	snd_pcm_close(sndpcm.handle);
 exit1:
-	pthread_exit(&retval_play);
+	pthread_exit(&bat->retval_play);
 }
 
 static int read_from_pcm(struct pcm_container *sndpcm,
@@ -521,6 +583,8 @@ static int read_from_pcm(struct pcm_container *sndpcm,
 			snd_pcm_prepare(sndpcm->handle);
 			fprintf(bat->err, _("Overrun: %s(%d)\n"),
 					snd_strerror(err), err);
+			log_xrun(&bat->xrun_capture,
+					sndpcm->frames + frames - remain);
 			if (bat->roundtriplatency)
 				bat->latency.xrun_error = true;
 		} else if (err == -ESTRPIPE) {
@@ -537,54 +601,84 @@ static int read_from_pcm(struct pcm_container *sndpcm,
 		if (err > 0) {
 			remain -= err;
 			offset += err * sndpcm->frame_bits / 8;
+			sndpcm->frames += err;
 		}
 	}
 
 	return 0;
 }
 
+#ifdef HAVE_LIBFFTW3F
+/* run the streaming analysis on a captured chunk, not interrupted by the
+ * cancellation which ends the capture */
+static int analyze_chunk(struct pcm_container *sndpcm, struct bat *bat,
+		int frames)
+{
+	int err, state;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+	err = stream_analyze_feed(bat, sndpcm->buffer, frames);
+	pthread_setcancelstate(state, NULL);
+
+	return err;
+}
+#endif
+
 static int read_from_pcm_loop(struct pcm_container *sndpcm, struct bat *bat)
 {
 	int err = 0;
 	FILE *fp = NULL;
 	int size, frames;
 	int bytes_read = 0;
-	int bytes_count = bat->frames * bat->frame_size;
-	int remain = bytes_count;
+	long long remain = bat->frames;
 
-	remove(bat->capture.file);
-	fp = fopen(bat->capture.file, "wb");
-	err = -errno;
-	if (fp == NULL) {
-		fprintf(bat->err, _("Cannot open file: %s %d\n"),
-				bat->capture.file, err);
-		return err;
-	}
-	/* leave space for file header */
-	if (fseek(fp, sizeof(struct wav_container), SEEK_SET) != 0) {
+	/* streamed captures are analyzed on the fly and not stored */
+	if (!bat->streaming) {
+		remove(bat->capture.file);
+		fp = fopen(bat->capture.file, "wb");
 		err = -errno;
-		fclose(fp);
-		return err;
+		if (fp == NULL) {
+			fprintf(bat->err, _("Cannot open file: %s %d\n"),
+					bat->capture.file, err);
+			return err;
+		}
+		/* leave space for file header */
+		if (fseek(fp, sizeof(struct wav_container), SEEK_SET) != 0) {
+			err = -errno;
+			fclose(fp);
+			return err;
+		}
 	}
 
+	bat->capture_start = bat_clock();
 	while (remain > 0) {
-		size = (remain <= sndpcm->period_bytes) ?
-			remain : sndpcm->period_bytes;
-		frames = size * 8 / sndpcm->frame_bits;
+		frames = (remain <= sndpcm->period_size) ?
+			remain : sndpcm->period_size;
+		size = frames * sndpcm->frame_bits / 8;
 
 		/* read a chunk from pcm device */
 		err = read_from_pcm(sndpcm, frames, bat);
 		if (err != 0)
 			break;
 
+#ifdef HAVE_LIBFFTW3F
+		if (bat->streaming) {
+			err = analyze_chunk(sndpcm, bat, frames);
+			if (err != 0)
+				break;
+		}
+#endif
+
 		/* write the chunk to file */
-		if (fwrite(sndpcm->buffer, 1, size, fp) != size) {
-			err = -EIO;
-			break;
+		if (fp) {
+			if (fwrite(sndpcm->buffer, 1, size, fp) != size) {
+				err = -EIO;
+				break;
+			}
+			bytes_read += size;
 		}
 
-		bytes_read += size;
-		remain -= size;
+		remain -= frames;
 		bat->periods_played++;
 
 		if (bat->period_is_limited
@@ -592,9 +686,10 @@ static int read_from_pcm_loop(struct pcm_container *sndpcm, struct bat *bat)
 			break;
 	}
 
-	update_wav_header(bat, fp, bytes_read);
-
-	fclose(fp);
+	if (fp) {
+		update_wav_header(bat, fp, bytes_read);
+		fclose(fp);
+	}
 	return err;
 }
 
@@ -637,6 +732,8 @@ static int latencytest_process_input(struct pcm_container *sndpcm,
 		if (bat->latency.xrun_error == true)
 			break;
 
+		bat->latency.capture_time = pcm_position_time(bat, sndpcm,
+				true);
 		err = handleinput(bat, sndpcm->buffer, frames);
 		if (err != 0)
 			break;
@@ -679,7 +776,7 @@ void *record_alsa(struct bat *bat)
 
 	fprintf(bat->log, _("Entering capture thread (ALSA).\n"));
 
-	retval_record = 0;
+	bat->retval_record = 0;
 	memset(&sndpcm, 0, sizeof(sndpcm));
 
 	err = snd_pcm_open(&sndpcm.handle, bat->capture.device,
@@ -687,13 +784,13 @@ void *record_alsa(struct bat *bat)
 	if (err != 0) {
 		fprintf(bat->err, _("Cannot open PCM capture device: "));
 		fprintf(bat->err, _("%s(%d)\n"), snd_strerror(err), err);
-		retval_record = err;
+		bat->retval_record = err;
 		goto exit1;
 	}
 
 	err = set_snd_pcm_params(bat, &sndpcm);
 	if (err != 0) {
-		retval_record = err;
+		bat->retval_record = err;
 		goto exit2;
 	}
 
@@ -712,7 +809,7 @@ void *record_alsa(struct bat *bat)
 	pthread_cleanup_pop(0);
 
 	if (err != 0) {
-		retval_record = err;
+		bat->retval_record = err;
 		goto exit3;
 	}
 
@@ -720,12 +817,12 @@ void *record_alsa(struct bat *bat)
 	 * previous call) (before exit3) as this thread will be cancelled
 	 * by end of play thread. Except in single line mode. */
 	snd_pcm_drain(sndpcm.handle);
-	pthread_exit(&retval_record);
+	pthread_exit(&bat->retval_record);
 
 exit3:
 	free(sndpcm.buffer);
 exit2:
 	snd_pcm_close(sndpcm.handle);
 exit1:
-	pthread_exit(&retval_record);
+	pthread_exit(&bat->retval_record);
 }
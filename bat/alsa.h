@@ -13,8 +13,5 @@
  *
  */
 
-extern int retval_play;
-extern int retval_record;
-
 void *playback_alsa(struct bat *);
 void *record_alsa(struct bat *);
@@ -15,9 +15,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <math.h>
 #include <fftw3.h>
@@ -27,8 +32,65 @@
 
 #include "common.h"
 #include "bat-signal.h"
-
-static void check_amplitude(struct bat *bat, float *buf)
+#include "glitch.h"
+
+/* FFT plans are made once per size and shared by all channels. The FFTW
+ * planner is not thread safe, so the plans are created before the channel
+ * workers start, which then run them on their own buffers. */
+struct fft_plan {
+	int n;
+	fftwf_r2r_kind kind;
+	fftwf_plan plan;
+	struct fft_plan *next;
+};
+
+static struct fft_plan *fft_plans;
+static bool wisdom_loaded;
+static bool wisdom_dirty;
+static pthread_mutex_t fft_plan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* reference tones for the noise check, generated once per frequency */
+struct ref_tone {
+	float freq;
+	int nsamples;
+	unsigned int rate;
+	enum _bat_pcm_format format;
+	float *samples;
+	double energy;			/* sum of squares */
+	struct ref_tone *next;
+};
+
+static struct ref_tone *ref_tones;
+static pthread_mutex_t ref_tone_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* independent accumulators in the noise kernel */
+#define NOISE_LANES			8
+/* frames converted at a time when loading a channel */
+#define LOAD_CHUNK_FRAMES		4096
+
+/* the capture data, mapped from the file when possible */
+struct capture_map {
+	void *addr;			/* mapping, NULL if read in memory */
+	size_t length;
+	void *data;			/* first frame */
+};
+
+/* one analysis job per channel, logging into its own buffers */
+struct channel_job {
+	struct bat bat;
+	int channel;
+	void *buf;			/* interleaved capture data */
+	fftwf_plan plan;
+	int err;
+	bool started;
+	pthread_t thread;
+	char *log_buf;
+	size_t log_len;
+	char *err_buf;
+	size_t err_len;
+};
+
+static void check_amplitude(struct bat *bat, const float *buf)
 {
 	float sum, average, amplitude;
 	int i, percent;
@@ -105,7 +167,7 @@ static int check(struct bat *bat, struct analyze *a, int channel)
 {
 	float hz = 1.0 / ((float) bat->frames / (float) bat->rate);
 	float mean = 0.0, t, sigma = 0.0, p = 0.0;
-	int i, start = -1, end = -1, peak = 0, signals = 0;
+	int i, start = -1, end = -1, peak = 0, signals = 0, best = -1;
 	int err = 0, N = bat->frames / 2;
 
 	/* calculate mean */
@@ -140,6 +202,8 @@ static int check(struct bat *bat, struct analyze *a, int channel)
 			/* Check if peak is as expected */
 			err |= check_peak(bat, a, end, peak, hz, mean,
 					p, channel, start);
+			if (best == -1 || a->mag[peak] > a->mag[best])
+				best = peak;
 			end = start = -1;
 			if (signals == MAX_PEAKS)
 				break;
@@ -157,6 +221,9 @@ static int check(struct bat *bat, struct analyze *a, int channel)
 	fprintf(bat->log, _("Detected at least %d signal(s) in total\n"),
 			signals);
 
+	if (best != -1)
+		bat->result[channel].peak_hz = best * hz;
+
 	return err;
 }
 
@@ -174,39 +241,125 @@ static void calc_magnitude(struct bat *bat, struct analyze *a, int N)
 	a->mag[0] = 0.0;
 }
 
+static fftwf_plan get_fft_plan_kind(struct bat *bat, int N,
+		fftwf_r2r_kind kind)
+{
+	struct fft_plan *fp;
+	fftwf_plan p = NULL;
+	float *in, *out;
+
+	pthread_mutex_lock(&fft_plan_lock);
+	for (fp = fft_plans; fp; fp = fp->next) {
+		if (fp->n == N && fp->kind == kind) {
+			p = fp->plan;
+			goto out;
+		}
+	}
+
+	if (bat->wisdom && !wisdom_loaded) {
+		wisdom_loaded = true;
+		if (fftwf_import_wisdom_from_filename(bat->wisdom))
+			fprintf(bat->log, _("Loaded FFT wisdom from %s\n"),
+					bat->wisdom);
+	}
+
+	fp = malloc(sizeof(*fp));
+	in = (float *) fftwf_malloc(sizeof(float) * N);
+	out = (float *) fftwf_malloc(sizeof(float) * N);
+	if (fp == NULL || in == NULL || out == NULL)
+		goto out_free;
+
+	/* measuring overwrites the arrays, so plan on scratch buffers */
+	p = fftwf_plan_r2r_1d(N, in, out, kind,
+			FFTW_MEASURE | FFTW_PRESERVE_INPUT | FFTW_WISDOM_ONLY);
+	if (p == NULL) {
+		p = fftwf_plan_r2r_1d(N, in, out, kind,
+				FFTW_MEASURE | FFTW_PRESERVE_INPUT);
+		if (p != NULL)
+			wisdom_dirty = true;
+	}
+	if (p == NULL)
+		goto out_free;
+
+	fp->n = N;
+	fp->kind = kind;
+	fp->plan = p;
+	fp->next = fft_plans;
+	fft_plans = fp;
+	fp = NULL;
+
+out_free:
+	fftwf_free(out);
+	fftwf_free(in);
+	free(fp);
+out:
+	pthread_mutex_unlock(&fft_plan_lock);
+	return p;
+}
+
+static fftwf_plan get_fft_plan(struct bat *bat, int N)
+{
+	return get_fft_plan_kind(bat, N, FFTW_R2HC);
+}
+
+static void save_fft_wisdom(struct bat *bat)
+{
+	pthread_mutex_lock(&fft_plan_lock);
+	if (bat->wisdom && wisdom_dirty) {
+		if (fftwf_export_wisdom_to_filename(bat->wisdom))
+			wisdom_dirty = false;
+		else
+			fprintf(bat->err, _("Cannot write FFT wisdom: %s\n"),
+					bat->wisdom);
+	}
+	pthread_mutex_unlock(&fft_plan_lock);
+}
+
+/* release the cached plans and reference tones at exit */
+void analyze_cleanup(void)
+{
+	struct fft_plan *fp;
+	struct ref_tone *t;
+
+	pthread_mutex_lock(&fft_plan_lock);
+	while (fft_plans) {
+		fp = fft_plans;
+		fft_plans = fp->next;
+		fftwf_destroy_plan(fp->plan);
+		free(fp);
+	}
+	fftwf_cleanup();
+	pthread_mutex_unlock(&fft_plan_lock);
+
+	pthread_mutex_lock(&ref_tone_lock);
+	while (ref_tones) {
+		t = ref_tones;
+		ref_tones = t->next;
+		free(t->samples);
+		free(t);
+	}
+	pthread_mutex_unlock(&ref_tone_lock);
+}
+
 static int find_and_check_harmonics(struct bat *bat, struct analyze *a,
-		int channel)
+		int channel, fftwf_plan p)
 {
-	fftwf_plan p;
 	int err = -ENOMEM, N = bat->frames;
 
-	/* Allocate FFT buffers */
-	a->in = (float *) fftwf_malloc(sizeof(float) * bat->frames);
-	if (a->in == NULL)
-		goto out1;
-
+	/* Allocate FFT buffers, the input is the channel's samples */
 	a->out = (float *) fftwf_malloc(sizeof(float) * bat->frames);
 	if (a->out == NULL)
-		goto out2;
+		goto out1;
 
 	a->mag = (float *) fftwf_malloc(sizeof(float) * bat->frames);
 	if (a->mag == NULL)
-		goto out3;
-
-	/* create FFT plan */
-	p = fftwf_plan_r2r_1d(N, a->in, a->out, FFTW_R2HC,
-			FFTW_MEASURE | FFTW_PRESERVE_INPUT);
-	if (p == NULL)
-		goto out4;
-
-	/* convert source PCM to floats */
-	bat->convert_sample_to_float(a->buf, a->in, bat->frames);
+		goto out2;
 
 	/* check amplitude */
 	check_amplitude(bat, a->in);
 
-	/* run FFT */
-	fftwf_execute(p);
+	/* run FFT on this channel's buffers */
+	fftwf_execute_r2r(p, a->in, a->out);
 
 	/* FFT out is real and imaginary numbers - calc magnitude for each */
 	calc_magnitude(bat, a, N);
@@ -214,33 +367,79 @@ static int find_and_check_harmonics(struct bat *bat, struct analyze *a,
 	/* check data */
 	err = check(bat, a, channel);
 
-	fftwf_destroy_plan(p);
-
-out4:
 	fftwf_free(a->mag);
-out3:
-	fftwf_free(a->out);
 out2:
-	fftwf_free(a->in);
+	fftwf_free(a->out);
 out1:
 	return err;
 }
 
-static int calculate_noise_one_period(struct bat *bat,
-		struct noise_analyzer *na, float *src,
-		int length, int channel)
+/* look up the reference tone for freq, generating it on first use; the
+ * tones are kept for the whole run and shared by all channels */
+static const struct ref_tone *get_ref_tone(struct bat *bat, float freq,
+		int nsamples)
+{
+	struct ref_tone *t;
+	int i;
+
+	pthread_mutex_lock(&ref_tone_lock);
+	for (t = ref_tones; t; t = t->next)
+		if (t->freq == freq && t->nsamples == nsamples
+				&& t->rate == bat->rate
+				&& t->format == bat->format)
+			goto out;
+
+	t = malloc(sizeof(*t));
+	if (t == NULL)
+		goto out;
+	t->samples = malloc(sizeof(float) * nsamples);
+	if (t->samples == NULL
+			|| generate_sine_wave_raw_mono(bat, t->samples, freq,
+				nsamples) < 0) {
+		free(t->samples);
+		free(t);
+		t = NULL;
+		goto out;
+	}
+	t->freq = freq;
+	t->nsamples = nsamples;
+	t->rate = bat->rate;
+	t->format = bat->format;
+	for (i = 0, t->energy = 0.0; i < nsamples; i++)
+		t->energy += (double) t->samples[i] * t->samples[i];
+	t->next = ref_tones;
+	ref_tones = t;
+out:
+	pthread_mutex_unlock(&ref_tone_lock);
+	return t;
+}
+
+/**
+ * Compare one sine period of src with the target tone and return the
+ * signal to noise amplitude ratio in *ratio.
+ *
+ * The period is phase aligned and scaled to the rms of the target. The
+ * scaling is applied analytically: with gain g = sqrt(Ett / Sss) the
+ * residual sum((t - g * s)^2) is 2 * Ett - 2 * g * Sts, so one pass over
+ * the samples computes everything. The sums use NOISE_LANES independent
+ * accumulators so the loop vectorizes without reassociation.
+ */
+static int calculate_noise_one_period(const struct noise_analyzer *na,
+		const float *src, int length, float *ratio)
 {
-	int i, shift = 0;
-	float tmp, rms, gain, residual;
-	float a = 0.0, b = 1.0;
+	double sss[NOISE_LANES] = { 0.0 }, sts[NOISE_LANES] = { 0.0 };
+	double ss = 0.0, ts = 0.0, gain, residual, v;
+	const float *p, *t = na->target;
+	float a = 0.0, b = 1.0, tmp;
+	int i, j, n = na->nsamples, shift = -1;
 
 	/* step 1. phase compensation */
 
-	if (length < 2 * na->nsamples)
+	if (length < 2 * n)
 		return -EINVAL;
 
 	/* search for the beginning of a sine period */
-	for (i = 0, tmp = 0.0, shift = -1; i < na->nsamples; i++) {
+	for (i = 0; i < n; i++) {
 		/* find i where src[i] >= 0 && src[i+1] < 0 */
 		if (src[i] < 0.0)
 			continue;
@@ -257,41 +456,46 @@ static int calculate_noise_one_period(struct bat *bat,
 	if (shift == -1)
 		return -EINVAL;
 
-	/* shift sine waveform to source[0] = 0.0 */
-	for (i = 0; i < na->nsamples; i++)
-		na->source[i] = a * src[i + shift + 1] + b * src[i + shift];
+	/* step 2. energy of the shifted period and its product with target */
 
-	/* step 2. gain compensation */
-
-	/* calculate rms of signal amplitude */
-	for (i = 0, tmp = 0.0; i < na->nsamples; i++)
-		tmp += na->source[i] * na->source[i];
-	rms = sqrtf(tmp / na->nsamples);
-
-	gain = na->rms_tgt / rms;
-
-	for (i = 0; i < na->nsamples; i++)
-		na->source[i] *= gain;
+	p = src + shift;
+	for (i = 0; i + NOISE_LANES <= n; i += NOISE_LANES) {
+		for (j = 0; j < NOISE_LANES; j++) {
+			v = (double) a * p[i + j + 1] + (double) b * p[i + j];
+			sss[j] += v * v;
+			sts[j] += t[i + j] * v;
+		}
+	}
+	for (; i < n; i++) {
+		v = (double) a * p[i + 1] + (double) b * p[i];
+		ss += v * v;
+		ts += t[i] * v;
+	}
+	for (j = 0; j < NOISE_LANES; j++) {
+		ss += sss[j];
+		ts += sts[j];
+	}
 
-	/* step 3. calculate snr in dB */
+	/* step 3. residual after gain compensation */
 
-	for (i = 0, tmp = 0.0, residual = 0.0; i < na->nsamples; i++) {
-		tmp = fabsf(na->target[i] - na->source[i]);
-		residual += tmp * tmp;
+	if (ss == 0.0) {
+		*ratio = 0.0;
+		return 0;
 	}
-
-	tmp = na->rms_tgt / sqrtf(residual / na->nsamples);
-	na->snr_db = 20.0 * log10f(tmp);
+	gain = sqrt(na->energy_tgt / ss);
+	residual = 2.0 * na->energy_tgt - 2.0 * gain * ts;
+	*ratio = residual > 0.0 ? sqrt(na->energy_tgt / residual) : HUGE_VALF;
 
 	return 0;
 }
 
-static int calculate_noise(struct bat *bat, float *src, int channel)
+static int calculate_noise(struct bat *bat, const float *src, int channel)
 {
 	int err = 0;
 	struct noise_analyzer na;
+	const struct ref_tone *tone;
 	float freq = bat->target_freq[channel];
-	float tmp, sum_snr_pc, avg_snr_pc, avg_snr_db;
+	float ratio, ratio_thd, sum_snr_pc, avg_snr_pc, avg_snr_db;
 	int offset, i, cnt_noise, cnt_clean;
 	/* num of samples in each sine period */
 	int nsamples = (int) ceilf(bat->rate / freq);
@@ -303,44 +507,31 @@ static int calculate_noise(struct bat *bat, float *src, int channel)
 
 	fprintf(bat->log, _("samples per period: %d\n"), nsamples);
 	fprintf(bat->log, _("total sections to detect: %d\n"), nsection);
-	na.source = (float *)malloc(sizeof(float) * nsamples);
-	if (!na.source) {
-		err = -ENOMEM;
-		goto out1;
-	}
 
-	na.target = (float *)malloc(sizeof(float) * nsamples);
-	if (!na.target) {
-		err = -ENOMEM;
-		goto out2;
-	}
-
-	/* generate standard single-tone signal */
-	err = generate_sine_wave_raw_mono(bat, na.target, freq, nsamples);
-	if (err < 0)
-		goto out3;
+	/* standard single-tone signal */
+	tone = get_ref_tone(bat, freq, nsamples);
+	if (tone == NULL)
+		return -ENOMEM;
 
 	na.nsamples = nsamples;
+	na.target = tone->samples;
+	na.energy_tgt = tone->energy;
 
-	/* calculate rms of standard signal */
-	for (i = 0, tmp = 0.0; i < nsamples; i++)
-		tmp += na.target[i] * na.target[i];
-	na.rms_tgt = sqrtf(tmp / nsamples);
+	/* compare amplitude ratios instead of dB for each section */
+	ratio_thd = powf(10.0, bat->snr_thd_db / 20.0);
 
 	/* calculate average noise level */
 	sum_snr_pc = 0.0;
 	cnt_clean = cnt_noise = 0;
 	for (i = 0, offset = 0; i < nsection; i++) {
-		na.snr_db = SNR_DB_INVALID;
-
-		err = calculate_noise_one_period(bat, &na, src + offset,
-				nsamples_per_section, channel);
+		err = calculate_noise_one_period(&na, src + offset,
+				nsamples_per_section, &ratio);
 		if (err < 0)
-			goto out3;
+			return err;
 
-		if (na.snr_db > bat->snr_thd_db) {
+		if (ratio > ratio_thd) {
 			cnt_clean++;
-			sum_snr_pc += 100.0 / powf(10.0, na.snr_db / 20.0);
+			sum_snr_pc += 100.0 / ratio;
 		} else {
 			cnt_noise++;
 		}
@@ -352,7 +543,7 @@ static int calculate_noise(struct bat *bat, float *src, int channel)
 				cnt_noise);
 		err = -cnt_noise;
 		if (cnt_clean == 0)
-			goto out3;
+			return err;
 	} else {
 		fprintf(bat->log, _("No noise detected.\n"));
 	}
@@ -361,65 +552,443 @@ static int calculate_noise(struct bat *bat, float *src, int channel)
 	avg_snr_db = 20.0 * log10f(100.0 / avg_snr_pc);
 	fprintf(bat->log, _("Average SNR is %.2f dB (%.2f %%) at %d points.\n"),
 			avg_snr_db, avg_snr_pc, cnt_clean);
+	bat->result[channel].snr_db = avg_snr_db;
 
-out3:
-	free(na.target);
-out2:
-	free(na.source);
-out1:
 	return err;
 }
 
-static int find_and_check_noise(struct bat *bat, void *buf, int channel)
+/**
+ * Convert the samples of one channel of the interleaved capture to floats,
+ * a chunk at a time, so only the channel's samples are held in memory.
+ */
+static float *load_channel(struct bat *bat, const void *data, int channel)
+{
+	int i, n, k, chunk = LOAD_CHUNK_FRAMES;
+	const char *src = data;
+	float *x, *tmp;
+
+	x = (float *) fftwf_malloc(sizeof(float) * bat->frames);
+	if (x == NULL)
+		return NULL;
+	if (bat->channels == 1) {
+		bat->convert_sample_to_float((void *) src, x, bat->frames);
+		return x;
+	}
+
+	tmp = malloc(sizeof(float) * chunk * bat->channels);
+	if (tmp == NULL) {
+		fftwf_free(x);
+		return NULL;
+	}
+	for (i = 0; i < bat->frames; i += n) {
+		n = bat->frames - i < chunk ? bat->frames - i : chunk;
+		bat->convert_sample_to_float((void *) (src + (size_t) i
+					* bat->frame_size), tmp,
+				n * bat->channels);
+		for (k = 0; k < n; k++)
+			x[i + k] = tmp[k * bat->channels + channel];
+	}
+
+	free(tmp);
+	return x;
+}
+
+/* half width in bins of a tone in the Blackman-Harris windowed spectrum */
+#define TONE_BINS			5
+#define MAX_HARMONICS			9
+/* THD+N measurement bandwidth */
+#define THDN_LOW			20.0
+#define THDN_HIGH			20000.0
+
+/* power spectrum of N samples, bins 0 to N / 2 */
+static int power_spectrum(fftwf_plan plan, const float *x, int N,
+		bool window, float *power)
 {
-	int err = 0;
-	float *source;
+	float *in, *out, w;
+	int i;
 
-	source = (float *)malloc(sizeof(float) * bat->frames);
-	if (!source)
+	in = (float *) fftwf_malloc(sizeof(float) * N);
+	out = (float *) fftwf_malloc(sizeof(float) * N);
+	if (in == NULL || out == NULL) {
+		fftwf_free(in);
+		fftwf_free(out);
 		return -ENOMEM;
+	}
 
-	/* convert source PCM to floats */
-	bat->convert_sample_to_float(buf, source, bat->frames);
+	for (i = 0; i < N; i++) {
+		w = 1.0;
+		/* 4-term Blackman-Harris, -92 dB side lobes */
+		if (window)
+			w = 0.35875 - 0.48829 * cosf(2.0 * M_PI * i / N)
+				+ 0.14128 * cosf(4.0 * M_PI * i / N)
+				- 0.01168 * cosf(6.0 * M_PI * i / N);
+		in[i] = x[i] * w;
+	}
+	fftwf_execute_r2r(plan, in, out);
 
-	/* adjust waveform and calculate noise */
-	err = calculate_noise(bat, source, channel);
+	power[0] = out[0] * out[0];
+	for (i = 1; i < N / 2; i++)
+		power[i] = out[i] * out[i] + out[N - i] * out[N - i];
+	power[N / 2] = out[N / 2] * out[N / 2];
 
-	free(source);
-	return err;
+	fftwf_free(out);
+	fftwf_free(in);
+	return 0;
+}
+
+static double band_power(const float *power, int N, int lo, int hi)
+{
+	double sum = 0.0;
+	int i;
+
+	if (lo < 1)
+		lo = 1;
+	if (hi > N / 2)
+		hi = N / 2;
+	for (i = lo; i <= hi; i++)
+		sum += power[i];
+	return sum;
+}
+
+static float ratio_db(double a, double b)
+{
+	if (a <= 0.0)
+		return -SNR_DB_MAX;
+	return 10.0 * log10(a / b);
 }
 
 /**
- * Convert interleaved samples from channels in samples from a single channel
+ * Measure THD+N and THD of the sine on this channel, and the power at the
+ * target frequency of every channel for the crosstalk check.
  */
-static int reorder_data(struct bat *bat)
+static int check_distortion(struct bat *bat, const float *x, int channel,
+		fftwf_plan plan)
 {
-	char *p, *new_bat_buf;
-	int ch, i, j;
+	struct channel_result *r = &bat->result[channel];
+	int N = bat->frames, i, h, k0, k, lo, hi, err;
+	float hz = (float) bat->rate / N;
+	double fund, total, harm = 0.0;
+	float *power, thdn, thd;
+
+	power = malloc(sizeof(float) * (N / 2 + 1));
+	if (power == NULL)
+		return -ENOMEM;
+	err = power_spectrum(plan, x, N, true, power);
+	if (err < 0)
+		goto out;
 
-	if (bat->channels == 1)
-		return 0; /* No need for reordering */
+	for (i = 0; i < bat->channels; i++) {
+		k = lrintf(bat->target_freq[i] / hz);
+		r->level[i] = band_power(power, N, k - TONE_BINS,
+				k + TONE_BINS);
+	}
 
-	p = malloc(bat->frames * bat->frame_size);
-	new_bat_buf = p;
-	if (p == NULL)
-		return -ENOMEM;
+	if (!bat->check_thdn)
+		goto out;
+
+	/* fundamental at the strongest bin near the target */
+	k = lrintf(bat->target_freq[channel] / hz);
+	for (i = k - TONE_BINS, k0 = k; i <= k + TONE_BINS; i++)
+		if (i > 0 && i < N / 2 && power[i] > power[k0])
+			k0 = i;
+	fund = band_power(power, N, k0 - TONE_BINS, k0 + TONE_BINS);
+	if (fund <= 0.0) {
+		fprintf(bat->err, _("No signal for THD+N\n"));
+		err = -ENOPEAK;
+		goto out;
+	}
+
+	lo = ceilf(THDN_LOW / hz);
+	hi = THDN_HIGH / hz;
+	total = band_power(power, N, lo, hi);
+	for (h = 2; h <= MAX_HARMONICS; h++) {
+		k = h * k0;
+		if (k + TONE_BINS > hi || k + TONE_BINS > N / 2)
+			break;
+		harm += band_power(power, N, k - TONE_BINS, k + TONE_BINS);
+	}
 
-	for (ch = 0; ch < bat->channels; ch++) {
-		for (j = 0; j < bat->frames; j++) {
-			for (i = 0; i < bat->sample_size; i++) {
-				*p++ = ((char *) (bat->buf))[j * bat->frame_size
-						+ ch * bat->sample_size + i];
+	thdn = ratio_db(total - fund, fund);
+	thd = ratio_db(harm, fund);
+	r->thdn_db = thdn;
+
+	fprintf(bat->log, _("\nChecking for THD+N: "));
+	fprintf(bat->log, _("Threshold is %.2f dB\n"), bat->thdn_thd_db);
+	fprintf(bat->log, _("THD+N is %.2f dB (%.4f%%),"), thdn,
+			100.0 * powf(10.0, thdn / 20.0));
+	fprintf(bat->log, _(" THD is %.2f dB (%.4f%%)\n"), thd,
+			100.0 * powf(10.0, thd / 20.0));
+	if (thdn > bat->thdn_thd_db) {
+		fprintf(bat->err, _(" FAIL: THD+N above threshold\n"));
+		err = -EDISTORTION;
+	}
+
+out:
+	free(power);
+	return err;
+}
+
+/* crosstalk from each channel into the others, from the levels measured
+ * by check_distortion() at each channel's target frequency */
+static int check_crosstalk(struct bat *bat)
+{
+	float hz = (float) bat->rate / bat->frames, xt;
+	int c, d, err = 0;
+
+	fprintf(bat->log, _("\nChecking for crosstalk: "));
+	fprintf(bat->log, _("Threshold is %.2f dB\n"), bat->crosstalk_thd_db);
+
+	for (d = 0; d < bat->channels; d++) {
+		for (c = 0; c < bat->channels; c++) {
+			if (c == d)
+				continue;
+			if (fabsf(bat->target_freq[c] - bat->target_freq[d])
+					< 2 * TONE_BINS * hz) {
+				fprintf(bat->log, _("Channel %i to %i: same"),
+						d + 1, c + 1);
+				fprintf(bat->log, _(" frequency, skipped\n"));
+				continue;
+			}
+			xt = ratio_db(bat->result[c].level[d],
+					bat->result[d].level[d]);
+			fprintf(bat->log, _("Channel %i to %i: %.2f dB\n"),
+					d + 1, c + 1, xt);
+			if (xt > bat->crosstalk_thd_db) {
+				fprintf(bat->err, _(" FAIL: crosstalk above"));
+				fprintf(bat->err, _(" threshold\n"));
+				err = -ECROSSTALK;
 			}
 		}
 	}
 
-	free(bat->buf);
-	bat->buf = new_bat_buf;
+	return err;
+}
+
+/**
+ * Frequency response from the multitone or sweep signal, per third octave
+ * band relative to the 1000 Hz band. The signal is periodic and the
+ * capture holds whole periods, so its spectrum is compared line by line
+ * with the spectrum of one period of the generated signal.
+ */
+static int check_response(struct bat *bat, const float *x, int channel,
+		fftwf_plan plan)
+{
+	float freq[MAX_TONES], resp[MAX_TONES], *cap = NULL;
+	float *ref = NULL, dev, max_dev = 0.0, edge = powf(2.0, 1.0 / 6.0);
+	const float *table;
+	double pc, pr, refp[MAX_TONES], ref_max = 0.0;
+	int N = bat->frames, P, M, n, b, j, lo, hi, err;
+	fftwf_plan ref_plan;
+	bool valid[MAX_TONES];
+
+	table = get_signal_table(bat, &P);
+	if (table == NULL)
+		return -ENOMEM;
+	if (N < P || N % P) {
+		fprintf(bat->err, _("Capture too short for the test signal\n"));
+		return -EINVAL;
+	}
+	M = N / P;
+
+	ref_plan = get_fft_plan(bat, P);
+	cap = malloc(sizeof(float) * (N / 2 + 1));
+	ref = malloc(sizeof(float) * (P / 2 + 1));
+	if (ref_plan == NULL || cap == NULL || ref == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+	err = power_spectrum(plan, x, N, false, cap);
+	if (err == 0)
+		err = power_spectrum(ref_plan, table, P, false, ref);
+	if (err < 0)
+		goto out;
+
+	n = response_frequencies(bat, freq);
+	for (b = 0; b < n; b++) {
+		lo = ceilf(freq[b] / edge * P / bat->rate);
+		hi = floorf(freq[b] * edge * P / bat->rate);
+		if (hi > P / 2 - 1)
+			hi = P / 2 - 1;
+		for (j = lo, pc = pr = 0.0; j <= hi; j++) {
+			pc += cap[j * M];
+			pr += ref[j];
+		}
+		resp[b] = ratio_db(pc, pr);
+		refp[b] = pr;
+		valid[b] = lo <= hi && pr > 0.0;
+		if (pr > ref_max)
+			ref_max = pr;
+	}
+
+	/* at low rates the bands stop below 1000 Hz */
+	if (n <= -RESPONSE_BAND_MIN || !valid[-RESPONSE_BAND_MIN]) {
+		fprintf(bat->err, _("No test signal in the 1000 Hz band\n"));
+		err = -ENOPEAK;
+		goto out;
+	}
+
+	fprintf(bat->log, _("Frequency response relative to 1000 Hz:\n"));
+	for (b = 0; b < n; b++) {
+		/* skip bands the signal does not reach */
+		if (!valid[b] || refp[b] < ref_max * 1e-6)
+			continue;
+		dev = resp[b] - resp[-RESPONSE_BAND_MIN];
+		fprintf(bat->log, _("  %8.1f Hz %7.2f dB\n"), freq[b], dev);
+		if (fabsf(dev) > max_dev)
+			max_dev = fabsf(dev);
+	}
+	fprintf(bat->log, _("Maximum deviation %.2f dB\n"), max_dev);
+
+	if (bat->check_flatness && max_dev > bat->flatness_thd_db) {
+		fprintf(bat->err, _(" FAIL: response deviation above"));
+		fprintf(bat->err, _(" threshold %.2f dB\n"),
+				bat->flatness_thd_db);
+		err = -ERESPONSE;
+	}
+
+out:
+	free(ref);
+	free(cap);
+	return err;
+}
+
+static int analyze_channel(struct bat *bat, float *x, int c,
+		fftwf_plan plan)
+{
+	struct analyze a;
+	int err;
+
+	if (bat->signal != SIGNAL_SINE) {
+		fprintf(bat->log, _("\nChannel %i - "), c + 1);
+		if (bat->standalone)
+			return 0;
+		return check_response(bat, x, c, plan);
+	}
+
+	fprintf(bat->log, _("\nChannel %i - "), c + 1);
+	fprintf(bat->log, _("Checking for target frequency %2.2f Hz\n"),
+			bat->target_freq[c]);
+	a.in = x;
+	if (!bat->standalone) {
+		err = find_and_check_harmonics(bat, &a, c, plan);
+		if (err != 0)
+			return err;
+	}
+
+	if (snr_is_valid(bat->snr_thd_db)) {
+		fprintf(bat->log, _("\nChecking for SNR: "));
+		fprintf(bat->log, _("Threshold is %.2f dB (%.2f%%)\n"),
+				bat->snr_thd_db, 100.0
+				/ powf(10.0, bat->snr_thd_db / 20.0));
+		err = calculate_noise(bat, x, c);
+		if (err != 0)
+			return err;
+	}
+
+	if (!bat->standalone && (bat->check_thdn || bat->check_crosstalk))
+		return check_distortion(bat, x, c, plan);
 
 	return 0;
 }
 
+static int load_and_analyze_channel(struct bat *bat, void *data, int c,
+		fftwf_plan plan)
+{
+	float *x;
+	int err;
+
+	x = load_channel(bat, data, c);
+	if (x == NULL)
+		return -ENOMEM;
+	err = analyze_channel(bat, x, c, plan);
+	fftwf_free(x);
+
+	return err;
+}
+
+static void *channel_worker(void *arg)
+{
+	struct channel_job *job = arg;
+
+	job->err = load_and_analyze_channel(&job->bat, job->buf, job->channel,
+			job->plan);
+	return NULL;
+}
+
+static void channel_job_close(struct channel_job *job)
+{
+	if (job->bat.err != job->bat.log && job->bat.err != NULL)
+		fclose(job->bat.err);
+	if (job->bat.log != NULL)
+		fclose(job->bat.log);
+	job->bat.log = job->bat.err = NULL;
+}
+
+/**
+ * Analyze all channels concurrently. Each channel logs into memory and the
+ * logs are printed in channel order once all are done, so the output is
+ * the same as a serial run, stopping at the first failing channel.
+ */
+static int analyze_channels(struct bat *bat, fftwf_plan plan)
+{
+	struct channel_job jobs[MAX_CHANNELS], *job;
+	int c, err = 0;
+
+	if (bat->channels == 1)
+		return load_and_analyze_channel(bat, bat->buf, 0, plan);
+
+	memset(jobs, 0, sizeof(jobs));
+	for (c = 0; c < bat->channels; c++) {
+		job = &jobs[c];
+		job->bat = *bat;
+		job->channel = c;
+		job->plan = plan;
+		job->buf = bat->buf;
+		job->bat.log = open_memstream(&job->log_buf, &job->log_len);
+		if (bat->err == bat->log)
+			job->bat.err = job->bat.log;
+		else
+			job->bat.err = open_memstream(&job->err_buf,
+					&job->err_len);
+		if (job->bat.log == NULL || job->bat.err == NULL) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	for (c = 0; c < bat->channels; c++) {
+		job = &jobs[c];
+		job->started = pthread_create(&job->thread, NULL,
+				channel_worker, job) == 0;
+		if (!job->started)
+			channel_worker(job);
+	}
+
+	for (c = 0; c < bat->channels; c++) {
+		job = &jobs[c];
+		if (job->started)
+			pthread_join(job->thread, NULL);
+		channel_job_close(job);
+		if (err != 0)
+			continue;
+		bat->result[c] = job->bat.result[c];
+		if (job->log_buf)
+			fwrite(job->log_buf, 1, job->log_len, bat->log);
+		if (job->err_buf)
+			fwrite(job->err_buf, 1, job->err_len, bat->err);
+		err = job->err;
+	}
+
+out:
+	for (c = 0; c < bat->channels; c++) {
+		channel_job_close(&jobs[c]);
+		free(jobs[c].log_buf);
+		free(jobs[c].err_buf);
+	}
+
+	return err;
+}
+
 /* truncate sample frames for faster FFT analysis process */
 static int truncate_frames(struct bat *bat)
 {
@@ -434,80 +1003,585 @@ static int truncate_frames(struct bat *bat)
 	return -EINVAL;
 }
 
+/**
+ * Map the capture file read-only, so that captures larger than the memory
+ * can be analyzed; the channels are converted from the page cache by their
+ * workers. Fall back to reading the analyzed frames if mapping fails.
+ */
+static int map_capture(struct bat *bat, struct capture_map *m)
+{
+	struct stat st;
+	off_t offset;
+	size_t items;
+
+	memset(m, 0, sizeof(*m));
+
+	offset = ftello(bat->fp);
+	if (offset < 0 || fstat(fileno(bat->fp), &st) < 0)
+		return -errno;
+	if ((st.st_size - offset) / bat->frame_size < bat->frames)
+		return -EIO;
+
+	m->addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+			fileno(bat->fp), 0);
+	if (m->addr != MAP_FAILED) {
+		m->length = st.st_size;
+		m->data = (char *) m->addr + offset;
+		madvise(m->addr, m->length, MADV_SEQUENTIAL);
+		return 0;
+	}
+
+	m->addr = NULL;
+	m->data = malloc((size_t) bat->frames * bat->frame_size);
+	if (m->data == NULL)
+		return -ENOMEM;
+	items = fread(m->data, bat->frame_size, bat->frames, bat->fp);
+	if (items != bat->frames)
+		return -EIO;
+	return 0;
+}
+
+static void unmap_capture(struct capture_map *m)
+{
+	if (m->addr)
+		munmap(m->addr, m->length);
+	else
+		free(m->data);
+}
+
 int analyze_capture(struct bat *bat)
 {
 	int err = 0;
-	size_t items;
-	int c;
-	struct analyze a;
+	struct capture_map map;
+	fftwf_plan plan = NULL;
 
 	err = truncate_frames(bat);
 	if (err < 0) {
-		fprintf(bat->err, _("Invalid frame number for analysis: %d\n"),
+		fprintf(bat->err, _("Invalid frame number for analysis: %lld\n"),
 				bat->frames);
 		return err;
 	}
 
-	fprintf(bat->log, _("\nBAT analysis: signal has %d frames at %d Hz,"),
+	fprintf(bat->log, _("\nBAT analysis: signal has %lld frames at %d Hz,"),
 			bat->frames, bat->rate);
 	fprintf(bat->log, _(" %d channels, %d bytes per sample.\n"),
 			bat->channels, bat->sample_size);
 
-	bat->buf = malloc(bat->frames * bat->frame_size);
-	if (bat->buf == NULL)
-		return -ENOMEM;
-
 	bat->fp = fopen(bat->capture.file, "rb");
 	err = -errno;
 	if (bat->fp == NULL) {
 		fprintf(bat->err, _("Cannot open file: %s %d\n"),
 				bat->capture.file, err);
-		goto exit1;
+		return err;
 	}
 
 	/* Skip header */
 	err = read_wav_header(bat, bat->capture.file, bat->fp, true);
 	if (err != 0)
-		goto exit2;
+		goto exit1;
 
-	items = fread(bat->buf, bat->frame_size, bat->frames, bat->fp);
-	if (items != bat->frames) {
-		err = -EIO;
+	err = map_capture(bat, &map);
+	if (err != 0)
 		goto exit2;
+	bat->buf = map.data;
+
+	if (!bat->standalone) {
+		plan = get_fft_plan(bat, bat->frames);
+		if (plan == NULL) {
+			fprintf(bat->err, _("Cannot create FFT plan\n"));
+			err = -ENOMEM;
+			goto exit2;
+		}
 	}
 
-	err = reorder_data(bat);
-	if (err != 0)
-		goto exit2;
+	err = analyze_channels(bat, plan);
+	if (err == 0 && !bat->standalone && bat->check_crosstalk
+			&& bat->signal == SIGNAL_SINE && bat->channels > 1)
+		err = check_crosstalk(bat);
+	if (err == 0 && bat->check_glitch)
+		err = glitch_check_file(bat);
+
+	save_fft_wisdom(bat);
+
+exit2:
+	unmap_capture(&map);
+	bat->buf = NULL;
+exit1:
+	fclose(bat->fp);
 
+	return err;
+}
+
+/* Streaming analysis: captured periods are split into Hann windowed
+ * segments of STREAM_SEGMENT_SECS with 50% overlap. Each segment is checked
+ * on its own, so a failure shows up while the capture is running, and its
+ * power spectrum is added to a Welch average reported at the end. Memory
+ * use does not depend on the capture duration. */
+#define STREAM_SEGMENT_SECS		1
+/* frames fed at a time from a capture file */
+#define STREAM_FILE_CHUNK		65536
+/* bins on each side of the peak counted as signal (Hann main lobe) */
+#define STREAM_PEAK_BINS		3
+
+struct stream_channel {
+	float *seg;			/* deinterleaved samples, N frames */
+	int fill;			/* frames in seg */
+	double *psd;			/* sum of segment power spectra */
+	float snr_sum;
+	float snr_min;
+};
+
+struct stream_analyzer {
+	int N;				/* segment size, power of two */
+	int bin_lo;			/* first bin above DC_THRESHOLD */
+	fftwf_plan plan;
+	float *window;
+	float *in;
+	float *out;
+	float *power;
+	float *conv;			/* converted chunk, interleaved */
+	int conv_frames;
+	unsigned int segments;
+	long long frames;
+	struct stream_channel ch[MAX_CHANNELS];
+};
+
+static void stream_free(struct stream_analyzer *s)
+{
+	int c;
+
+	for (c = 0; c < MAX_CHANNELS; c++) {
+		free(s->ch[c].seg);
+		free(s->ch[c].psd);
+	}
+	free(s->conv);
+	free(s->power);
+	fftwf_free(s->out);
+	fftwf_free(s->in);
+	free(s->window);
+	free(s);
+}
+
+int stream_analyze_init(struct bat *bat)
+{
+	struct stream_analyzer *s;
+	int c, i, N = MIN_BUFFERSIZE;
+
+	while (N * 2 <= bat->rate * STREAM_SEGMENT_SECS)
+		N *= 2;
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		return -ENOMEM;
+	s->N = N;
+	s->bin_lo = (int) (DC_THRESHOLD * N / bat->rate) + 1;
+	s->window = malloc(sizeof(float) * N);
+	s->in = (float *) fftwf_malloc(sizeof(float) * N);
+	s->out = (float *) fftwf_malloc(sizeof(float) * N);
+	s->power = malloc(sizeof(float) * (N / 2));
+	if (!s->window || !s->in || !s->out || !s->power)
+		goto err_nomem;
 	for (c = 0; c < bat->channels; c++) {
-		fprintf(bat->log, _("\nChannel %i - "), c + 1);
-		fprintf(bat->log, _("Checking for target frequency %2.2f Hz\n"),
+		s->ch[c].seg = malloc(sizeof(float) * N);
+		s->ch[c].psd = calloc(N / 2, sizeof(double));
+		if (!s->ch[c].seg || !s->ch[c].psd)
+			goto err_nomem;
+		s->ch[c].snr_min = SNR_DB_MAX;
+	}
+
+	for (i = 0; i < N; i++)
+		s->window[i] = 0.5 - 0.5 * cosf(2.0 * M_PI * i / N);
+
+	s->plan = get_fft_plan(bat, N);
+	if (s->plan == NULL) {
+		fprintf(bat->err, _("Cannot create FFT plan\n"));
+		stream_free(s);
+		return -ENOMEM;
+	}
+
+	if (bat->check_glitch && glitch_init(bat) < 0)
+		goto err_nomem;
+
+	fprintf(bat->log, _("\nBAT streaming analysis: %d frames per segment,"),
+			N);
+	fprintf(bat->log, _(" %2.2f Hz resolution\n"), (float) bat->rate / N);
+
+	bat->stream = s;
+	return 0;
+
+err_nomem:
+	stream_free(s);
+	return -ENOMEM;
+}
+
+/* peak bin of s->power in [bin_lo, N/2), refined by parabolic interpolation */
+static float stream_peak(struct stream_analyzer *s, const float *power,
+		int *bin)
+{
+	float l, m, r, d = 0.0;
+	int i, k = s->bin_lo;
+
+	for (i = s->bin_lo; i < s->N / 2; i++)
+		if (power[i] > power[k])
+			k = i;
+	*bin = k;
+
+	if (k > s->bin_lo && k < s->N / 2 - 1) {
+		l = sqrtf(power[k - 1]);
+		m = sqrtf(power[k]);
+		r = sqrtf(power[k + 1]);
+		if (l - 2.0 * m + r != 0.0)
+			d = 0.5 * (l - r) / (l - 2.0 * m + r);
+	}
+
+	return k + d;
+}
+
+static float stream_snr(struct stream_analyzer *s, const float *power, int k)
+{
+	double sig = 0.0, noise = 0.0;
+	int i;
+
+	for (i = s->bin_lo; i < s->N / 2; i++) {
+		if (abs(i - k) <= STREAM_PEAK_BINS)
+			sig += power[i];
+		else
+			noise += power[i];
+	}
+
+	if (sig == 0.0)
+		return SNR_DB_INVALID;
+	if (noise == 0.0)
+		return SNR_DB_MAX;
+	return 10.0 * log10(sig / noise);
+}
+
+static int stream_check(struct bat *bat, struct stream_analyzer *s, int c,
+		float peak, float snr, const char *what)
+{
+	float hz = (float) bat->rate / s->N;
+	float hz_peak = peak * hz;
+	float delta_rate = DELTA_RATE * bat->target_freq[c];
+	float tolerance = (delta_rate > DELTA_HZ) ? delta_rate : DELTA_HZ;
+
+	if (snr == SNR_DB_INVALID) {
+		fprintf(bat->err, _("Channel %i: %s: no signal detected\n"),
+				c + 1, what);
+		return -ENOPEAK;
+	}
+	if (fabsf(hz_peak - bat->target_freq[c]) > tolerance) {
+		fprintf(bat->err, _("Channel %i: %s: FAIL: peak at %2.2f Hz,"),
+				c + 1, what, hz_peak);
+		fprintf(bat->err, _(" target %2.2f Hz\n"),
 				bat->target_freq[c]);
-		a.buf = bat->buf +
-				c * bat->frames * bat->frame_size
-				/ bat->channels;
-		if (!bat->standalone) {
-			err = find_and_check_harmonics(bat, &a, c);
-			if (err != 0)
-				goto exit2;
+		return -EBADPEAK;
+	}
+	if (snr_is_valid(bat->snr_thd_db) && snr < bat->snr_thd_db) {
+		fprintf(bat->err, _("Channel %i: %s: FAIL: SNR %.2f dB"),
+				c + 1, what, snr);
+		fprintf(bat->err, _(" below threshold %.2f dB\n"),
+				bat->snr_thd_db);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int stream_segment(struct bat *bat, struct stream_analyzer *s, int c)
+{
+	struct stream_channel *ch = &s->ch[c];
+	char what[64];
+	float peak, snr;
+	int i, k, N = s->N;
+
+	for (i = 0; i < N; i++)
+		s->in[i] = ch->seg[i] * s->window[i];
+	fftwf_execute_r2r(s->plan, s->in, s->out);
+
+	s->power[0] = 0.0;
+	for (i = 1; i < N / 2; i++) {
+		s->power[i] = s->out[i] * s->out[i]
+				+ s->out[N - i] * s->out[N - i];
+		ch->psd[i] += s->power[i];
+	}
+
+	peak = stream_peak(s, s->power, &k);
+	snr = stream_snr(s, s->power, k);
+	if (snr != SNR_DB_INVALID) {
+		ch->snr_sum += snr;
+		if (snr < ch->snr_min)
+			ch->snr_min = snr;
+	}
+
+	/* keep the second half for the next, overlapping segment */
+	memmove(ch->seg, ch->seg + N / 2, sizeof(float) * (N / 2));
+	ch->fill = N / 2;
+
+	snprintf(what, sizeof(what), _("segment at %.2fs"),
+			(float) (s->frames - N) / bat->rate);
+	return stream_check(bat, s, c, peak, snr, what);
+}
+
+/**
+ * Feed captured interleaved frames to the streaming analyzer.
+ *
+ * @return 0 while the signal is good, or the error of the first segment
+ *         which failed the checks
+ */
+int stream_analyze_feed(struct bat *bat, void *buf, int frames)
+{
+	struct stream_analyzer *s = bat->stream;
+	float *p;
+	int c, n, err = 0, done = 0;
+
+	if (frames > s->conv_frames) {
+		p = realloc(s->conv, sizeof(float) * frames * bat->channels);
+		if (p == NULL)
+			return -ENOMEM;
+		s->conv = p;
+		s->conv_frames = frames;
+	}
+	bat->convert_sample_to_float(buf, s->conv, frames * bat->channels);
+	if (bat->glitch)
+		glitch_feed(bat, s->conv, frames);
+
+	while (done < frames) {
+		n = s->N - s->ch[0].fill;
+		if (n > frames - done)
+			n = frames - done;
+		for (c = 0; c < bat->channels; c++) {
+			struct stream_channel *ch = &s->ch[c];
+			const float *src = s->conv + done * bat->channels + c;
+			int i;
+
+			for (i = 0; i < n; i++, src += bat->channels)
+				ch->seg[ch->fill + i] = *src;
+			ch->fill += n;
 		}
+		done += n;
+		s->frames += n;
 
-		if (snr_is_valid(bat->snr_thd_db)) {
-			fprintf(bat->log, _("\nChecking for SNR: "));
-			fprintf(bat->log, _("Threshold is %.2f dB (%.2f%%)\n"),
-					bat->snr_thd_db, 100.0
-					/ powf(10.0, bat->snr_thd_db / 20.0));
-			err = find_and_check_noise(bat, a.buf, c);
-			if (err != 0)
-				goto exit2;
+		if (s->ch[0].fill < s->N)
+			continue;
+		s->segments++;
+		for (c = 0; c < bat->channels; c++) {
+			int e = stream_segment(bat, s, c);
+
+			if (e != 0 && err == 0)
+				err = e;
 		}
+		if (err != 0)
+			break;
 	}
 
-exit2:
+	return err;
+}
+
+/**
+ * Report the Welch averaged spectrum of each channel and free the analyzer.
+ */
+int stream_analyze_finish(struct bat *bat)
+{
+	struct stream_analyzer *s = bat->stream;
+	struct stream_channel *ch;
+	float *power = s->power;
+	float peak, snr;
+	int c, i, k, err = 0, e;
+
+	fprintf(bat->log, _("\nBAT streaming analysis: %lld frames,"),
+			s->frames);
+	fprintf(bat->log, _(" %u segments\n"), s->segments);
+
+	if (s->segments == 0) {
+		fprintf(bat->err, _("Not enough frames for analysis\n"));
+		err = -EINVAL;
+		goto out;
+	}
+
+	for (c = 0; c < bat->channels; c++) {
+		ch = &s->ch[c];
+		power[0] = 0.0;
+		for (i = 1; i < s->N / 2; i++)
+			power[i] = ch->psd[i] / s->segments;
+
+		peak = stream_peak(s, power, &k);
+		snr = stream_snr(s, power, k);
+
+		fprintf(bat->log, _("\nChannel %i - "), c + 1);
+		fprintf(bat->log, _("Checking for target frequency %2.2f Hz\n"),
+				bat->target_freq[c]);
+		fprintf(bat->log, _("Detected peak at %2.2f Hz\n"),
+				peak * bat->rate / s->N);
+		fprintf(bat->log, _("SNR %.2f dB, segment average %.2f dB,"),
+				snr, ch->snr_sum / s->segments);
+		fprintf(bat->log, _(" minimum %.2f dB\n"), ch->snr_min);
+
+		bat->result[c].peak_hz = peak * bat->rate / s->N;
+		bat->result[c].snr_db = snr;
+
+		e = stream_check(bat, s, c, peak, snr, _("average"));
+		if (e == 0)
+			fprintf(bat->log, _(" PASS\n"));
+		else if (err == 0)
+			err = e;
+	}
+
+	save_fft_wisdom(bat);
+out:
+	if (bat->glitch) {
+		e = glitch_finish(bat);
+		if (err == 0)
+			err = e;
+	}
+	stream_free(s);
+	bat->stream = NULL;
+	return err;
+}
+
+/* release an analyzer which was set up but not finished */
+void stream_analyze_free(struct bat *bat)
+{
+	glitch_free(bat);
+	if (bat->stream)
+		stream_free(bat->stream);
+	bat->stream = NULL;
+}
+
+/**
+ * Streaming analysis of an existing capture file, for --local: the whole
+ * file is mapped and fed to the analyzer a chunk at a time, so captures of
+ * any length are analyzed at constant memory.
+ */
+int stream_analyze_file(struct bat *bat)
+{
+	struct capture_map map;
+	long long frames = 0, done;
+	int n, err, e;
+
+	memset(&map, 0, sizeof(map));
+
+	bat->fp = fopen(bat->capture.file, "rb");
+	err = -errno;
+	if (bat->fp == NULL) {
+		fprintf(bat->err, _("Cannot open file: %s %d\n"),
+				bat->capture.file, err);
+		stream_analyze_finish(bat);
+		return err;
+	}
+
+	err = read_wav_header(bat, bat->capture.file, bat->fp, true);
+	if (err == 0) {
+		/* no minimum length, the whole file is analyzed */
+		bat->frames = 0;
+		err = map_capture(bat, &map);
+	}
+	if (err == 0 && map.addr == NULL) {
+		fprintf(bat->err, _("Cannot map file: %s\n"),
+				bat->capture.file);
+		err = -EIO;
+	}
+	/* from the file size, the header length is limited to 4 GiB */
+	if (err == 0)
+		frames = (map.length - ((char *) map.data - (char *) map.addr))
+			/ bat->frame_size;
+
+	for (done = 0; err == 0 && done < frames; done += n) {
+		n = frames - done < STREAM_FILE_CHUNK ?
+			frames - done : STREAM_FILE_CHUNK;
+		err = stream_analyze_feed(bat, (char *) map.data
+				+ done * bat->frame_size, n);
+	}
+
+	e = stream_analyze_finish(bat);
+	if (err == 0)
+		err = e;
+
+	unmap_capture(&map);
 	fclose(bat->fp);
-exit1:
-	free(bat->buf);
+	return err;
+}
+
+/**
+ * Locate the reference sequence ref in sig by FFT cross-correlation.
+ *
+ * @pos receives the offset of ref in sig in frames, refined to a fraction
+ *      of a frame by parabolic interpolation of the correlation peak
+ * @score receives the peak to rms ratio of the correlation, low when ref
+ *        is not present in sig
+ */
+int xcorr_locate(struct bat *bat, const float *ref, int nref,
+		const float *sig, int nsig, float *pos, float *score)
+{
+	fftwf_plan fwd, inv;
+	float *r, *x, *c, mean, re, im, l, m, rt;
+	double sum, rms;
+	int i, k, N = MIN_BUFFERSIZE, err = 0;
+
+	if (nref <= 0 || nsig < nref)
+		return -EINVAL;
+	while (N < nsig + nref)
+		N *= 2;
+
+	fwd = get_fft_plan_kind(bat, N, FFTW_R2HC);
+	inv = get_fft_plan_kind(bat, N, FFTW_HC2R);
+	if (fwd == NULL || inv == NULL)
+		return -ENOMEM;
+
+	r = (float *) fftwf_malloc(sizeof(float) * N);
+	x = (float *) fftwf_malloc(sizeof(float) * N);
+	c = (float *) fftwf_malloc(sizeof(float) * N);
+	if (!r || !x || !c) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	/* zero padded and without DC, so an offset does not correlate */
+	for (i = 0, sum = 0.0; i < nref; i++)
+		sum += ref[i];
+	mean = sum / nref;
+	for (i = 0; i < N; i++)
+		c[i] = i < nref ? ref[i] - mean : 0.0;
+	fftwf_execute_r2r(fwd, c, r);
+
+	for (i = 0, sum = 0.0; i < nsig; i++)
+		sum += sig[i];
+	mean = sum / nsig;
+	for (i = 0; i < N; i++)
+		c[i] = i < nsig ? sig[i] - mean : 0.0;
+	fftwf_execute_r2r(fwd, c, x);
+
+	/* conj(R) * X in halfcomplex order */
+	x[0] *= r[0];
+	x[N / 2] *= r[N / 2];
+	for (i = 1; i < N / 2; i++) {
+		re = r[i] * x[i] + r[N - i] * x[N - i];
+		im = r[i] * x[N - i] - r[N - i] * x[i];
+		x[i] = re;
+		x[N - i] = im;
+	}
+	fftwf_execute_r2r(inv, x, c);
+
+	/* only lags where ref fits in sig are valid */
+	for (i = 0, k = 0, sum = 0.0; i <= nsig - nref; i++) {
+		if (c[i] > c[k])
+			k = i;
+		sum += (double) c[i] * c[i];
+	}
+	rms = sqrt(sum / (nsig - nref + 1));
+
+	*pos = k;
+	if (k > 0 && k < nsig - nref) {
+		l = c[k - 1];
+		m = c[k];
+		rt = c[k + 1];
+		if (l - 2.0 * m + rt != 0.0)
+			*pos += 0.5 * (l - rt) / (l - 2.0 * m + rt);
+	}
+	*score = rms > 0.0 ? c[k] / rms : 0.0;
 
+out:
+	fftwf_free(c);
+	fftwf_free(x);
+	fftwf_free(r);
 	return err;
 }
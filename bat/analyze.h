@@ -14,3 +14,11 @@
  */
 
 int analyze_capture(struct bat *);
+int stream_analyze_init(struct bat *);
+int stream_analyze_feed(struct bat *, void *, int);
+int stream_analyze_finish(struct bat *);
+void stream_analyze_free(struct bat *);
+int stream_analyze_file(struct bat *);
+void analyze_cleanup(void);
+int xcorr_locate(struct bat *, const float *, int, const float *, int,
+		float *, float *);
@@ -29,3 +29,9 @@ float sin_generator_next_sample(struct sin_generator *);
 void sin_generator_vfill(struct sin_generator *, float *, int);
 int generate_sine_wave(struct bat *, int, void *);
 int generate_sine_wave_raw_mono(struct bat *, float *, float, int);
+int generate_chirp_raw_mono(struct bat *, float *, float, float, int, int);
+int response_frequencies(struct bat *, float *);
+int signal_period(struct bat *);
+const float *get_signal_table(struct bat *, int *);
+int generate_signal(struct bat *, int, void *);
+void signal_cleanup(void);
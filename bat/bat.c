@@ -42,6 +42,7 @@
 #include "analyze.h"
 #endif
 #include "latencytest.h"
+#include "multi.h"
 
 /* get snr threshold in dB */
 static void get_snr_thd_db(struct bat *bat, char *thd)
@@ -75,33 +76,66 @@ static void get_snr_thd_pc(struct bat *bat, char *thd)
 	bat->snr_thd_db = 20.0 * log10f(100.0 / thd_pc);
 }
 
+/* get a threshold in dB for the THD+N, crosstalk and response checks */
+static float get_thd_db(struct bat *bat, char *thd)
+{
+	float thd_db;
+	char *ptrf;
+
+	errno = 0;
+	thd_db = strtof(thd, &ptrf);
+	if (errno != 0 || ptrf == thd || *ptrf != '\0') {
+		fprintf(bat->err, _("Invalid threshold '%s'\n"), thd);
+		exit(EXIT_FAILURE);
+	}
+	return thd_db;
+}
+
+static void get_signal(struct bat *bat, char *name)
+{
+	if (strcasecmp(name, "sine") == 0)
+		bat->signal = SIGNAL_SINE;
+	else if (strcasecmp(name, "multitone") == 0)
+		bat->signal = SIGNAL_MULTITONE;
+	else if (strcasecmp(name, "sweep") == 0)
+		bat->signal = SIGNAL_SWEEP;
+	else {
+		fprintf(bat->err, _("Invalid signal '%s'\n"), name);
+		exit(EXIT_FAILURE);
+	}
+}
+
 static int get_duration(struct bat *bat)
 {
 	int err;
-	float duration_f;
-	long duration_i;
+	long long max_frames;
+	double duration_f;
+	long long duration_i;
 	char *ptrf, *ptri;
 
-	duration_f = strtof(bat->narg, &ptrf);
+	duration_f = strtod(bat->narg, &ptrf);
 	err = -errno;
-	if (duration_f == HUGE_VALF || duration_f == -HUGE_VALF
+	if (duration_f == HUGE_VAL || duration_f == -HUGE_VAL
 			|| (duration_f == 0.0 && err != 0))
 		goto err_exit;
 
-	duration_i = strtol(bat->narg, &ptri, 10);
-	if (duration_i == LONG_MAX || duration_i == LONG_MIN)
+	duration_i = strtoll(bat->narg, &ptri, 10);
+	if (duration_i == LLONG_MAX || duration_i == LLONG_MIN)
 		goto err_exit;
 
-	if (*ptrf == 's')
+	/* streaming analysis does not keep the capture in memory */
+	max_frames = bat->streaming ? MAX_STREAM_FRAMES : MAX_FRAMES;
+
+	if (*ptrf == 's' && duration_f * bat->rate <= max_frames)
 		bat->frames = duration_f * bat->rate;
-	else if (*ptri == 0)
+	else if (*ptri == 0 && duration_i <= max_frames)
 		bat->frames = duration_i;
 	else
 		bat->frames = -1;
 
-	if (bat->frames <= 0 || bat->frames > MAX_FRAMES) {
-		fprintf(bat->err, _("Invalid duration. Range: (0, %d(%fs))\n"),
-				MAX_FRAMES, (float)MAX_FRAMES / bat->rate);
+	if (bat->frames <= 0 || bat->frames > max_frames) {
+		fprintf(bat->err, _("Invalid duration. Range: (0, %lld(%fs))\n"),
+				max_frames, (double)max_frames / bat->rate);
 		return -EINVAL;
 	}
 
@@ -334,8 +368,20 @@ _("Usage: alsabat [-options]...\n"
 "      --local            internal loop, set to bypass pcm hardware devices\n"
 "      --standalone       standalone mode, to bypass analysis\n"
 "      --roundtriplatency round trip latency mode\n"
+"      --latency-xcorr    round trip latency by chirp cross-correlation\n"
 "      --snr-db=#         noise detect threshold, in SNR(dB)\n"
 "      --snr-pc=#         noise detect threshold, in noise percentage(%%)\n"
+"      --wisdom=#         file to load and store FFTW wisdom\n"
+"      --stream           analyze while capturing, at constant memory\n"
+"      --multi=#          file listing playback and capture device pairs\n"
+"                         to test concurrently\n"
+"      --report=#         file for the JSON report of --multi\n"
+"      --signal=#         test signal: sine, multitone or sweep\n"
+"      --thdn=#           THD+N threshold, in dB\n"
+"      --crosstalk=#      crosstalk threshold between channels, in dB\n"
+"      --flatness=#       frequency response deviation threshold, in dB\n"
+"      --glitch=#         detect discontinuities of the sine wave above this\n"
+"                         level, in dB relative to the sine wave\n"
 ));
 	fprintf(bat->log, _("Recognized sample formats are: "));
 	fprintf(bat->log, _("U8 S16_LE S24_3LE S32_LE\n"));
@@ -395,8 +441,18 @@ static void parse_arguments(struct bat *bat, int argc, char *argv[])
 		{"local",    0, 0, OPT_LOCAL},
 		{"standalone", 0, 0, OPT_STANDALONE},
 		{"roundtriplatency", 0, 0, OPT_ROUNDTRIPLATENCY},
+		{"latency-xcorr", 0, 0, OPT_LATENCY_XCORR},
 		{"snr-db",   1, 0, OPT_SNRTHD_DB},
 		{"snr-pc",   1, 0, OPT_SNRTHD_PC},
+		{"wisdom",   1, 0, OPT_WISDOM},
+		{"stream",   0, 0, OPT_STREAM},
+		{"multi",    1, 0, OPT_MULTI},
+		{"report",   1, 0, OPT_REPORT},
+		{"signal",   1, 0, OPT_SIGNAL},
+		{"thdn",     1, 0, OPT_THDN},
+		{"crosstalk", 1, 0, OPT_CROSSTALK},
+		{"flatness", 1, 0, OPT_FLATNESS},
+		{"glitch",   1, 0, OPT_GLITCH},
 		{0, 0, 0, 0}
 	};
 
@@ -421,12 +477,47 @@ static void parse_arguments(struct bat *bat, int argc, char *argv[])
 		case OPT_ROUNDTRIPLATENCY:
 			bat->roundtriplatency = true;
 			break;
+		case OPT_LATENCY_XCORR:
+			bat->roundtriplatency = true;
+			bat->roundtripxcorr = true;
+			break;
 		case OPT_SNRTHD_DB:
 			get_snr_thd_db(bat, optarg);
 			break;
 		case OPT_SNRTHD_PC:
 			get_snr_thd_pc(bat, optarg);
 			break;
+		case OPT_WISDOM:
+			bat->wisdom = optarg;
+			break;
+		case OPT_STREAM:
+			bat->streaming = true;
+			break;
+		case OPT_MULTI:
+			bat->multi = optarg;
+			break;
+		case OPT_REPORT:
+			bat->report = optarg;
+			break;
+		case OPT_SIGNAL:
+			get_signal(bat, optarg);
+			break;
+		case OPT_THDN:
+			bat->check_thdn = true;
+			bat->thdn_thd_db = get_thd_db(bat, optarg);
+			break;
+		case OPT_CROSSTALK:
+			bat->check_crosstalk = true;
+			bat->crosstalk_thd_db = get_thd_db(bat, optarg);
+			break;
+		case OPT_FLATNESS:
+			bat->check_flatness = true;
+			bat->flatness_thd_db = get_thd_db(bat, optarg);
+			break;
+		case OPT_GLITCH:
+			bat->check_glitch = true;
+			bat->glitch_thd_db = get_thd_db(bat, optarg);
+			break;
 		case 'D':
 			if (bat->playback.device == NULL)
 				bat->playback.device = optarg;
@@ -512,6 +603,78 @@ static int validate_options(struct bat *bat)
 		return -EINVAL;
 	}
 
+#ifndef HAVE_LIBFFTW3F
+	if (bat->roundtripxcorr) {
+		fprintf(bat->err, _("cross-correlation needs libfftw3\n"));
+		return -EINVAL;
+	}
+#endif
+
+	/* multi-device mode runs loopback tests only */
+	if (bat->multi && (bat->local || bat->roundtriplatency
+			|| bat->playback.mode == MODE_SINGLE
+			|| bat->capture.mode == MODE_SINGLE)) {
+		fprintf(bat->err, _("--multi needs loopback mode\n"));
+		return -EINVAL;
+	}
+
+	/* streaming analysis is done by the alsa capture loop, or over the
+	 * file in local mode */
+	if (bat->streaming) {
+#if defined(HAVE_LIBTINYALSA) || !defined(HAVE_LIBFFTW3F)
+		fprintf(bat->err, _("streaming analysis not supported\n"));
+		return -EINVAL;
+#endif
+		if (bat->roundtriplatency
+				|| bat->playback.mode == MODE_SINGLE) {
+			fprintf(bat->err, _("streaming analysis needs capture"));
+			fprintf(bat->err, _(" from a pcm device or a file\n"));
+			return -EINVAL;
+		}
+	}
+
+	/* the analyzers need the generated signal and the full capture */
+	if (bat->signal != SIGNAL_SINE || bat->check_thdn
+			|| bat->check_crosstalk || bat->check_flatness) {
+#ifndef HAVE_LIBFFTW3F
+		fprintf(bat->err, _("signal analysis needs libfftw3\n"));
+		return -EINVAL;
+#endif
+		if (bat->playback.file || bat->streaming
+				|| bat->roundtriplatency) {
+			fprintf(bat->err, _("signal analysis is not supported"));
+			fprintf(bat->err, _(" with --file, --stream or latency"));
+			fprintf(bat->err, _(" tests\n"));
+			return -EINVAL;
+		}
+	}
+	if (bat->signal == SIGNAL_SINE && bat->check_flatness) {
+		fprintf(bat->err, _("--flatness needs a multitone or sweep"));
+		fprintf(bat->err, _(" signal\n"));
+		return -EINVAL;
+	}
+	if (bat->signal != SIGNAL_SINE
+			&& (bat->check_thdn || bat->check_crosstalk)) {
+		fprintf(bat->err, _("--thdn and --crosstalk need a sine"));
+		fprintf(bat->err, _(" signal\n"));
+		return -EINVAL;
+	}
+
+	/* glitches are tracked on the sine wave of the captured signal */
+	if (bat->check_glitch) {
+#ifndef HAVE_LIBFFTW3F
+		fprintf(bat->err, _("glitch detection needs libfftw3\n"));
+		return -EINVAL;
+#endif
+		if (bat->signal != SIGNAL_SINE || bat->standalone
+				|| bat->roundtriplatency
+				|| bat->playback.mode == MODE_SINGLE) {
+			fprintf(bat->err, _("--glitch needs the analysis of a"));
+			fprintf(bat->err, _(" captured sine wave\n"));
+			return -EINVAL;
+		}
+	}
+
 	/* check sine wave frequency range */
 	freq_low = DC_THRESHOLD;
 	freq_high = bat->rate * RATE_FACTOR;
@@ -589,7 +752,7 @@ static int bat_init(struct bat *bat)
 			} else {
 				/* Play CAPTURE_DELAY msec +
 				 * 150% of the nb of frames to be analyzed */
-				bat->sinus_duration = bat->rate *
+				bat->sinus_duration = (long long) bat->rate *
 						CAPTURE_DELAY / 1000;
 				bat->sinus_duration +=
 						(bat->frames + bat->frames / 2);
@@ -667,6 +830,20 @@ int main(int argc, char *argv[])
 	if (err < 0)
 		goto out;
 
+	/* device pairs tested concurrently, each with its own analysis */
+	if (bat.multi) {
+		err = run_multi(&bat);
+		goto out;
+	}
+
+#ifdef HAVE_LIBFFTW3F
+	if (bat.streaming) {
+		err = stream_analyze_init(&bat);
+		if (err < 0)
+			goto out;
+	}
+#endif
+
 	/* round trip latency test thread */
 	if (bat.roundtriplatency) {
 		while (1) {
@@ -693,6 +870,7 @@ int main(int argc, char *argv[])
 			/* Waiting 500ms and start the next round */
 			usleep(CAPTURE_DELAY * 1000);
 		}
+		roundtrip_latency_free(&bat);
 		goto out;
 	}
 
@@ -714,7 +892,11 @@ int main(int argc, char *argv[])
 
 analyze:
 #ifdef HAVE_LIBFFTW3F
-	if (!bat.standalone || snr_is_valid(bat.snr_thd_db))
+	if (bat.streaming && bat.local)
+		err = stream_analyze_file(&bat);
+	else if (bat.streaming)
+		err = stream_analyze_finish(&bat);
+	else if (!bat.standalone || snr_is_valid(bat.snr_thd_db))
 		err = analyze_capture(&bat);
 #else
 	fprintf(bat.log, _("No libfftw3 library. Exit without analysis.\n"));
@@ -722,6 +904,11 @@ analyze:
 out:
 	fprintf(bat.log, _("\nReturn value is %d\n"), err);
 
+	signal_cleanup();
+#ifdef HAVE_LIBFFTW3F
+	analyze_cleanup();
+#endif
+
 	if (bat.logarg)
 		fclose(bat.log);
 	if (!bat.local)
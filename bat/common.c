@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <time.h>
 
 #include "aconfig.h"
 #include "gettext.h"
@@ -26,9 +27,6 @@
 #include "alsa.h"
 #include "bat-signal.h"
 
-int retval_play;
-int retval_record;
-
 /* update chunk_fmt data to bat */
 static int update_fmt_to_bat(struct bat *bat, struct chunk_fmt *fmt)
 {
@@ -223,8 +221,7 @@ int update_wav_header(struct bat *bat, FILE *fp, int bytes)
  */
 int generate_input_data(struct bat *bat, void *buffer, int bytes, int frames)
 {
-	int err;
-	static int load;
+	int err, load;
 
 	if (bat->playback.file != NULL) {
 		/* From input file */
@@ -250,16 +247,35 @@ int generate_input_data(struct bat *bat, void *buffer, int bytes, int frames)
 			}
 		}
 	} else {
-		/* Generate sine wave */
-		if ((bat->sinus_duration) && (load > bat->sinus_duration))
+		/* Generate test signal */
+		if ((bat->sinus_duration)
+				&& (bat->frames_generated > bat->sinus_duration))
 			return 1;
 
-		err = generate_sine_wave(bat, frames, buffer);
+		err = generate_signal(bat, frames, buffer);
 		if (err != 0)
 			return err;
 
-		load += frames;
+		bat->frames_generated += frames;
 	}
 
 	return 0;
 }
+
+/* monotonic time in seconds, to line up xruns with the capture */
+double bat_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void log_xrun(struct xrun_log *log, long long frame)
+{
+	if (log->count < MAX_XRUNS) {
+		log->ev[log->count].frame = frame;
+		log->ev[log->count].time = bat_clock();
+	}
+	log->count++;
+}
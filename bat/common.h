@@ -25,6 +25,16 @@
 #define OPT_ROUNDTRIPLATENCY		(OPT_BASE + 6)
 #define OPT_SNRTHD_DB			(OPT_BASE + 7)
 #define OPT_SNRTHD_PC			(OPT_BASE + 8)
+#define OPT_WISDOM			(OPT_BASE + 9)
+#define OPT_STREAM			(OPT_BASE + 10)
+#define OPT_LATENCY_XCORR		(OPT_BASE + 11)
+#define OPT_MULTI			(OPT_BASE + 12)
+#define OPT_REPORT			(OPT_BASE + 13)
+#define OPT_SIGNAL			(OPT_BASE + 14)
+#define OPT_THDN			(OPT_BASE + 15)
+#define OPT_CROSSTALK			(OPT_BASE + 16)
+#define OPT_FLATNESS			(OPT_BASE + 17)
+#define OPT_GLITCH			(OPT_BASE + 18)
 
 #define COMPOSE(a, b, c, d)		((a) | ((b)<<8) | ((c)<<16) | ((d)<<24))
 #define WAV_RIFF			COMPOSE('R', 'I', 'F', 'F')
@@ -37,6 +47,9 @@
 #define MIN_CHANNELS			1
 #define MAX_PEAKS			10
 #define MAX_FRAMES			(10 * 1024 * 1024)
+/* streamed captures are not kept, only the playback length (150% of the
+ * frames plus the capture delay) has to fit in a long long */
+#define MAX_STREAM_FRAMES		(LLONG_MAX / 2)
 /* Given in ms */
 #define CAPTURE_DELAY			500
 /* signal frequency should be less than samplerate * RATE_FACTOR */
@@ -56,6 +69,9 @@
 /* default period size for tinyalsa */
 #define TINYALSA_PERIODSIZE			1024
 
+/* xruns kept with their position for the glitch report */
+#define MAX_XRUNS			64
+
 #define LATENCY_TEST_NUMBER			5
 #define LATENCY_TEST_TIME_LIMIT			25
 #define DIV_BUFFERSIZE			2
@@ -64,6 +80,10 @@
 #define ENOPEAK				(EBATBASE + 1)
 #define EONLYDC				(EBATBASE + 2)
 #define EBADPEAK			(EBATBASE + 3)
+#define EDISTORTION			(EBATBASE + 4)
+#define ECROSSTALK			(EBATBASE + 5)
+#define ERESPONSE			(EBATBASE + 6)
+#define EGLITCH				(EBATBASE + 7)
 
 #define DC_THRESHOLD			7.01
 
@@ -82,6 +102,17 @@
 #define SHIFT_MAX			(sizeof(int) * 8 - 2)
 #define SHIFT_MIN			8
 
+/* Multitone and sweep signals cover third octave bands from about 50 Hz
+ * (1000 Hz * 2^(RESPONSE_BAND_MIN / 3)) up to samplerate * RATE_FACTOR. */
+#define MAX_TONES			32
+#define RESPONSE_BAND_MIN		-13
+#define SWEEP_LOW			20.0
+
+/* frames of the longest tone period table, one second at 192 kHz */
+#define MAX_TONE_TABLE			192000
+/* frames generated at a time through the format conversion */
+#define GEN_CHUNK_FRAMES		256
+
 /* Define SNR range in dB.
  * if the noise is equal to signal, SNR = 0.0dB;
  * if the noise is zero, SNR is limited by RIFF wav data width:
@@ -147,6 +178,12 @@ enum _bat_pcm_format {
 	BAT_PCM_FORMAT_MAX
 };
 
+enum _bat_signal {
+	SIGNAL_SINE = 0,
+	SIGNAL_MULTITONE,
+	SIGNAL_SWEEP,
+};
+
 enum _bat_op_mode {
 	MODE_UNKNOWN = -1,
 	MODE_SINGLE = 0,
@@ -181,8 +218,11 @@ struct sin_generator {
 	float frequency;
 	float sample_rate;
 	float magnitude;
+	int pos;			/* next frame of the period table */
 };
 
+struct latency_xcorr;
+
 struct roundtrip_latency {
 	int number;
 	enum latency_state state;
@@ -195,20 +235,41 @@ struct roundtrip_latency {
 	bool is_capturing;
 	bool is_playing;
 	bool xrun_error;
+	struct latency_xcorr *xcorr;	/* cross-correlation state */
+	double play_time;		/* time the next playback write is played
+					 * at, from the PCM status, 0 if unknown */
+	double capture_time;		/* time the next frame to read came in */
+};
+
+struct stream_analyzer;
+struct glitch_detector;
+
+struct xrun_log {
+	int count;			/* number of xruns, may exceed MAX_XRUNS */
+	struct {
+		long long frame;	/* position in the stream */
+		double time;		/* from bat_clock() */
+	} ev[MAX_XRUNS];
 };
 
 struct noise_analyzer {
 	int nsamples;			/* number of sample */
-	float *source;			/* single-tone to be analyzed */
-	float *target;			/* target single-tone as standard */
-	float rms_tgt;			/* rms of target single-tone */
-	float snr_db;			/* snr in dB */
+	const float *target;		/* target single-tone as standard */
+	double energy_tgt;		/* sum of squares of target single-tone */
+};
+
+/* measured values for reports */
+struct channel_result {
+	float peak_hz;			/* strongest detected peak, 0 if none */
+	float snr_db;			/* average snr, SNR_DB_INVALID if none */
+	float thdn_db;			/* THD+N, 0 if not measured */
+	float level[MAX_CHANNELS];	/* power at each channel's target */
 };
 
 struct bat {
 	unsigned int rate;		/* sampling rate */
 	int channels;			/* nb of channels */
-	int frames;			/* nb of frames */
+	long long frames;		/* nb of frames */
 	int frame_size;			/* size of frame */
 	int sample_size;		/* size of sample */
 	enum _bat_pcm_format format;	/* PCM format */
@@ -218,13 +279,28 @@ struct bat {
 	float sigma_k;			/* threshold for peak detection */
 	float snr_thd_db;		/* threshold for noise detection (dB) */
 	float target_freq[MAX_CHANNELS];
-
-	int sinus_duration;		/* number of frames for playback */
+	enum _bat_signal signal;	/* test signal type */
+	int signal_pos;			/* position in the signal period */
+	bool check_thdn;
+	float thdn_thd_db;		/* threshold for THD+N (dB) */
+	bool check_crosstalk;
+	float crosstalk_thd_db;		/* threshold for crosstalk (dB) */
+	bool check_flatness;
+	float flatness_thd_db;		/* threshold for response deviation */
+	bool check_glitch;
+	float glitch_thd_db;		/* threshold for discontinuities (dB) */
+
+	long long sinus_duration;	/* number of frames for playback */
 	char *narg;			/* argument string of duration */
 	char *logarg;			/* path name of log file */
 	char *debugplay;		/* path name to store playback signal */
+	char *wisdom;			/* path name of FFTW wisdom file */
+	char *multi;			/* path name of device pair list */
+	char *report;			/* path name of JSON report */
 	bool standalone;		/* enable to bypass analysis */
 	bool roundtriplatency;		/* enable round trip latency */
+	bool roundtripxcorr;		/* measure it by cross-correlation */
+	bool streaming;			/* analyze while capturing */
 
 	struct pcm playback;
 	struct pcm capture;
@@ -243,12 +319,21 @@ struct bat {
 	void (*convert_float_to_sample)(float *, void *, int, int);
 
 	void *buf;			/* PCM Buffer */
+	struct sin_generator sg[MAX_CHANNELS];	/* playback generators */
+	long long frames_generated;	/* frames of signal played */
+	int retval_play;		/* playback thread exit code */
+	int retval_record;		/* capture thread exit code */
+	struct channel_result result[MAX_CHANNELS];
+	struct stream_analyzer *stream;	/* streaming analysis state */
+	struct glitch_detector *glitch;	/* glitch detection state */
+	double capture_start;		/* bat_clock() at capture start */
+	struct xrun_log xrun_play;	/* playback underruns */
+	struct xrun_log xrun_capture;	/* capture overruns */
 
 	bool local;			/* true for internal test */
 };
 
 struct analyze {
-	void *buf;
 	float *in;
 	float *out;
 	float *mag;
@@ -259,3 +344,5 @@ int read_wav_header(struct bat *, char *, FILE *, bool);
 int write_wav_header(FILE *, struct wav_container *, struct bat *);
 int update_wav_header(struct bat *, FILE *, int);
 int generate_input_data(struct bat *, void *, int, int);
+double bat_clock(void);
+void log_xrun(struct xrun_log *, long long);
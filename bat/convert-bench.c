@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Micro-benchmark of the sample format conversions, built on request
+ * with "make convert-bench":
+ *
+ *	convert-bench [samples [loops]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "convert.h"
+
+#define DEFAULT_SAMPLES		(2 * 48000 * 10)
+#define DEFAULT_LOOPS		20
+
+struct to_float {
+	const char *name;
+	void (*fct)(void *, float *, int);
+};
+
+struct from_float {
+	const char *name;
+	void (*fct)(float *, void *, int, int);
+	float low;
+	float high;
+};
+
+static const struct to_float to_float[] = {
+	{ "U8 to float", convert_uint8_to_float },
+	{ "S16_LE to float", convert_int16_to_float },
+	{ "S24_3LE to float", convert_int24_to_float },
+	{ "S32_LE to float", convert_int32_to_float },
+};
+
+static const struct from_float from_float[] = {
+	{ "float to U8", convert_float_to_uint8, 0.0, 255.0 },
+	{ "float to S16_LE", convert_float_to_int16, -32768.0, 32767.0 },
+	{ "float to S24_3LE", convert_float_to_int24, -8388608.0, 8388607.0 },
+	{ "float to S32_LE", convert_float_to_int32, -2147483520.0,
+			2147483520.0 },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, double t, int samples, int loops)
+{
+	double n = (double) samples * loops;
+
+	printf("%-18s %8.3f ns/sample %10.1f Msamples/s\n", name,
+			t * 1e9 / n, n / t * 1e-6);
+}
+
+int main(int argc, char *argv[])
+{
+	int samples = DEFAULT_SAMPLES, loops = DEFAULT_LOOPS;
+	uint8_t *raw;
+	float *val;
+	double t;
+	int i, k;
+
+	if (argc > 1)
+		samples = atoi(argv[1]);
+	if (argc > 2)
+		loops = atoi(argv[2]);
+	if (samples <= 0 || loops <= 0) {
+		fprintf(stderr, "usage: %s [samples [loops]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	raw = malloc((size_t) samples * 4);
+	val = malloc((size_t) samples * sizeof(float));
+	if (raw == NULL || val == NULL) {
+		fprintf(stderr, "Not enough memory.\n");
+		return EXIT_FAILURE;
+	}
+
+	srand(1);
+	for (i = 0; i < samples * 4; i++)
+		raw[i] = rand();
+
+	printf("%d samples, %d loops\n", samples, loops);
+	for (k = 0; k < sizeof(to_float) / sizeof(to_float[0]); k++) {
+		to_float[k].fct(raw, val, samples);
+		t = now();
+		for (i = 0; i < loops; i++)
+			to_float[k].fct(raw, val, samples);
+		report(to_float[k].name, now() - t, samples, loops);
+	}
+
+	for (k = 0; k < sizeof(from_float) / sizeof(from_float[0]); k++) {
+		for (i = 0; i < samples; i++)
+			val[i] = from_float[k].low + (float) rand() / RAND_MAX
+				* (from_float[k].high - from_float[k].low);
+		from_float[k].fct(val, raw, samples, 1);
+		t = now();
+		for (i = 0; i < loops; i++)
+			from_float[k].fct(val, raw, samples, 1);
+		report(from_float[k].name, now() - t, samples, loops);
+	}
+
+	free(val);
+	free(raw);
+	return EXIT_SUCCESS;
+}
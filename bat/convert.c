@@ -18,96 +18,273 @@
 #include <stdlib.h>
 #include <stdint.h>
 
-void convert_uint8_to_float(void *buf, float *val, int samples)
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CONVERT_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+/*
+ * The samples of all channels are interleaved, so each conversion is a
+ * single loop over samples * channels. The SSE2 kernels are part of the
+ * x86-64 baseline and selected at build time. The packed 24-bit kernels
+ * need byte shuffles, so they are built for SSSE3 and AVX2 and picked at
+ * startup from what the CPU supports. The scalar loops convert what is
+ * left over and are simple enough for the compiler to vectorize on other
+ * targets.
+ */
+
+#ifdef CONVERT_X86_DISPATCH
+/* the kernels return the number of samples they converted */
+static int (*int24_to_float_kernel)(const uint8_t *, float *, int);
+static int (*float_to_int24_kernel)(const float *, uint8_t *, int);
+
+__attribute__((target("ssse3")))
+static int int24_to_float_ssse3(const uint8_t *src, float *val, int samples)
 {
+	/* place the 3 bytes of each sample in the top of a dword */
+	const __m128i shuf = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5,
+			-1, 6, 7, 8, -1, 9, 10, 11);
+	__m128i s;
 	int i;
 
-	for (i = 0; i < samples; i++)
-		val[i] = ((uint8_t *) buf)[i];
+	/* 16 bytes are loaded for 4 samples, keep the load in the buffer */
+	for (i = 0; i + 6 <= samples; i += 4) {
+		s = _mm_loadu_si128((const __m128i *) (src + i * 3));
+		s = _mm_srai_epi32(_mm_shuffle_epi8(s, shuf), 8);
+		_mm_storeu_ps(val + i, _mm_cvtepi32_ps(s));
+	}
+	return i;
 }
 
-void convert_int16_to_float(void *buf, float *val, int samples)
+__attribute__((target("avx2")))
+static int int24_to_float_avx2(const uint8_t *src, float *val, int samples)
 {
+	/* the shuffle works within lanes: move the second 12 bytes up to
+	 * the high lane first */
+	const __m256i perm = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+	const __m256i shuf = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5,
+			-1, 6, 7, 8, -1, 9, 10, 11,
+			-1, 0, 1, 2, -1, 3, 4, 5,
+			-1, 6, 7, 8, -1, 9, 10, 11);
+	__m256i s;
 	int i;
 
-	for (i = 0; i < samples; i++)
-		val[i] = ((int16_t *) buf)[i];
+	/* 32 bytes are loaded for 8 samples, keep the load in the buffer */
+	for (i = 0; i + 11 <= samples; i += 8) {
+		s = _mm256_loadu_si256((const __m256i *) (src + i * 3));
+		s = _mm256_permutevar8x32_epi32(s, perm);
+		s = _mm256_srai_epi32(_mm256_shuffle_epi8(s, shuf), 8);
+		_mm256_storeu_ps(val + i, _mm256_cvtepi32_ps(s));
+	}
+	return i;
 }
 
-void convert_int24_to_float(void *buf, float *val, int samples)
+__attribute__((target("ssse3")))
+static int float_to_int24_ssse3(const float *val, uint8_t *dst, int n)
 {
+	/* drop the top byte of each dword */
+	const __m128i shuf = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9,
+			10, 12, 13, 14, -1, -1, -1, -1);
+	__m128i s;
 	int i;
+
+	/* 16 bytes are stored for 4 samples, the last 4 are overwritten by
+	 * the next ones; keep the store in the buffer */
+	for (i = 0; i + 6 <= n; i += 4) {
+		s = _mm_cvttps_epi32(_mm_loadu_ps(val + i));
+		_mm_storeu_si128((__m128i *) (dst + i * 3),
+				_mm_shuffle_epi8(s, shuf));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static int float_to_int24_avx2(const float *val, uint8_t *dst, int n)
+{
+	const __m256i shuf = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9,
+			10, 12, 13, 14, -1, -1, -1, -1,
+			0, 1, 2, 4, 5, 6, 8, 9,
+			10, 12, 13, 14, -1, -1, -1, -1);
+	/* join the 12 bytes of both lanes */
+	const __m256i perm = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+	__m256i s;
+	int i;
+
+	/* 32 bytes are stored for 8 samples, the last 8 are overwritten by
+	 * the next ones; keep the store in the buffer */
+	for (i = 0; i + 11 <= n; i += 8) {
+		s = _mm256_cvttps_epi32(_mm256_loadu_ps(val + i));
+		s = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(s, shuf),
+				perm);
+		_mm256_storeu_si256((__m256i *) (dst + i * 3), s);
+	}
+	return i;
+}
+
+__attribute__((constructor))
+static void convert_select_kernels(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		int24_to_float_kernel = int24_to_float_avx2;
+		float_to_int24_kernel = float_to_int24_avx2;
+	} else if (__builtin_cpu_supports("ssse3")) {
+		int24_to_float_kernel = int24_to_float_ssse3;
+		float_to_int24_kernel = float_to_int24_ssse3;
+	}
+}
+#endif
+
+void convert_uint8_to_float(void *buf, float *val, int samples)
+{
+	const uint8_t *src = buf;
+	int i = 0;
+
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	__m128i b, lo, hi;
+
+	for (; i + 16 <= samples; i += 16) {
+		b = _mm_loadu_si128((const __m128i *) (src + i));
+		lo = _mm_unpacklo_epi8(b, zero);
+		hi = _mm_unpackhi_epi8(b, zero);
+		_mm_storeu_ps(val + i, _mm_cvtepi32_ps(
+				_mm_unpacklo_epi16(lo, zero)));
+		_mm_storeu_ps(val + i + 4, _mm_cvtepi32_ps(
+				_mm_unpackhi_epi16(lo, zero)));
+		_mm_storeu_ps(val + i + 8, _mm_cvtepi32_ps(
+				_mm_unpacklo_epi16(hi, zero)));
+		_mm_storeu_ps(val + i + 12, _mm_cvtepi32_ps(
+				_mm_unpackhi_epi16(hi, zero)));
+	}
+#endif
+	for (; i < samples; i++)
+		val[i] = src[i];
+}
+
+void convert_int16_to_float(void *buf, float *val, int samples)
+{
+	const int16_t *src = buf;
+	int i = 0;
+
+#ifdef __SSE2__
+	__m128i s;
+
+	for (; i + 8 <= samples; i += 8) {
+		s = _mm_loadu_si128((const __m128i *) (src + i));
+		/* sign extend by shifting the words into the high halves */
+		_mm_storeu_ps(val + i, _mm_cvtepi32_ps(_mm_srai_epi32(
+				_mm_unpacklo_epi16(s, s), 16)));
+		_mm_storeu_ps(val + i + 4, _mm_cvtepi32_ps(_mm_srai_epi32(
+				_mm_unpackhi_epi16(s, s), 16)));
+	}
+#endif
+	for (; i < samples; i++)
+		val[i] = src[i];
+}
+
+void convert_int24_to_float(void *buf, float *val, int samples)
+{
+	const uint8_t *src = buf;
+	int i = 0;
 	int32_t tmp;
 
-	for (i = 0; i < samples; i++) {
-		tmp = ((uint8_t *) buf)[i * 3 + 2] << 24;
-		tmp |= ((uint8_t *) buf)[i * 3 + 1] << 16;
-		tmp |= ((uint8_t *) buf)[i * 3] << 8;
-		tmp >>= 8;
-		val[i] = tmp;
+#ifdef CONVERT_X86_DISPATCH
+	if (int24_to_float_kernel)
+		i = int24_to_float_kernel(src, val, samples);
+#endif
+	for (; i < samples; i++) {
+		tmp = (uint32_t) src[i * 3 + 2] << 24;
+		tmp |= src[i * 3 + 1] << 16;
+		tmp |= src[i * 3] << 8;
+		val[i] = tmp >> 8;
 	}
 }
 
 void convert_int32_to_float(void *buf, float *val, int samples)
 {
-	int i;
+	const int32_t *src = buf;
+	int i = 0;
 
-	for (i = 0; i < samples; i++)
-		val[i] = ((int32_t *) buf)[i];
+#ifdef __SSE2__
+	for (; i + 4 <= samples; i += 4)
+		_mm_storeu_ps(val + i, _mm_cvtepi32_ps(
+				_mm_loadu_si128((const __m128i *) (src + i))));
+#endif
+	for (; i < samples; i++)
+		val[i] = src[i];
 }
 
 void convert_float_to_uint8(float *val, void *buf, int samples, int channels)
 {
-	int i, c, idx;
+	uint8_t *dst = buf;
+	int i = 0, n = samples * channels;
 
-	for (i = 0; i < samples; i++) {
-		for (c = 0; c < channels; c++) {
-			idx = i * channels + c;
-			((uint8_t *) buf)[idx] = (uint8_t) val[idx];
-		}
+#ifdef __SSE2__
+	__m128i a, b, c, d;
+
+	for (; i + 16 <= n; i += 16) {
+		a = _mm_cvttps_epi32(_mm_loadu_ps(val + i));
+		b = _mm_cvttps_epi32(_mm_loadu_ps(val + i + 4));
+		c = _mm_cvttps_epi32(_mm_loadu_ps(val + i + 8));
+		d = _mm_cvttps_epi32(_mm_loadu_ps(val + i + 12));
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(
+				_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
 	}
+#endif
+	for (; i < n; i++)
+		dst[i] = (uint8_t) val[i];
 }
 
 void convert_float_to_int16(float *val, void *buf, int samples, int channels)
 {
-	int i, c, idx;
+	int16_t *dst = buf;
+	int i = 0, n = samples * channels;
+
+#ifdef __SSE2__
+	__m128i a, b;
 
-	for (i = 0; i < samples; i++) {
-		for (c = 0; c < channels; c++) {
-			idx = i * channels + c;
-			((int16_t *) buf)[idx] = (int16_t) val[idx];
-		}
+	for (; i + 8 <= n; i += 8) {
+		a = _mm_cvttps_epi32(_mm_loadu_ps(val + i));
+		b = _mm_cvttps_epi32(_mm_loadu_ps(val + i + 4));
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_packs_epi32(a, b));
 	}
+#endif
+	for (; i < n; i++)
+		dst[i] = (int16_t) val[i];
 }
 
 void convert_float_to_int24(float *val, void *buf, int samples, int channels)
 {
-	int i, c, idx_f, idx_i;
-	int32_t val_f_i;
-
-	for (i = 0; i < samples; i++) {
-		for (c = 0; c < channels; c++) {
-			idx_f = i * channels + c;
-			idx_i = 3 * idx_f;
-			val_f_i = (int32_t) val[idx_f];
-			((int8_t *) buf)[idx_i + 0] =
-				(int8_t) (val_f_i & 0xff);
-			((int8_t *) buf)[idx_i + 1] =
-				(int8_t) ((val_f_i >> 8) & 0xff);
-			((int8_t *) buf)[idx_i + 2] =
-				(int8_t) ((val_f_i >> 16) & 0xff);
-		}
+	uint8_t *dst = buf;
+	int i = 0, n = samples * channels;
+	int32_t tmp;
+
+#ifdef CONVERT_X86_DISPATCH
+	if (float_to_int24_kernel)
+		i = float_to_int24_kernel(val, dst, n);
+#endif
+	for (; i < n; i++) {
+		tmp = (int32_t) val[i];
+		dst[i * 3 + 0] = tmp & 0xff;
+		dst[i * 3 + 1] = (tmp >> 8) & 0xff;
+		dst[i * 3 + 2] = (tmp >> 16) & 0xff;
 	}
 }
 
 void convert_float_to_int32(float *val, void *buf, int samples, int channels)
 {
-	int i, c, idx;
+	int32_t *dst = buf;
+	int i = 0, n = samples * channels;
 
-	for (i = 0; i < samples; i++) {
-		for (c = 0; c < channels; c++) {
-			idx = i * channels + c;
-			((int32_t *) buf)[idx] = (int32_t) val[idx];
-		}
-	}
+#ifdef __SSE2__
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_si128((__m128i *) (dst + i),
+				_mm_cvttps_epi32(_mm_loadu_ps(val + i)));
+#endif
+	for (; i < n; i++)
+		dst[i] = (int32_t) val[i];
 }
@@ -0,0 +1,375 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "aconfig.h"
+#include "gettext.h"
+
+#include "common.h"
+#include "glitch.h"
+
+/*
+ * A sine of angular frequency w obeys x[n] = 2 cos(w) x[n-1] - x[n-2]
+ * whatever its amplitude and phase, so the prediction error of this
+ * recurrence stays at the noise floor as long as the tone is continuous.
+ * A dropped, repeated or zeroed block breaks the phase and shows up as an
+ * error spike at the exact frame where it happened.
+ */
+
+/* tone present for this long before detection starts */
+#define GLITCH_SETTLE_MS		100
+/* flagged frames closer than this are one event */
+#define GLITCH_MERGE_MS			10
+/* tone level for detection to start, relative to full scale */
+#define GLITCH_PRESENT_DB		-60.0
+/* silence level of a dropout, relative to the tone and to the noise */
+#define GLITCH_SILENCE_DB		-60.0
+#define GLITCH_SILENCE_SIGMA		4.0
+/* consecutive silent frames for a dropout, at least a quarter period */
+#define GLITCH_DROPOUT_FRAMES		8
+/* error threshold over the rms error */
+#define GLITCH_NOISE_FACTOR		8.0
+/* time constants of the tone power and error power estimates */
+#define GLITCH_POWER_MS			10
+#define GLITCH_NOISE_MS			100
+/* events reported per channel */
+#define MAX_GLITCHES			100
+/* read size of the capture file */
+#define GLITCH_CHUNK_FRAMES		4096
+
+struct glitch_event {
+	long long start;		/* first frame */
+	long long end;			/* last frame */
+	float level_db;			/* peak error relative to the tone */
+	bool dropout;
+};
+
+struct glitch_channel {
+	double coef;			/* 2 cos(w) */
+	double x1, x2;			/* previous samples */
+	double power;			/* tone mean square */
+	double noise;			/* error mean square */
+	long long settle;		/* frames with the tone present */
+	int dropout;			/* silent frames for a dropout */
+	int silent;			/* consecutive silent frames */
+	bool armed;
+	bool in_dropout;
+	bool open;
+	struct glitch_event cur;
+	int count;
+	struct glitch_event ev[MAX_GLITCHES];
+};
+
+struct glitch_detector {
+	long long frames;		/* frames fed so far */
+	float offset;			/* DC of unsigned formats */
+	double present;			/* mean square of a tone at the
+					 * GLITCH_PRESENT_DB level */
+	double thd;			/* error threshold, power ratio */
+	double silence;			/* dropout level, power ratio */
+	double a_power;
+	double a_noise;
+	long long settle;
+	int merge;
+	struct glitch_channel ch[MAX_CHANNELS];
+};
+
+int glitch_init(struct bat *bat)
+{
+	struct glitch_detector *g;
+	double fs;
+	int c;
+
+	g = calloc(1, sizeof(*g));
+	if (g == NULL)
+		return -ENOMEM;
+
+	fs = ldexp(1.0, 8 * bat->sample_size - 1);
+	if (bat->format == BAT_PCM_FORMAT_U8)
+		g->offset = fs;
+	g->present = fs * fs * pow(10.0, GLITCH_PRESENT_DB / 10.0) / 2.0;
+	g->thd = pow(10.0, bat->glitch_thd_db / 10.0);
+	g->silence = pow(10.0, GLITCH_SILENCE_DB / 10.0);
+	g->a_power = 1000.0 / (GLITCH_POWER_MS * bat->rate);
+	g->a_noise = 1000.0 / (GLITCH_NOISE_MS * bat->rate);
+	g->settle = (long long) bat->rate * GLITCH_SETTLE_MS / 1000;
+	g->merge = bat->rate * GLITCH_MERGE_MS / 1000;
+	for (c = 0; c < bat->channels; c++) {
+		g->ch[c].coef = 2.0 * cos(2.0 * M_PI * bat->target_freq[c]
+				/ bat->rate);
+		g->ch[c].dropout = bat->rate / (4 * bat->target_freq[c]);
+		if (g->ch[c].dropout < GLITCH_DROPOUT_FRAMES)
+			g->ch[c].dropout = GLITCH_DROPOUT_FRAMES;
+	}
+
+	bat->glitch = g;
+	return 0;
+}
+
+static void close_event(struct glitch_channel *ch)
+{
+	if (!ch->open)
+		return;
+	if (ch->count < MAX_GLITCHES)
+		ch->ev[ch->count] = ch->cur;
+	ch->count++;
+	ch->open = false;
+}
+
+static void open_event(struct glitch_detector *g, struct glitch_channel *ch,
+		long long frame, float level_db, bool dropout)
+{
+	/* close to the previous event: the same glitch */
+	if (ch->open && frame - ch->cur.end <= g->merge) {
+		ch->cur.end = frame;
+		if (level_db > ch->cur.level_db)
+			ch->cur.level_db = level_db;
+		ch->cur.dropout |= dropout;
+		return;
+	}
+
+	close_event(ch);
+	ch->cur.start = ch->cur.end = frame;
+	ch->cur.level_db = level_db;
+	ch->cur.dropout = dropout;
+	ch->open = true;
+}
+
+static void track(struct glitch_detector *g, struct glitch_channel *ch,
+		double x, long long frame)
+{
+	double e, e2, thr, silence;
+
+	e = x - ch->coef * ch->x1 + ch->x2;
+	e2 = e * e;
+	ch->x2 = ch->x1;
+	ch->x1 = x;
+
+	if (!ch->armed) {
+		ch->power += (x * x - ch->power) * g->a_power;
+		ch->noise += (e2 - ch->noise) * g->a_noise;
+		ch->settle = ch->power > g->present ? ch->settle + 1 : 0;
+		if (ch->settle >= g->settle)
+			ch->armed = true;
+		return;
+	}
+
+	/* dropouts, reported from their first silent frame; the error of
+	 * white noise through the recurrence is about 6 times its power */
+	silence = 2.0 * ch->power * g->silence;
+	if (silence < GLITCH_SILENCE_SIGMA * GLITCH_SILENCE_SIGMA
+			* ch->noise / 6.0)
+		silence = GLITCH_SILENCE_SIGMA * GLITCH_SILENCE_SIGMA
+			* ch->noise / 6.0;
+	if (x * x < silence) {
+		if (++ch->silent == ch->dropout) {
+			ch->in_dropout = true;
+			open_event(g, ch, frame - ch->dropout + 1, 0.0, true);
+		}
+		if (ch->in_dropout) {
+			ch->cur.end = frame;
+			return;
+		}
+	} else {
+		ch->silent = 0;
+		ch->in_dropout = false;
+	}
+
+	thr = g->thd * 2.0 * ch->power;
+	if (thr < GLITCH_NOISE_FACTOR * GLITCH_NOISE_FACTOR * ch->noise)
+		thr = GLITCH_NOISE_FACTOR * GLITCH_NOISE_FACTOR * ch->noise;
+	if (e2 > thr) {
+		open_event(g, ch, frame,
+				10.0 * log10(e2 / (2.0 * ch->power)), false);
+		return;
+	}
+
+	ch->power += (x * x - ch->power) * g->a_power;
+	ch->noise += (e2 - ch->noise) * g->a_noise;
+}
+
+void glitch_feed(struct bat *bat, const float *buf, int frames)
+{
+	struct glitch_detector *g = bat->glitch;
+	int i, c;
+
+	for (c = 0; c < bat->channels; c++)
+		for (i = 0; i < frames; i++)
+			track(g, &g->ch[c], buf[i * bat->channels + c]
+					- g->offset, g->frames + i);
+	g->frames += frames;
+}
+
+/* nearest xrun in the log within MAX_BUFFERTIME of the event, by frame
+ * position for capture overruns and by time for playback underruns */
+static int nearest_xrun(struct bat *bat, const struct xrun_log *log,
+		bool capture, long long frame, double *delta)
+{
+	double t, d, best = MAX_BUFFERTIME / 1000000.0;
+	int i, n = log->count < MAX_XRUNS ? log->count : MAX_XRUNS, k = -1;
+
+	for (i = 0; i < n; i++) {
+		if (capture) {
+			d = (double) (frame - log->ev[i].frame) / bat->rate;
+		} else {
+			t = bat->capture_start + (double) frame / bat->rate;
+			d = t - log->ev[i].time;
+		}
+		if (fabs(d) <= fabs(best)) {
+			best = d;
+			k = i;
+		}
+	}
+
+	*delta = best;
+	return k;
+}
+
+static void print_event(struct bat *bat, const struct glitch_event *ev)
+{
+	double d;
+	int k;
+
+	fprintf(bat->log, _("  frame %lld (%.3f s): "), ev->start,
+			(double) ev->start / bat->rate);
+	if (ev->dropout)
+		fprintf(bat->log, _("dropout, %lld frames"),
+				ev->end - ev->start + 1);
+	else
+		fprintf(bat->log, _("discontinuity, %lld frames, %.2f dB"),
+				ev->end - ev->start + 1, ev->level_db);
+
+	k = nearest_xrun(bat, &bat->xrun_capture, true, ev->start, &d);
+	if (k >= 0)
+		fprintf(bat->log, _(", capture overrun at frame %lld (%+.1f ms)"),
+				bat->xrun_capture.ev[k].frame, d * 1000.0);
+	k = nearest_xrun(bat, &bat->xrun_play, false, ev->start, &d);
+	if (k >= 0)
+		fprintf(bat->log, _(", playback underrun at frame %lld (%+.1f ms)"),
+				bat->xrun_play.ev[k].frame, d * 1000.0);
+	fprintf(bat->log, _("\n"));
+}
+
+/**
+ * Report the glitches of each channel with the xruns seen near them, and
+ * free the detector.
+ */
+int glitch_finish(struct bat *bat)
+{
+	struct glitch_detector *g = bat->glitch;
+	struct glitch_channel *ch;
+	int c, i, err = 0;
+
+	fprintf(bat->log, _("\nChecking for glitches: "));
+	fprintf(bat->log, _("Threshold is %.2f dB, %lld frames\n"),
+			bat->glitch_thd_db, g->frames);
+	if (bat->xrun_play.count || bat->xrun_capture.count)
+		fprintf(bat->log, _("%d playback underruns, %d capture overruns\n"),
+				bat->xrun_play.count, bat->xrun_capture.count);
+
+	for (c = 0; c < bat->channels; c++) {
+		ch = &g->ch[c];
+		fprintf(bat->log, _("Channel %i - "), c + 1);
+		if (!ch->armed) {
+			fprintf(bat->err, _("No tone for glitch detection\n"));
+			if (err == 0)
+				err = -ENOPEAK;
+			continue;
+		}
+
+		/* silence up to the end is the end of the playback */
+		if (ch->in_dropout)
+			ch->open = false;
+		close_event(ch);
+
+		fprintf(bat->log, _("%d glitches\n"), ch->count);
+		for (i = 0; i < ch->count && i < MAX_GLITCHES; i++)
+			print_event(bat, &ch->ev[i]);
+		if (ch->count > MAX_GLITCHES)
+			fprintf(bat->log, _("  %d more not shown\n"),
+					ch->count - MAX_GLITCHES);
+
+		if (ch->count) {
+			fprintf(bat->err, _(" FAIL: glitches found\n"));
+			if (err == 0)
+				err = -EGLITCH;
+		} else {
+			fprintf(bat->log, _(" PASS\n"));
+		}
+	}
+
+	free(g);
+	bat->glitch = NULL;
+	return err;
+}
+
+/* drop the detector state without a report */
+void glitch_free(struct bat *bat)
+{
+	free(bat->glitch);
+	bat->glitch = NULL;
+}
+
+/* run the detector over the whole capture file, in chunks */
+int glitch_check_file(struct bat *bat)
+{
+	FILE *fp;
+	void *raw;
+	float *val;
+	size_t items;
+	int err;
+
+	fp = fopen(bat->capture.file, "rb");
+	err = -errno;
+	if (fp == NULL) {
+		fprintf(bat->err, _("Cannot open file: %s %d\n"),
+				bat->capture.file, err);
+		return err;
+	}
+
+	raw = malloc(GLITCH_CHUNK_FRAMES * bat->frame_size);
+	val = malloc(sizeof(float) * GLITCH_CHUNK_FRAMES * bat->channels);
+	if (raw == NULL || val == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	err = read_wav_header(bat, bat->capture.file, fp, true);
+	if (err != 0)
+		goto out;
+
+	err = glitch_init(bat);
+	if (err < 0)
+		goto out;
+
+	while ((items = fread(raw, bat->frame_size, GLITCH_CHUNK_FRAMES,
+					fp)) > 0) {
+		bat->convert_sample_to_float(raw, val, items * bat->channels);
+		glitch_feed(bat, val, items);
+	}
+
+	err = glitch_finish(bat);
+out:
+	free(val);
+	free(raw);
+	fclose(fp);
+	return err;
+}
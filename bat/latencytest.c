@@ -18,10 +18,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "aconfig.h"
+#include "gettext.h"
 
 #include "common.h"
 #include "bat-signal.h"
-#include "gettext.h"
+#ifdef HAVE_LIBFFTW3F
+#include "analyze.h"
+#endif
 
 /* How one measurement step works:
    - Listen and measure the average loudness of the environment for 1 second.
@@ -29,7 +36,42 @@
    - Begin playing a ~1000 Hz sine wave and start counting the samples elapsed.
    - Stop counting and playing if the input's loudness is higher than the
      threshold, as the output wave is probably coming back.
-   - Calculate the round trip audio latency value in milliseconds. */
+   - Calculate the round trip audio latency value in milliseconds.
+
+   With --latency-xcorr, a linear chirp is played once per test instead and
+   located in one second of captured signal by FFT cross-correlation, which
+   tolerates background noise and resolves a fraction of a frame. The
+   capture frame at which the chirp is played is found by lining up the
+   playback and capture positions with the timestamps the driver takes
+   with them, so it carries no thread scheduling jitter and does not
+   depend on the period size; the playback buffering is not part of the
+   result. Without PCM timestamps the time the chirp is written is used,
+   which bounds the resolution to the thread wakeup jitter. */
+
+#define XCORR_CHIRP_MS			100
+#define XCORR_FADE_MS			5
+#define XCORR_CHIRP_LOW			200.0
+#define XCORR_CHIRP_HIGH		8000.0
+/* correlation peak to rms ratio below which the chirp is not found */
+#define XCORR_MIN_SCORE			10.0
+
+struct latency_xcorr {
+	float *chirp;			/* reference sequence */
+	int chirp_frames;
+	int chirp_sent;			/* frames of the chirp played */
+	double chirp_pos;		/* capture frame the chirp is played at */
+	float *listen;			/* captured signal, mixed to mono */
+	int listen_frames;
+	int listen_fill;
+	long long listen_start;		/* capture frame of listen[0] */
+	float *in_buf;			/* conversion buffers */
+	int in_size;
+	float *out_buf;
+	int out_size;
+	long long in_frames;		/* frames captured so far */
+	double in_time;			/* time frame in_frames came in */
+	pthread_mutex_t lock;
+};
 
 static float sumaudio(struct bat *bat, short int *buffer, int frames)
 {
@@ -50,13 +92,76 @@ static float sumaudio(struct bat *bat, short int *buffer, int frames)
 	return sum;
 }
 
+/* check the result of the current test and move on to the next one */
+static void store_result(struct bat *bat)
+{
+	int n, num = bat->latency.number;
+	float sum = 0, var = 0;
+	float max = 0;
+	float min = 100000.0f;
+
+	for (n = 0; n < num; n++) {
+		if (bat->latency.result[n] > max)
+			max = bat->latency.result[n];
+		if (bat->latency.result[n] < min)
+			min = bat->latency.result[n];
+		sum += bat->latency.result[n];
+	}
+
+	/* The maximum is higher than the minimum's double */
+	if (max / min > 2.0f) {
+		bat->latency.state = LATENCY_STATE_COMPLETE_FAILURE;
+		bat->latency.is_capturing = false;
+		return;
+
+	/* Final results */
+	} else if (num == LATENCY_TEST_NUMBER) {
+		bat->latency.final_result = (int) (sum / LATENCY_TEST_NUMBER);
+		fprintf(bat->log, _("Final round trip latency: %dms\n"),
+				bat->latency.final_result);
+
+		if (bat->latency.xcorr) {
+			sum /= LATENCY_TEST_NUMBER;
+			for (n = 0; n < num; n++)
+				var += (bat->latency.result[n] - sum)
+					* (bat->latency.result[n] - sum);
+			fprintf(bat->log, _("Average %.3fms, min %.3fms,"),
+					sum, min);
+			fprintf(bat->log, _(" max %.3fms, jitter %.3fms\n"),
+					max, sqrtf(var / num));
+		}
+
+		bat->latency.state = LATENCY_STATE_COMPLETE_SUCCESS;
+		bat->latency.is_capturing = false;
+		return;
+	}
+
+	/* Next step */
+	bat->latency.state = LATENCY_STATE_WAITING;
+	bat->latency.number++;
+}
+
+/* nothing came back within a second */
+static void no_signal(struct bat *bat)
+{
+	bat->latency.error++;
+
+	if (bat->latency.error > LATENCY_TEST_NUMBER) {
+		fprintf(bat->err, _("Could not detect signal."));
+		fprintf(bat->err, _("Too much background noise?\n"));
+		bat->latency.state = LATENCY_STATE_COMPLETE_FAILURE;
+		bat->latency.is_capturing = false;
+		return;
+	}
+
+	/* let's start over */
+	bat->latency.state = LATENCY_STATE_WAITING;
+}
+
 static void play_and_listen(struct bat *bat, void *buffer, int frames)
 {
 	int averageinput;
 	int n = 0;
-	float sum = 0;
-	float max = 0;
-	float min = 100000.0f;
 	short int *input;
 	int num = bat->latency.number;
 
@@ -87,40 +192,7 @@ static void play_and_listen(struct bat *bat, void *buffer, int frames)
 					num,
 					(int) bat->latency.result[num - 1]);
 
-			for (n = 0; n < num; n++) {
-				if (bat->latency.result[n] > max)
-					max = bat->latency.result[n];
-				if (bat->latency.result[n] < min)
-					min = bat->latency.result[n];
-				sum += bat->latency.result[n];
-			}
-
-			/* The maximum is higher than the minimum's double */
-			if (max / min > 2.0f) {
-				bat->latency.state =
-					LATENCY_STATE_COMPLETE_FAILURE;
-				bat->latency.is_capturing = false;
-				return;
-
-			/* Final results */
-			} else if (num == LATENCY_TEST_NUMBER) {
-				bat->latency.final_result =
-					(int) (sum / LATENCY_TEST_NUMBER);
-				fprintf(bat->log,
-					_("Final round trip latency: %dms\n"),
-					bat->latency.final_result);
-
-				bat->latency.state =
-					LATENCY_STATE_COMPLETE_SUCCESS;
-				bat->latency.is_capturing = false;
-				return;
-
-			/* Next step */
-			} else
-				bat->latency.state = LATENCY_STATE_WAITING;
-
-			bat->latency.number++;
-
+			store_result(bat);
 		} else
 			/* Happens when an early noise comes in */
 			bat->latency.state = LATENCY_STATE_WAITING;
@@ -131,23 +203,8 @@ static void play_and_listen(struct bat *bat, void *buffer, int frames)
 
 		/* Do not listen to more than a second
 		   Maybe too much background noise */
-		if (bat->latency.samples > bat->rate) {
-			bat->latency.error++;
-
-			if (bat->latency.error > LATENCY_TEST_NUMBER) {
-				fprintf(bat->err,
-					_("Could not detect signal."));
-				fprintf(bat->err,
-					_("Too much background noise?\n"));
-				bat->latency.state =
-					LATENCY_STATE_COMPLETE_FAILURE;
-				bat->latency.is_capturing = false;
-				return;
-			}
-
-			/* let's start over */
-			bat->latency.state = LATENCY_STATE_WAITING;
-		}
+		if (bat->latency.samples > bat->rate)
+			no_signal(bat);
 	}
 
 	return;
@@ -166,6 +223,218 @@ static void calculate_threshold(struct bat *bat)
 						* 32767.0f);
 }
 
+#ifdef HAVE_LIBFFTW3F
+static void xcorr_free(struct bat *bat)
+{
+	struct latency_xcorr *x = bat->latency.xcorr;
+
+	if (x == NULL)
+		return;
+	pthread_mutex_destroy(&x->lock);
+	free(x->chirp);
+	free(x->listen);
+	free(x->in_buf);
+	free(x->out_buf);
+	free(x);
+	bat->latency.xcorr = NULL;
+}
+
+static int xcorr_init(struct bat *bat)
+{
+	struct latency_xcorr *x;
+	float high = XCORR_CHIRP_HIGH;
+	int err;
+
+	x = calloc(1, sizeof(*x));
+	if (x == NULL)
+		return -ENOMEM;
+	bat->latency.xcorr = x;
+	pthread_mutex_init(&x->lock, NULL);
+
+	if (high > bat->rate * RATE_FACTOR)
+		high = bat->rate * RATE_FACTOR;
+	x->chirp_frames = bat->rate * XCORR_CHIRP_MS / 1000;
+	x->chirp_sent = x->chirp_frames;
+	x->chirp = malloc(sizeof(float) * x->chirp_frames);
+	x->listen_frames = bat->rate;
+	x->listen = malloc(sizeof(float) * x->listen_frames);
+	if (x->chirp == NULL || x->listen == NULL)
+		return -ENOMEM;
+
+	err = generate_chirp_raw_mono(bat, x->chirp, XCORR_CHIRP_LOW, high,
+			x->chirp_frames, bat->rate * XCORR_FADE_MS / 1000);
+	if (err < 0)
+		return err;
+
+	return 0;
+}
+
+static float *xcorr_buffer(float **buf, int *size, int samples)
+{
+	float *p;
+
+	if (samples > *size) {
+		p = realloc(*buf, sizeof(float) * samples);
+		if (p == NULL)
+			return NULL;
+		*buf = p;
+		*size = samples;
+	}
+	return *buf;
+}
+
+/* play the chirp once after the input armed it, silence otherwise */
+static int xcorr_output(struct bat *bat, void *buffer, int frames)
+{
+	struct latency_xcorr *x = bat->latency.xcorr;
+	double now;
+	float *out, v;
+	int i, c, start, n = 0;
+
+	out = xcorr_buffer(&x->out_buf, &x->out_size, frames * bat->channels);
+	if (out == NULL)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&x->lock);
+	start = x->chirp_sent;
+	if (start == 0) {
+		/* map the playing time onto the capture frame count */
+		now = bat->latency.play_time > 0.0 ?
+			bat->latency.play_time : bat_clock();
+		x->chirp_pos = x->in_frames + (now - x->in_time) * bat->rate;
+	}
+	if (start < x->chirp_frames) {
+		n = x->chirp_frames - start;
+		if (n > frames)
+			n = frames;
+		x->chirp_sent += n;
+	}
+	pthread_mutex_unlock(&x->lock);
+
+	for (i = 0; i < frames; i++) {
+		v = i < n ? x->chirp[start + i] : 0.0;
+		for (c = 0; c < bat->channels; c++)
+			*out++ = v;
+	}
+	bat->convert_float_to_sample(x->out_buf, buffer, frames,
+			bat->channels);
+
+	return 0;
+}
+
+/* locate the chirp in the captured second and store the latency */
+static void xcorr_result(struct bat *bat)
+{
+	struct latency_xcorr *x = bat->latency.xcorr;
+	int num = bat->latency.number;
+	float pos, score, latency;
+	double sent;
+	int err;
+
+	pthread_mutex_lock(&x->lock);
+	sent = x->chirp_pos;
+	pthread_mutex_unlock(&x->lock);
+
+	/* the playback did not get to send the chirp */
+	if (sent < 0) {
+		no_signal(bat);
+		return;
+	}
+
+	err = xcorr_locate(bat, x->chirp, x->chirp_frames, x->listen,
+			x->listen_frames, &pos, &score);
+	if (err < 0) {
+		fprintf(bat->err, _("Cross-correlation failed: %d\n"), err);
+		bat->latency.state = LATENCY_STATE_COMPLETE_FAILURE;
+		bat->latency.is_capturing = false;
+		return;
+	}
+
+	latency = x->listen_start + pos - sent;
+	if (score < XCORR_MIN_SCORE || latency <= 0) {
+		no_signal(bat);
+		return;
+	}
+
+	bat->latency.result[num - 1] = latency * 1000 / bat->rate;
+	fprintf(bat->log, _("Test%d, round trip latency %.3fms"), num,
+			bat->latency.result[num - 1]);
+	fprintf(bat->log, _(" (%.2f frames, score %.1f)\n"), latency, score);
+
+	store_result(bat);
+}
+
+static int xcorr_input(struct bat *bat, void *buffer, int frames)
+{
+	struct latency_xcorr *x = bat->latency.xcorr;
+	float *in, v;
+	int i, c, n;
+
+	pthread_mutex_lock(&x->lock);
+	x->in_frames += frames;
+	x->in_time = bat->latency.capture_time > 0.0 ?
+		bat->latency.capture_time : bat_clock();
+	pthread_mutex_unlock(&x->lock);
+
+	switch (bat->latency.state) {
+	/* No noise floor to measure, let the streams settle for 1 second */
+	case LATENCY_STATE_MEASURE_FOR_1_SECOND:
+		bat->latency.samples += frames;
+
+		if (bat->latency.samples >= bat->rate) {
+			bat->latency.samples = 0;
+			x->listen_fill = 0;
+			x->listen_start = x->in_frames;
+			/* arm the chirp */
+			pthread_mutex_lock(&x->lock);
+			x->chirp_sent = 0;
+			x->chirp_pos = -1;
+			pthread_mutex_unlock(&x->lock);
+			bat->latency.state = LATENCY_STATE_PLAY_AND_LISTEN;
+		}
+		break;
+
+	/* Recording one second after the chirp was armed */
+	case LATENCY_STATE_PLAY_AND_LISTEN:
+		in = xcorr_buffer(&x->in_buf, &x->in_size,
+				frames * bat->channels);
+		if (in == NULL)
+			return -ENOMEM;
+		bat->convert_sample_to_float(buffer, in,
+				frames * bat->channels);
+
+		n = x->listen_frames - x->listen_fill;
+		if (n > frames)
+			n = frames;
+		for (i = 0; i < n; i++) {
+			for (c = 0, v = 0.0; c < bat->channels; c++)
+				v += *in++;
+			x->listen[x->listen_fill++] = v / bat->channels;
+		}
+
+		if (x->listen_fill == x->listen_frames)
+			xcorr_result(bat);
+		break;
+
+	/* Waiting 1 second */
+	case LATENCY_STATE_WAITING:
+		bat->latency.samples += frames;
+
+		if (bat->latency.samples > bat->rate) {
+			/* 1 second elapsed, start over */
+			bat->latency.samples = 0;
+			bat->latency.state = LATENCY_STATE_MEASURE_FOR_1_SECOND;
+		}
+		break;
+
+	default:
+		return 0;
+	}
+
+	return 0;
+}
+#endif
+
 void roundtrip_latency_init(struct bat *bat)
 {
 	bat->latency.number = 1;
@@ -178,12 +447,35 @@ void roundtrip_latency_init(struct bat *bat)
 	bat->latency.is_playing = false;
 	bat->latency.error = 0;
 	bat->latency.xrun_error = false;
+	bat->latency.play_time = 0.0;
+	bat->latency.capture_time = 0.0;
 	bat->frames = LATENCY_TEST_TIME_LIMIT * bat->rate;
 	bat->periods_played = 0;
+
+#ifdef HAVE_LIBFFTW3F
+	xcorr_free(bat);
+	if (bat->roundtripxcorr && xcorr_init(bat) < 0) {
+		fprintf(bat->err, _("Cannot set up cross-correlation\n"));
+		xcorr_free(bat);
+		bat->latency.state = LATENCY_STATE_COMPLETE_FAILURE;
+	}
+#endif
+}
+
+void roundtrip_latency_free(struct bat *bat)
+{
+#ifdef HAVE_LIBFFTW3F
+	xcorr_free(bat);
+#endif
 }
 
 int handleinput(struct bat *bat, void *buffer, int frames)
 {
+#ifdef HAVE_LIBFFTW3F
+	if (bat->latency.xcorr)
+		return xcorr_input(bat, buffer, frames);
+#endif
+
 	switch (bat->latency.state) {
 	/* Measuring average loudness for 1 second */
 	case LATENCY_STATE_MEASURE_FOR_1_SECOND:
@@ -231,6 +523,11 @@ int handleoutput(struct bat *bat, void *buffer, int bytes, int frames)
 			&& bat->latency.is_capturing == false)
 		return bat->latency.state;
 
+#ifdef HAVE_LIBFFTW3F
+	if (bat->latency.xcorr)
+		err = xcorr_output(bat, buffer, frames);
+	else
+#endif
 	if (bat->latency.state == LATENCY_STATE_PLAY_AND_LISTEN)
 		err = generate_sine_wave(bat, frames, buffer);
 	else
@@ -13,5 +13,6 @@
  *
  */
 void roundtrip_latency_init(struct bat *);
+void roundtrip_latency_free(struct bat *);
 int handleinput(struct bat *, void *, int);
 int handleoutput(struct bat *, void *, int, int);
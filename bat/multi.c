@@ -0,0 +1,407 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "aconfig.h"
+#include "gettext.h"
+#include "version.h"
+
+#include "common.h"
+#include "multi.h"
+#ifdef HAVE_LIBFFTW3F
+#include "analyze.h"
+#endif
+
+/* Multi-device mode: each playback/capture pair listed in the --multi file
+ * is tested in its own thread, with a private copy of the settings and an
+ * in-memory log. The analysis shares its FFT plans and reference tones
+ * between the pairs. Logs are printed in list order once all pairs are
+ * done, followed by a JSON report of all results. */
+
+#define MULTI_NAME_MAX			128
+
+struct pair_job {
+	struct bat bat;
+	char playback[MULTI_NAME_MAX];
+	char capture[MULTI_NAME_MAX];
+	const char *stage;		/* test step which failed */
+	int err;
+	bool started;
+	pthread_t thread;
+	char *log_buf;
+	size_t log_len;
+};
+
+static const char *format_names[BAT_PCM_FORMAT_MAX] = {
+	[BAT_PCM_FORMAT_S16_LE] = "S16_LE",
+	[BAT_PCM_FORMAT_S32_LE] = "S32_LE",
+	[BAT_PCM_FORMAT_U8] = "U8",
+	[BAT_PCM_FORMAT_S24_3LE] = "S24_3LE",
+};
+
+/* read "playback [capture]" lines, capture defaults to playback */
+static int read_pairs(struct bat *bat, struct pair_job **jobs, int *count)
+{
+	struct pair_job *p, *list = NULL;
+	char line[2 * MULTI_NAME_MAX + 16];
+	char pb[MULTI_NAME_MAX], cp[MULTI_NAME_MAX];
+	int n = 0, items, err = 0;
+	FILE *fp;
+
+	fp = fopen(bat->multi, "r");
+	if (fp == NULL) {
+		err = -errno;
+		fprintf(bat->err, _("Cannot open file: %s %d\n"),
+				bat->multi, err);
+		return err;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		items = sscanf(line, "%127s %127s", pb, cp);
+		if (items < 1 || pb[0] == '#')
+			continue;
+		p = realloc(list, sizeof(*list) * (n + 1));
+		if (p == NULL) {
+			err = -ENOMEM;
+			break;
+		}
+		list = p;
+		p = &list[n++];
+		memset(p, 0, sizeof(*p));
+		strcpy(p->playback, pb);
+		strcpy(p->capture, items == 2 ? cp : pb);
+	}
+	fclose(fp);
+
+	if (err == 0 && n == 0) {
+		fprintf(bat->err, _("No device pairs in %s\n"), bat->multi);
+		err = -EINVAL;
+	}
+	if (err < 0) {
+		free(list);
+		return err;
+	}
+
+	*jobs = list;
+	*count = n;
+	return 0;
+}
+
+/* like test_loopback(), but reporting errors instead of exiting */
+static int pair_loopback(struct pair_job *job)
+{
+	struct bat *bat = &job->bat;
+	pthread_t capture_id, playback_id;
+	int *result, err;
+
+	job->stage = "playback";
+	err = pthread_create(&playback_id, NULL,
+			(void *) bat->playback.fct, bat);
+	if (err != 0) {
+		fprintf(bat->err, _("Cannot create playback thread: %d\n"),
+				err);
+		return -err;
+	}
+
+	/* Let some time for playing something before capturing */
+	usleep(CAPTURE_DELAY * 1000);
+
+	job->stage = "capture";
+	err = pthread_create(&capture_id, NULL, (void *) bat->capture.fct, bat);
+	if (err != 0) {
+		fprintf(bat->err, _("Cannot create capture thread: %d\n"), err);
+		pthread_cancel(playback_id);
+		pthread_join(playback_id, NULL);
+		return -err;
+	}
+
+	/* wait for playback to complete */
+	job->stage = "playback";
+	err = pthread_join(playback_id, (void **) &result);
+	if (err == 0 && result != PTHREAD_CANCELED && *result != 0) {
+		fprintf(bat->err, _("Exit playback thread fail: %d\n"),
+				*result);
+		err = *result;
+	} else if (err != 0) {
+		fprintf(bat->err, _("Cannot join playback thread: %d\n"), err);
+		err = -err;
+	} else {
+		fprintf(bat->log, _("Playback completed.\n"));
+	}
+
+	/* now stop and wait for capture to finish */
+	pthread_cancel(capture_id);
+	if (pthread_join(capture_id, (void **) &result) != 0)
+		return err ? err : -EINVAL;
+	if (err != 0)
+		return err;
+
+	job->stage = "capture";
+	if (result == PTHREAD_CANCELED) {
+		fprintf(bat->log, _("Capture canceled.\n"));
+	} else if (*result != 0) {
+		fprintf(bat->err, _("Exit capture thread fail: %d\n"),
+				*result);
+		return *result;
+	} else {
+		fprintf(bat->log, _("Capture completed.\n"));
+	}
+
+	return 0;
+}
+
+static void *pair_worker(void *arg)
+{
+	struct pair_job *job = arg;
+#ifdef HAVE_LIBFFTW3F
+	struct bat *bat = &job->bat;
+	int err;
+#endif
+
+	job->err = pair_loopback(job);
+
+#ifdef HAVE_LIBFFTW3F
+	if (job->err == 0)
+		job->stage = "analysis";
+	if (bat->stream) {
+		err = stream_analyze_finish(bat);
+		if (job->err == 0)
+			job->err = err;
+	} else if (job->err == 0 && (!bat->standalone
+				|| snr_is_valid(bat->snr_thd_db))) {
+		job->err = analyze_capture(bat);
+	}
+#endif
+	if (job->err == 0)
+		job->stage = NULL;
+
+	return NULL;
+}
+
+static int pair_init(struct bat *bat, struct pair_job *job)
+{
+	char name[] = TEMP_RECORD_FILE_NAME;
+	int fd, err;
+
+	job->bat = *bat;
+	bat = &job->bat;
+	bat->playback.device = job->playback;
+	bat->capture.device = job->capture;
+	bat->playback.mode = MODE_LOOPBACK;
+	bat->capture.mode = MODE_LOOPBACK;
+	bat->capture.file = NULL;
+	bat->buf = NULL;
+	bat->stream = NULL;
+	job->stage = "setup";
+
+	bat->log = open_memstream(&job->log_buf, &job->log_len);
+	if (bat->log == NULL)
+		return -ENOMEM;
+	bat->err = bat->log;
+
+	/* private record file for each pair */
+	fd = mkstemp(name);
+	if (fd == -1) {
+		err = -errno;
+		fprintf(bat->err, _("Fail to create record file: %d\n"), err);
+		return err;
+	}
+	close(fd);
+	bat->capture.file = strdup(name);
+	if (bat->capture.file == NULL)
+		return -ENOMEM;
+
+#ifdef HAVE_LIBFFTW3F
+	if (bat->streaming)
+		return stream_analyze_init(bat);
+#endif
+	return 0;
+}
+
+static void pair_free(struct pair_job *job)
+{
+#ifdef HAVE_LIBFFTW3F
+	/* the worker finishes the analysis, unless it did not run */
+	stream_analyze_free(&job->bat);
+#endif
+	if (job->bat.log)
+		fclose(job->bat.log);
+	job->bat.log = job->bat.err = NULL;
+	if (job->bat.capture.file) {
+		remove(job->bat.capture.file);
+		free(job->bat.capture.file);
+		job->bat.capture.file = NULL;
+	}
+}
+
+static void json_string(FILE *fp, const char *s, size_t len)
+{
+	size_t i;
+	unsigned char ch;
+
+	fputc('"', fp);
+	for (i = 0; i < len; i++) {
+		ch = s[i];
+		if (ch == '"' || ch == '\\')
+			fprintf(fp, "\\%c", ch);
+		else if (ch == '\n')
+			fputs("\\n", fp);
+		else if (ch == '\t')
+			fputs("\\t", fp);
+		else if (ch < 0x20)
+			fprintf(fp, "\\u%04x", ch);
+		else
+			fputc(ch, fp);
+	}
+	fputc('"', fp);
+}
+
+static void write_report(struct bat *bat, FILE *fp, struct pair_job *jobs,
+		int count)
+{
+	struct pair_job *job;
+	struct channel_result *r;
+	int i, c, failed = 0;
+
+	for (i = 0; i < count; i++)
+		if (jobs[i].err != 0)
+			failed++;
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"version\": \"%s\",\n", PACKAGE_VERSION);
+	fprintf(fp, "  \"rate\": %u,\n", bat->rate);
+	fprintf(fp, "  \"channels\": %d,\n", bat->channels);
+	fprintf(fp, "  \"format\": \"%s\",\n",
+			bat->format >= 0 && bat->format < BAT_PCM_FORMAT_MAX
+			&& format_names[bat->format] ?
+			format_names[bat->format] : "unknown");
+	fprintf(fp, "  \"frames\": %lld,\n", bat->frames);
+	fprintf(fp, "  \"passed\": %d,\n", count - failed);
+	fprintf(fp, "  \"failed\": %d,\n", failed);
+	fprintf(fp, "  \"results\": [\n");
+	for (i = 0; i < count; i++) {
+		job = &jobs[i];
+		fprintf(fp, "    {\n      \"playback\": ");
+		json_string(fp, job->playback, strlen(job->playback));
+		fprintf(fp, ",\n      \"capture\": ");
+		json_string(fp, job->capture, strlen(job->capture));
+		fprintf(fp, ",\n      \"result\": \"%s\",\n",
+				job->err ? "fail" : "pass");
+		fprintf(fp, "      \"error\": %d,\n", job->err);
+		if (job->stage)
+			fprintf(fp, "      \"stage\": \"%s\",\n", job->stage);
+		fprintf(fp, "      \"channels\": [\n");
+		for (c = 0; c < bat->channels; c++) {
+			r = &job->bat.result[c];
+			fprintf(fp, "        { \"target_hz\": %.2f",
+					bat->target_freq[c]);
+			if (r->peak_hz > 0.0)
+				fprintf(fp, ", \"peak_hz\": %.2f", r->peak_hz);
+			else
+				fprintf(fp, ", \"peak_hz\": null");
+			if (snr_is_valid(r->snr_db))
+				fprintf(fp, ", \"snr_db\": %.2f", r->snr_db);
+			else
+				fprintf(fp, ", \"snr_db\": null");
+			if (bat->check_thdn && r->thdn_db != 0.0)
+				fprintf(fp, ", \"thdn_db\": %.2f", r->thdn_db);
+			fprintf(fp, " }%s\n", c + 1 < bat->channels ? "," : "");
+		}
+		fprintf(fp, "      ],\n      \"log\": ");
+		json_string(fp, job->log_buf ? job->log_buf : "",
+				job->log_buf ? job->log_len : 0);
+		fprintf(fp, "\n    }%s\n", i + 1 < count ? "," : "");
+	}
+	fprintf(fp, "  ]\n}\n");
+}
+
+/**
+ * Run the loopback test on all device pairs of bat->multi concurrently.
+ *
+ * @return 0 if all pairs passed, otherwise the error of the first pair
+ *         in the list which failed
+ */
+int run_multi(struct bat *bat)
+{
+	struct pair_job *jobs, *job;
+	FILE *fp = bat->log;
+	int i, count, err;
+
+	err = read_pairs(bat, &jobs, &count);
+	if (err < 0)
+		return err;
+
+	fprintf(bat->log, _("Testing %d device pairs\n"), count);
+
+	for (i = 0; i < count; i++) {
+		job = &jobs[i];
+		job->err = pair_init(bat, job);
+		if (job->err != 0)
+			continue;
+		job->started = pthread_create(&job->thread, NULL,
+				pair_worker, job) == 0;
+		if (!job->started) {
+			fprintf(job->bat.err, _("Cannot create thread\n"));
+			job->err = -EAGAIN;
+		}
+	}
+
+	err = 0;
+	for (i = 0; i < count; i++) {
+		job = &jobs[i];
+		if (job->started)
+			pthread_join(job->thread, NULL);
+		/* flush the log into log_buf */
+		if (job->bat.log)
+			fflush(job->bat.log);
+
+		fprintf(bat->log, _("\nDevice pair %d: %s -> %s\n"), i + 1,
+				job->playback, job->capture);
+		if (job->log_buf)
+			fwrite(job->log_buf, 1, job->log_len, bat->log);
+		fprintf(bat->log, _("Return value is %d\n"), job->err);
+		if (job->err != 0 && err == 0)
+			err = job->err;
+	}
+
+	if (bat->report) {
+		fp = fopen(bat->report, "w");
+		if (fp == NULL) {
+			fprintf(bat->err, _("Cannot open file: %s %d\n"),
+					bat->report, -errno);
+			fp = bat->log;
+		}
+	}
+	if (fp == bat->log)
+		fprintf(bat->log, "\n");
+	write_report(bat, fp, jobs, count);
+	if (fp != bat->log)
+		fclose(fp);
+
+	for (i = 0; i < count; i++) {
+		pair_free(&jobs[i]);
+		free(jobs[i].log_buf);
+	}
+	free(jobs);
+
+	return err;
+}
@@ -28,6 +28,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "gettext.h"
 #include "common.h"
@@ -78,47 +79,36 @@ float sin_generator_next_sample(struct sin_generator *sg)
 	return (float)sr;
 }
 
+/* pull the state back to the magnitude, against the drift of long runs */
+static void sin_generator_renormalize(struct sin_generator *sg)
+{
+	double r = hypot(sg->state_real, sg->state_imag);
+
+	if (r > 0.0) {
+		sg->state_real *= sg->magnitude / r;
+		sg->state_imag *= sg->magnitude / r;
+	}
+}
+
 /* fills a vector with a sine wave */
 void sin_generator_vfill(struct sin_generator *sg, float *buf, int n)
 {
 	int i;
 	for (i = 0; i < n; i++)
 		*buf++ = sin_generator_next_sample(sg);
+	sin_generator_renormalize(sg);
 }
 
-static int reorder(struct bat *bat, float *val, int frames)
+/* scale and offset from [-1, 1] to the range of the sample format */
+static int waveform_scale(struct bat *bat, float *factor, float *offset)
 {
-	float *new_buf = NULL;
-	int i, c, bytes;
-
-	bytes = frames * bat->channels * sizeof(float);
-
-	new_buf = (float *) malloc(bytes);
-	if (new_buf == NULL) {
-		fprintf(bat->err, _("Not enough memory.\n"));
-		return -ENOMEM;
-	}
-
-	memcpy(new_buf, val, bytes);
-	for (i = 0; i < frames; i++)
-		for (c = 0; c < bat->channels; c++)
-			val[i * bat->channels + c] =
-				new_buf[c * frames + i];
-	free(new_buf);
-
-	return 0;
-}
-
-static int adjust_waveform(struct bat *bat, float *val, int frames,
-		int channels)
-{
-	int i, nsamples, max;
-	float factor, offset = 0.0;
+	int max;
 
+	*offset = 0.0;
 	switch (bat->format) {
 	case BAT_PCM_FORMAT_U8:
 		max = INT8_MAX;
-		offset = max;	/* shift for unsigned format */
+		*offset = max;	/* shift for unsigned format */
 		break;
 	case BAT_PCM_FORMAT_S16_LE:
 		max  = INT16_MAX;
@@ -134,54 +124,245 @@ static int adjust_waveform(struct bat *bat, float *val, int frames,
 		return -EINVAL;
 	}
 
-	factor = max * RANGE_FACTOR;
-	nsamples = channels * frames;
+	*factor = max * RANGE_FACTOR;
+	return 0;
+}
+
+static int adjust_waveform(struct bat *bat, float *val, int frames,
+		int channels)
+{
+	int i, nsamples, err;
+	float factor, offset;
 
+	err = waveform_scale(bat, &factor, &offset);
+	if (err < 0)
+		return err;
+
+	nsamples = channels * frames;
 	for (i = 0; i < nsamples; i++)
 		val[i] = val[i] * factor + offset;
 
 	return 0;
 }
 
-int generate_sine_wave(struct bat *bat, int frames, void *buf)
+/* one period converted to the sample format, or NULL on failure */
+static void *convert_period(struct bat *bat, const float *period, int n)
 {
-	int err = 0;
-	int c, nsamples;
-	float *sinus_f = NULL;
-	static struct sin_generator sg[MAX_CHANNELS];
+	float *val;
+	void *raw;
 
-	nsamples = bat->channels * frames;
-	sinus_f = (float *) malloc(nsamples * sizeof(float));
-	if (sinus_f == NULL) {
-		fprintf(bat->err, _("Not enough memory.\n"));
-		return -ENOMEM;
+	val = malloc(sizeof(float) * n);
+	raw = malloc((size_t) n * bat->sample_size);
+	if (val == NULL || raw == NULL)
+		goto err;
+
+	memcpy(val, period, sizeof(float) * n);
+	if (adjust_waveform(bat, val, n, 1) < 0)
+		goto err;
+	bat->convert_float_to_sample(val, raw, n, 1);
+
+	free(val);
+	return raw;
+err:
+	free(raw);
+	free(val);
+	return NULL;
+}
+
+/* copy frames of one channel from a period table, size is constant once
+ * inlined in copy_channel() */
+static inline void copy_period(char *dst, int stride, const char *src,
+		int size, int period, int *pos, int frames)
+{
+	int i, p = *pos;
+
+	for (i = 0; i < frames; i++) {
+		memcpy(dst, src + p * size, size);
+		dst += stride;
+		if (++p == period)
+			p = 0;
+	}
+	*pos = p;
+}
+
+/* write channel c of frames interleaved frames from a period table in the
+ * sample format, starting at *pos */
+static void copy_channel(struct bat *bat, void *buf, int c, int frames,
+		const void *table, int period, int *pos)
+{
+	char *dst = (char *) buf + c * bat->sample_size;
+	int n;
+
+	/* mono: whole runs of the table */
+	if (bat->channels == 1) {
+		while (frames > 0) {
+			n = period - *pos < frames ? period - *pos : frames;
+			memcpy(dst, (const char *) table
+					+ *pos * bat->sample_size,
+					n * bat->sample_size);
+			dst += n * bat->sample_size;
+			frames -= n;
+			*pos = (*pos + n) % period;
+		}
+		return;
 	}
 
+	switch (bat->sample_size) {
+	case 1:
+		copy_period(dst, bat->frame_size, table, 1, period, pos, frames);
+		break;
+	case 2:
+		copy_period(dst, bat->frame_size, table, 2, period, pos, frames);
+		break;
+	case 3:
+		copy_period(dst, bat->frame_size, table, 3, period, pos, frames);
+		break;
+	default:
+		copy_period(dst, bat->frame_size, table, 4, period, pos, frames);
+		break;
+	}
+}
+
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+	unsigned int t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/*
+ * A tone of an integer frequency repeats exactly after rate / gcd(rate,
+ * frequency) frames, at most one second. That period is computed once in
+ * the sample format and shared by all tests of the run, so playing the
+ * tone is a copy. Other frequencies are made by the phasor recurrence.
+ */
+struct tone_table {
+	float frequency;
+	unsigned int rate;
+	enum _bat_pcm_format format;
+	int period;
+	void *samples;			/* in the sample format */
+	struct tone_table *next;
+};
+
+static struct tone_table *tone_tables;
+static pthread_mutex_t tone_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const void *get_tone_table(struct bat *bat, float freq, int *period)
+{
+	struct tone_table *t;
+	unsigned int f, g, k;
+	float *val;
+	int i, n;
+
+	if (freq != floorf(freq) || freq < 1.0 || freq >= bat->rate / 2)
+		return NULL;
+	f = freq;
+	g = gcd(bat->rate, f);
+	n = bat->rate / g;
+	k = f / g;
+	if (n > MAX_TONE_TABLE)
+		return NULL;
+
+	pthread_mutex_lock(&tone_table_lock);
+	for (t = tone_tables; t; t = t->next)
+		if (t->frequency == freq && t->rate == bat->rate
+				&& t->format == bat->format)
+			goto out;
+
+	t = malloc(sizeof(*t));
+	val = malloc(sizeof(float) * n);
+	if (t == NULL || val == NULL)
+		goto err;
+
+	/* same waveform as the phasor, which starts at 0 going down */
+	for (i = 0; i < n; i++)
+		val[i] = -sin(2.0 * M_PI * ((unsigned long long) k * i % n)
+				/ n);
+	t->samples = convert_period(bat, val, n);
+	if (t->samples == NULL)
+		goto err;
+	free(val);
+
+	t->frequency = freq;
+	t->rate = bat->rate;
+	t->format = bat->format;
+	t->period = n;
+	t->next = tone_tables;
+	tone_tables = t;
+out:
+	pthread_mutex_unlock(&tone_table_lock);
+	*period = t->period;
+	return t->samples;
+err:
+	pthread_mutex_unlock(&tone_table_lock);
+	free(val);
+	free(t);
+	return NULL;
+}
+
+/**
+ * Generate frames of the sine wave of each channel directly interleaved
+ * in the sample format: from the period table of the tone when there is
+ * one, else by the phasor of the channel, a chunk at a time through the
+ * format conversion.
+ */
+int generate_sine_wave(struct bat *bat, int frames, void *buf)
+{
+	float val[GEN_CHUNK_FRAMES * MAX_CHANNELS];
+	const void *table[MAX_CHANNELS];
+	int period[MAX_CHANNELS];
+	struct sin_generator *sg = bat->sg;
+	float factor, offset, *v;
+	int c, i, n, done, phasors = 0, err;
+
+	err = waveform_scale(bat, &factor, &offset);
+	if (err < 0)
+		return err;
+
 	for (c = 0; c < bat->channels; c++) {
 		/* initialize static struct at the first time */
-		if (sg[c].frequency != bat->target_freq[c])
+		if (sg[c].frequency != bat->target_freq[c]) {
 			sin_generator_init(&sg[c], 1.0, bat->target_freq[c],
 					bat->rate);
-		/* fill buffer for each channel */
-		sin_generator_vfill(&sg[c], sinus_f + c * frames, frames);
+			sg[c].pos = 0;
+		}
+		table[c] = get_tone_table(bat, bat->target_freq[c],
+				&period[c]);
+		if (table[c] == NULL)
+			phasors++;
 	}
 
-	/* reorder samples to interleaved mode */
-	err = reorder(bat, sinus_f, frames);
-	if (err != 0)
-		goto exit;
-
-	/* adjust amplitude and offset of waveform */
-	err = adjust_waveform(bat, sinus_f, frames, bat->channels);
-	if (err != 0)
-		goto exit;
-
-	bat->convert_float_to_sample(sinus_f, buf, frames, bat->channels);
+	for (done = 0; phasors && done < frames; done += n) {
+		n = frames - done < GEN_CHUNK_FRAMES ?
+			frames - done : GEN_CHUNK_FRAMES;
+		for (c = 0; c < bat->channels; c++) {
+			v = val + c;
+			if (table[c] != NULL) {
+				for (i = 0; i < n; i++, v += bat->channels)
+					*v = offset;
+				continue;
+			}
+			for (i = 0; i < n; i++, v += bat->channels)
+				*v = sin_generator_next_sample(&sg[c]) * factor
+					+ offset;
+			sin_generator_renormalize(&sg[c]);
+		}
+		bat->convert_float_to_sample(val, (char *) buf
+				+ done * bat->frame_size, n, bat->channels);
+	}
 
-exit:
-	free(sinus_f);
+	for (c = 0; c < bat->channels; c++)
+		if (table[c] != NULL)
+			copy_channel(bat, buf, c, frames, table[c], period[c],
+					&sg[c].pos);
 
-	return err;
+	return 0;
 }
 
 /* generate single channel sine waveform without sample conversion */
@@ -201,3 +382,222 @@ int generate_sine_wave_raw_mono(struct bat *bat, float *buf,
 
 	return err;
 }
+
+/* generate single channel linear chirp from f0 to f1 Hz without sample
+ * conversion, faded in and out over fade samples to limit the splatter */
+int generate_chirp_raw_mono(struct bat *bat, float *buf, float f0, float f1,
+		int nsamples, int fade)
+{
+	double t, T = (double) nsamples / bat->rate;
+	int i;
+
+	if (nsamples <= 2 * fade)
+		return -EINVAL;
+
+	for (i = 0; i < nsamples; i++) {
+		t = (double) i / bat->rate;
+		buf[i] = sin(2.0 * M_PI
+				* (f0 * t + (f1 - f0) * t * t / (2.0 * T)));
+		if (i < fade)
+			buf[i] *= 0.5 - 0.5 * cos(M_PI * i / fade);
+		else if (i >= nsamples - fade)
+			buf[i] *= 0.5 - 0.5 * cos(M_PI * (nsamples - 1 - i)
+					/ fade);
+	}
+
+	/* adjust amplitude and offset of waveform */
+	return adjust_waveform(bat, buf, nsamples, 1);
+}
+
+/* Multitone and sweep signals are periodic, so one period is computed and
+ * shared by all tests of the run. The period is a power of two frames, so
+ * the power of two analysis window always holds whole periods. */
+struct signal_table {
+	enum _bat_signal type;
+	unsigned int rate;
+	enum _bat_pcm_format format;
+	int period;
+	float *samples;
+	void *raw;			/* samples in the sample format */
+	struct signal_table *next;
+};
+
+static struct signal_table *signal_tables;
+static pthread_mutex_t signal_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* third octave band centers covered by the multitone and sweep signals */
+int response_frequencies(struct bat *bat, float *freq)
+{
+	float f, high = bat->rate * RATE_FACTOR;
+	int k, n = 0;
+
+	for (k = RESPONSE_BAND_MIN; n < MAX_TONES; k++) {
+		f = 1000.0 * powf(2.0, k / 3.0);
+		if (f > high)
+			break;
+		freq[n++] = f;
+	}
+
+	return n;
+}
+
+int signal_period(struct bat *bat)
+{
+	int period = MIN_BUFFERSIZE;
+
+	while (period * 2 <= bat->rate / 2)
+		period *= 2;
+
+	return period;
+}
+
+/* logarithmic sweep from SWEEP_LOW to the highest usable frequency, the
+ * rate of change is scaled so that a period ends on a whole cycle */
+static void fill_sweep(struct bat *bat, float *buf, int period)
+{
+	double f1 = SWEEP_LOW, f2 = bat->rate * RATE_FACTOR;
+	double T = (double) period / bat->rate, L = log(f2 / f1);
+	double cycles = f1 * T * (f2 / f1 - 1.0) / L;
+	double scale = round(cycles) / cycles, t;
+	int i;
+
+	for (i = 0; i < period; i++) {
+		t = (double) i / bat->rate;
+		buf[i] = sin(2.0 * M_PI * scale * f1 * T / L
+				* (exp(t / T * L) - 1.0));
+	}
+}
+
+/* one tone per band on the nearest period bin, with Schroeder phases to
+ * keep the crest factor low, normalized to full scale */
+static void fill_multitone(struct bat *bat, float *buf, int period)
+{
+	float freq[MAX_TONES], max = 0.0;
+	int bins[MAX_TONES];
+	int i, k, n, m = 0, bin, last = 0;
+	double phase;
+
+	n = response_frequencies(bat, freq);
+	for (k = 0; k < n; k++) {
+		bin = lrintf(freq[k] * period / bat->rate);
+		if (bin <= last)
+			continue;
+		bins[m++] = last = bin;
+	}
+
+	memset(buf, 0, sizeof(float) * period);
+	for (k = 0; k < m; k++) {
+		phase = -M_PI * k * (k - 1) / m;
+		for (i = 0; i < period; i++)
+			buf[i] += sin(2.0 * M_PI * ((long long) bins[k] * i
+					% period) / period + phase);
+	}
+
+	for (i = 0; i < period; i++)
+		if (fabsf(buf[i]) > max)
+			max = fabsf(buf[i]);
+	for (i = 0; i < period && max > 0.0; i++)
+		buf[i] /= max;
+}
+
+static struct signal_table *find_signal_table(struct bat *bat)
+{
+	struct signal_table *t;
+
+	pthread_mutex_lock(&signal_table_lock);
+	for (t = signal_tables; t; t = t->next)
+		if (t->type == bat->signal && t->rate == bat->rate
+				&& t->format == bat->format)
+			goto out;
+
+	t = malloc(sizeof(*t));
+	if (t == NULL)
+		goto out;
+	t->type = bat->signal;
+	t->rate = bat->rate;
+	t->format = bat->format;
+	t->period = signal_period(bat);
+	t->raw = NULL;
+	t->samples = malloc(sizeof(float) * t->period);
+	if (t->samples == NULL)
+		goto err;
+	if (t->type == SIGNAL_SWEEP)
+		fill_sweep(bat, t->samples, t->period);
+	else
+		fill_multitone(bat, t->samples, t->period);
+	t->raw = convert_period(bat, t->samples, t->period);
+	if (t->raw == NULL)
+		goto err;
+	t->next = signal_tables;
+	signal_tables = t;
+out:
+	pthread_mutex_unlock(&signal_table_lock);
+	return t;
+err:
+	pthread_mutex_unlock(&signal_table_lock);
+	free(t->samples);
+	free(t);
+	return NULL;
+}
+
+/* one period of the multitone or sweep signal, in the range [-1, 1] */
+const float *get_signal_table(struct bat *bat, int *period)
+{
+	struct signal_table *t = find_signal_table(bat);
+
+	if (t == NULL)
+		return NULL;
+	*period = t->period;
+	return t->samples;
+}
+
+/* release the cached tone and signal tables at exit */
+void signal_cleanup(void)
+{
+	struct tone_table *t;
+	struct signal_table *s;
+
+	pthread_mutex_lock(&tone_table_lock);
+	while (tone_tables) {
+		t = tone_tables;
+		tone_tables = t->next;
+		free(t->samples);
+		free(t);
+	}
+	pthread_mutex_unlock(&tone_table_lock);
+
+	pthread_mutex_lock(&signal_table_lock);
+	while (signal_tables) {
+		s = signal_tables;
+		signal_tables = s->next;
+		free(s->raw);
+		free(s->samples);
+		free(s);
+	}
+	pthread_mutex_unlock(&signal_table_lock);
+}
+
+/* generate the playback signal selected with --signal */
+int generate_signal(struct bat *bat, int frames, void *buf)
+{
+	struct signal_table *t;
+	int c, pos = bat->signal_pos;
+
+	if (bat->signal == SIGNAL_SINE)
+		return generate_sine_wave(bat, frames, buf);
+
+	t = find_signal_table(bat);
+	if (t == NULL) {
+		fprintf(bat->err, _("Not enough memory.\n"));
+		return -ENOMEM;
+	}
+
+	/* same signal on all channels */
+	for (c = 0; c < bat->channels; c++) {
+		pos = bat->signal_pos;
+		copy_channel(bat, buf, c, frames, t->raw, t->period, &pos);
+	}
+	bat->signal_pos = pos;
+
+	return 0;
+}
@@ -289,28 +289,28 @@ void *playback_tinyalsa(struct bat *bat)
 
 	fprintf(bat->log, _("Entering playback thread (tinyalsa).\n"));
 
-	retval_play = 0;
+	bat->retval_play = 0;
 
 	/* init device */
 	err = get_tiny_device(bat, bat->playback.device,
 			&bat->playback.card_tiny,
 			&bat->playback.device_tiny);
 	if (err < 0) {
-		retval_play = err;
+		bat->retval_play = err;
 		goto exit1;
 	}
 
 	/* init config */
 	err = init_config(bat, &config);
 	if (err < 0) {
-		retval_play = err;
+		bat->retval_play = err;
 		goto exit1;
 	}
 
 	/* check param before open device */
 	err = check_playback_params(bat, &config);
 	if (err < 0) {
-		retval_play = err;
+		bat->retval_play = err;
 		goto exit1;
 	}
 
@@ -320,7 +320,7 @@ void *playback_tinyalsa(struct bat *bat)
 	if (!pcm || !pcm_is_ready(pcm)) {
 		fprintf(bat->err, _("Unable to open PCM device %u (%s)!\n"),
 				bat->playback.device_tiny, pcm_get_error(pcm));
-		retval_play = -EINVAL;
+		bat->retval_play = -EINVAL;
 		goto exit1;
 	}
 
@@ -328,7 +328,7 @@ void *playback_tinyalsa(struct bat *bat)
 	bufbytes = pcm_frames_to_bytes(pcm, pcm_get_buffer_size(pcm));
 	buffer = malloc(bufbytes);
 	if (!buffer) {
-		retval_play = -ENOMEM;
+		bat->retval_play = -ENOMEM;
 		goto exit2;
 	}
 
@@ -346,13 +346,13 @@ void *playback_tinyalsa(struct bat *bat)
 		if (bat->fp == NULL) {
 			fprintf(bat->err, _("Cannot open file: %s %d\n"),
 					bat->playback.file, err);
-			retval_play = err;
+			bat->retval_play = err;
 			goto exit3;
 		}
 		/* Skip header */
 		err = read_wav_header(bat, bat->playback.file, bat->fp, true);
 		if (err != 0) {
-			retval_play = err;
+			bat->retval_play = err;
 			goto exit4;
 		}
 	}
@@ -362,7 +362,7 @@ void *playback_tinyalsa(struct bat *bat)
 	else
 		err = play_sample(bat, pcm, buffer, bufbytes);
 	if (err < 0) {
-		retval_play = err;
+		bat->retval_play = err;
 		goto exit4;
 	}
 
@@ -374,7 +374,7 @@ exit3:
 exit2:
 	pcm_close(pcm);
 exit1:
-	pthread_exit(&retval_play);
+	pthread_exit(&bat->retval_play);
 }
 
 /**
@@ -487,21 +487,21 @@ void *record_tinyalsa(struct bat *bat)
 
 	fprintf(bat->log, _("Entering capture thread (tinyalsa).\n"));
 
-	retval_record = 0;
+	bat->retval_record = 0;
 
 	/* init device */
 	err = get_tiny_device(bat, bat->capture.device,
 			&bat->capture.card_tiny,
 			&bat->capture.device_tiny);
 	if (err < 0) {
-		retval_record = err;
+		bat->retval_record = err;
 		goto exit1;
 	}
 
 	/* init config */
 	err = init_config(bat, &config);
 	if (err < 0) {
-		retval_record = err;
+		bat->retval_record = err;
 		goto exit1;
 	}
 
@@ -511,7 +511,7 @@ void *record_tinyalsa(struct bat *bat)
 	if (!pcm || !pcm_is_ready(pcm)) {
 		fprintf(bat->err, _("Unable to open PCM device (%s)!\n"),
 				pcm_get_error(pcm));
-		retval_record = -EINVAL;
+		bat->retval_record = -EINVAL;
 		goto exit1;
 	}
 
@@ -519,7 +519,7 @@ void *record_tinyalsa(struct bat *bat)
 	bufbytes = pcm_frames_to_bytes(pcm, pcm_get_buffer_size(pcm));
 	buffer = malloc(bufbytes);
 	if (!buffer) {
-		retval_record = -ENOMEM;
+		bat->retval_record = -ENOMEM;
 		goto exit2;
 	}
 
@@ -534,7 +534,7 @@ void *record_tinyalsa(struct bat *bat)
 	else
 		err = capture_sample(bat, pcm, buffer, bufbytes);
 	if (err != 0) {
-		retval_record = err;
+		bat->retval_record = err;
 		goto exit3;
 	}
 
@@ -543,12 +543,12 @@ void *record_tinyalsa(struct bat *bat)
 	 *  by end of play thread. Except in single line mode. */
 	pthread_cleanup_pop(0);
 	pthread_cleanup_pop(0);
-	pthread_exit(&retval_record);
+	pthread_exit(&bat->retval_record);
 
 exit3:
 	free(buffer);
 exit2:
 	pcm_close(pcm);
 exit1:
-	pthread_exit(&retval_record);
+	pthread_exit(&bat->retval_record);
 }